@@ -55,6 +55,18 @@ VERSION HISTORY:
 
 #include "base64.h"
 
+#include <atomic>
+#include <cstdint>
+
+/*
+ * The vectorized kernels are only worth it when their intrinsics get
+ * inlined; unoptimized builds are faster with the scalar code alone.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__OPTIMIZE__)
+#define NP1SEC_BASE64_X86
+#include <immintrin.h>
+#endif
+
 namespace np1sec
 {
 
@@ -64,9 +76,26 @@ namespace np1sec
 static const char cb64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 /*
-** Translation Table to decode (created by author)
+** Reverse translation table; 0xff marks characters outside the alphabet.
 */
-static const char cd64[] = "|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
+static const unsigned char cd64[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
 
 /*
 ** encodeblock
@@ -88,98 +117,335 @@ static void encodeblock(char* out, const unsigned char* in, size_t len)
 }
 
 /*
- * base64 encode data.  Insert no linebreaks or whitespace.
- *
- * The buffer base64data must contain at least ((datalen+2)/3)*4 bytes of
- * space.  This function will return the number of bytes actually used.
+ * Decode one unpadded quantum of 4 characters into 3 bytes.
+ * Returns false if any character is outside the alphabet.
  */
-size_t base64_encode(char* base64data, const unsigned char* data, size_t datalen)
+static bool decodeblock(unsigned char* out, const char* in)
 {
-	size_t base64len = 0;
-	
-	while (datalen > 2) {
-		encodeblock(base64data, data, 3);
-		base64data += 4;
-		base64len += 4;
-		data += 3;
-		datalen -= 3;
+	unsigned char in0 = cd64[(unsigned char)in[0]];
+	unsigned char in1 = cd64[(unsigned char)in[1]];
+	unsigned char in2 = cd64[(unsigned char)in[2]];
+	unsigned char in3 = cd64[(unsigned char)in[3]];
+	if ((in0 | in1 | in2 | in3) & 0x80) {
+		return false;
 	}
-	if (datalen > 0) {
-		encodeblock(base64data, data, datalen);
-		base64len += 4;
+	
+	out[0] = (in0 << 2) | (in1 >> 4);
+	out[1] = (in1 << 4) | (in2 >> 2);
+	out[2] = (in2 << 6) | in3;
+	return true;
+}
+
+/*
+ * The vectorized kernels below only ever process whole blocks. They return
+ * the number of input bytes they consumed and leave the remainder, including
+ * the final padded quantum, to the scalar code. The decoders stop at the
+ * first block containing a character outside the alphabet, so that the
+ * scalar code is the one deciding to reject the input.
+ */
+struct Base64Kernels
+{
+	Base64Implementation implementation;
+	size_t (*encode_blocks)(char* out, const unsigned char* in, size_t len);
+	size_t (*decode_blocks)(unsigned char* out, const char* in, size_t len);
+};
+
+static size_t encode_blocks_scalar(char*, const unsigned char*, size_t)
+{
+	return 0;
+}
+
+static size_t decode_blocks_scalar(unsigned char*, const char*, size_t)
+{
+	return 0;
+}
+
+#ifdef NP1SEC_BASE64_X86
+
+/*
+ * SSE2 has no byte shuffle, so this kernel assembles each 24-bit group with
+ * scalar loads and uses vector arithmetic for the bit extraction and the
+ * alphabet translation, which is where the scalar code spends its time.
+ * Decoding the same way is slower than the scalar table lookups, so the
+ * SSE2 implementation only vectorizes the encoder.
+ */
+__attribute__((target("sse2")))
+static inline __m128i translate_sse2(__m128i indices)
+{
+	__m128i result = _mm_add_epi8(indices, _mm_set1_epi8('A'));
+	result = _mm_add_epi8(result, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(25)), _mm_set1_epi8(('a' - 26) - 'A')));
+	result = _mm_add_epi8(result, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(51)), _mm_set1_epi8(('0' - 52) - ('a' - 26))));
+	result = _mm_add_epi8(result, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(62)), _mm_set1_epi8(('+' - 62) - ('0' - 52))));
+	result = _mm_add_epi8(result, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(63)), _mm_set1_epi8(('/' - 63) - ('0' - 52))));
+	return result;
+}
+
+__attribute__((target("sse2")))
+static size_t encode_blocks_sse2(char* out, const unsigned char* in, size_t len)
+{
+	const __m128i mask = _mm_set1_epi32(0x3f);
+	size_t consumed = 0;
+	while (len - consumed >= 12) {
+		const unsigned char* p = in + consumed;
+		__m128i groups = _mm_setr_epi32(
+			(p[0] << 16) | (p[1] << 8) | p[2],
+			(p[3] << 16) | (p[4] << 8) | p[5],
+			(p[6] << 16) | (p[7] << 8) | p[8],
+			(p[9] << 16) | (p[10] << 8) | p[11]
+		);
+		__m128i indices = _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(_mm_srli_epi32(groups, 18), mask),
+				_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(groups, 12), mask), 8)
+			),
+			_mm_or_si128(
+				_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(groups, 6), mask), 16),
+				_mm_slli_epi32(_mm_and_si128(groups, mask), 24)
+			)
+		);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), translate_sse2(indices));
+		consumed += 12;
+		out += 16;
 	}
+	return consumed;
+}
+
+/*
+ * The AVX2 kernels follow Wojciech Muła's vectorized base64 algorithms:
+ * in-lane byte shuffles place each 3-byte group into a 32-bit lane, and
+ * multiplies do the 6-bit field shifts.
+ */
+__attribute__((target("avx2")))
+static size_t encode_blocks_avx2(char* out, const unsigned char* in, size_t len)
+{
+	const __m256i shuffle = _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+	);
+	const __m256i shift_lut = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+	);
 	
-	return base64len;
+	size_t consumed = 0;
+	/* Each iteration uses 24 bytes, but the second load reads up to byte 28. */
+	while (len - consumed >= 32) {
+		const unsigned char* p = in + consumed;
+		__m256i data = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)),
+			1
+		);
+		data = _mm256_shuffle_epi8(data, shuffle);
+		__m256i t0 = _mm256_and_si256(data, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(data, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t1, t3);
+		
+		__m256i lut_index = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		lut_index = _mm256_or_si256(lut_index, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		__m256i result = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, lut_index), indices);
+		
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), result);
+		consumed += 24;
+		out += 32;
+	}
+	return consumed;
 }
 
-static size_t decode(unsigned char* out, const char* in, size_t b64len)
+__attribute__((target("avx2")))
+static size_t decode_blocks_avx2(unsigned char* out, const char* in, size_t len)
 {
-	size_t written = 0;
-	unsigned char c = 0;
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+	);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+	);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+	);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+	);
 	
-	if (b64len > 0) {
-		c = in[0] << 2;
+	size_t consumed = 0;
+	/*
+	 * Each iteration writes 32 bytes of which only 24 are decoded output;
+	 * the 12 extra bytes of input guarantee the output buffer has room.
+	 */
+	while (len - consumed >= 44) {
+		__m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + consumed));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(chars, 4), mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(chars, mask_2f);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) {
+			break;
+		}
+		__m256i eq_2f = _mm256_cmpeq_epi8(chars, mask_2f);
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+		__m256i values = _mm256_add_epi8(chars, roll);
+		
+		__m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i groups = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		groups = _mm256_shuffle_epi8(groups, pack);
+		groups = _mm256_permutevar8x32_epi32(groups, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), groups);
+		consumed += 32;
+		out += 24;
+	}
+	return consumed;
+}
+
+#endif
+
+static const Base64Kernels scalar_kernels = { Base64Implementation::Scalar, encode_blocks_scalar, decode_blocks_scalar };
+#ifdef NP1SEC_BASE64_X86
+static const Base64Kernels sse2_kernels = { Base64Implementation::SSE2, encode_blocks_sse2, decode_blocks_scalar };
+static const Base64Kernels avx2_kernels = { Base64Implementation::AVX2, encode_blocks_avx2, decode_blocks_avx2 };
+#endif
+
+bool base64_implementation_supported(Base64Implementation implementation)
+{
+	switch (implementation) {
+		case Base64Implementation::Scalar:
+			return true;
+#ifdef NP1SEC_BASE64_X86
+		case Base64Implementation::SSE2:
+			return __builtin_cpu_supports("sse2");
+		case Base64Implementation::AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+		default:
+			return false;
 	}
-	if (b64len > 1) {
-		out[0] = c | in[1] >> 4;
-		written = 1;
-		c = in[1] << 4;
+}
+
+static const Base64Kernels* kernels_for(Base64Implementation implementation)
+{
+	switch (implementation) {
+#ifdef NP1SEC_BASE64_X86
+		case Base64Implementation::SSE2:
+			return &sse2_kernels;
+		case Base64Implementation::AVX2:
+			return &avx2_kernels;
+#endif
+		default:
+			return &scalar_kernels;
 	}
-	if (b64len > 2) {
-		out[1] = c | in[2] >> 2;
-		written = 2;
-		c = in[2] << 6;
+}
+
+static const Base64Kernels* detect_kernels()
+{
+	if (base64_implementation_supported(Base64Implementation::AVX2)) {
+		return kernels_for(Base64Implementation::AVX2);
 	}
-	if (b64len > 3) {
-		out[2] = c | in[3];
-		written = 3;
+	if (base64_implementation_supported(Base64Implementation::SSE2)) {
+		return kernels_for(Base64Implementation::SSE2);
 	}
-	return written;
+	return kernels_for(Base64Implementation::Scalar);
 }
 
-/*
- * base64 decode data.  Skip non-base64 chars, and terminate at the
- * first '=', or the end of the buffer.
- *
- * The buffer data must contain at least ((base64len+3) / 4) * 3 bytes
- * of space.  This function will return the number of bytes actually
- * used.
- */
-size_t base64_decode(unsigned char* data, const char* base64data, size_t base64len)
+static std::atomic<const Base64Kernels*>& selected_kernels()
+{
+	static std::atomic<const Base64Kernels*> kernels(detect_kernels());
+	return kernels;
+}
+
+Base64Implementation base64_implementation()
+{
+	return selected_kernels().load(std::memory_order_relaxed)->implementation;
+}
+
+void debug_set_base64_implementation(Base64Implementation implementation)
+{
+	if (base64_implementation_supported(implementation)) {
+		selected_kernels().store(kernels_for(implementation), std::memory_order_relaxed);
+	}
+}
+
+void base64_encode(std::string* base64data, const unsigned char* data, size_t datalen)
 {
-	size_t datalen = 0;
-	char b64[4];
-	size_t b64accum = 0;
+	size_t offset = base64data->size();
+	base64data->resize(offset + base64_encoded_size(datalen));
+	char* out = &(*base64data)[offset];
 	
-	while (base64len > 0) {
-		char b = *base64data;
-		unsigned char bdecode;
-		++base64data;
-		--base64len;
-		if (b < '+' || b > 'z')
-			continue; /* Skip non-base64 chars */
-		if (b == '=') {
-			/* Force termination */
-			datalen += decode(data, b64, b64accum);
-			base64len = 0;
-		} else {
-			bdecode = cd64[b - '+'];
-			if (bdecode == '$')
-				continue; /* Skip non-base64 chars */
-			b64[b64accum++] = bdecode - '>';
-			if (b64accum == 4) {
-				/* We have a complete block; decode it. */
-				size_t written = decode(data, b64, b64accum);
-				data += written;
-				datalen += written;
-				b64accum = 0;
-			}
+	size_t consumed = selected_kernels().load(std::memory_order_relaxed)->encode_blocks(out, data, datalen);
+	out += consumed / 3 * 4;
+	data += consumed;
+	datalen -= consumed;
+	
+	while (datalen > 2) {
+		encodeblock(out, data, 3);
+		out += 4;
+		data += 3;
+		datalen -= 3;
+	}
+	if (datalen > 0) {
+		encodeblock(out, data, datalen);
+	}
+}
+
+bool base64_decode(std::string* data, const char* base64data, size_t base64len)
+{
+	if (base64len % 4 != 0) {
+		return false;
+	}
+	data->resize(base64len / 4 * 3);
+	if (base64len == 0) {
+		return true;
+	}
+	unsigned char* out = reinterpret_cast<unsigned char*>(&(*data)[0]);
+	
+	/* Everything but the final quantum is unpadded. */
+	size_t body = base64len - 4;
+	size_t consumed = selected_kernels().load(std::memory_order_relaxed)->decode_blocks(out, base64data, body);
+	out += consumed / 4 * 3;
+	for (size_t i = consumed; i < body; i += 4) {
+		if (!decodeblock(out, base64data + i)) {
+			return false;
 		}
+		out += 3;
+	}
+	
+	const char* last = base64data + body;
+	if (last[3] != '=') {
+		return decodeblock(out, last);
 	}
 	
-	/* Just discard any short block at the end. */
+	unsigned char in0 = cd64[(unsigned char)last[0]];
+	unsigned char in1 = cd64[(unsigned char)last[1]];
+	if ((in0 | in1) & 0x80) {
+		return false;
+	}
+	out[0] = (in0 << 2) | (in1 >> 4);
 	
-	return datalen;
+	if (last[2] == '=') {
+		if (in1 & 0x0f) {
+			return false;
+		}
+		data->resize(data->size() - 2);
+		return true;
+	}
+	
+	unsigned char in2 = cd64[(unsigned char)last[2]];
+	if ((in2 & 0x80) || (in2 & 0x03)) {
+		return false;
+	}
+	out[1] = (in1 << 4) | (in2 >> 2);
+	data->resize(data->size() - 1);
+	return true;
 }
 
 } // namespace np1sec
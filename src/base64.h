@@ -20,27 +20,44 @@
 #define SRC_BASE64_H_
 
 #include <cstddef>
+#include <string>
 
 namespace np1sec
 {
 
 /*
- * base64 encode data.  Insert no linebreaks or whitespace.
+ * base64 encode data, appending the result to *base64data.  Insert no
+ * linebreaks or whitespace.
  *
- * The buffer base64data must contain at least ((datalen+2)/3)*4 bytes of
- * space.  This function will return the number of bytes actually used.
+ * The output grows by exactly base64_encoded_size(datalen) bytes.
  */
-size_t base64_encode(char* base64data, const unsigned char* data, size_t datalen);
+void base64_encode(std::string* base64data, const unsigned char* data, size_t datalen);
 
 /*
- * base64 decode data.  Skip non-base64 chars, and terminate at the
- * first '=', or the end of the buffer.
+ * base64 decode data into *data, replacing its contents.
  *
- * The buffer data must contain at least ((base64len+3) / 4) * 3 bytes
- * of space.  This function will return the number of bytes actually
- * used.
+ * The input must be canonical padded base64: a multiple of four characters
+ * from the RFC 4648 alphabet, with at most two trailing '=' characters and
+ * no stray bits set in the final quantum. Anything else is rejected, in which
+ * case this function returns false and the contents of *data are undefined.
  */
-size_t base64_decode(unsigned char* data, const char* base64data, size_t base64len);
+bool base64_decode(std::string* data, const char* base64data, size_t base64len);
+
+inline size_t base64_encoded_size(size_t datalen)
+{
+	return ((datalen + 2) / 3) * 4;
+}
+
+/*
+ * The codec picks the fastest implementation the CPU supports on first use.
+ * The selection can be overridden for benchmarking and testing; requests for
+ * an implementation the CPU does not support are ignored.
+ */
+enum class Base64Implementation { Scalar, SSE2, AVX2 };
+
+Base64Implementation base64_implementation();
+bool base64_implementation_supported(Base64Implementation implementation);
+void debug_set_base64_implementation(Base64Implementation implementation);
 
 } // namespace np1sec
 
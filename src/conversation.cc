@@ -17,6 +17,7 @@
  */
 
 #include "conversation.h"
+#include "ephemeralkeypool.h"
 #include "partition.h"
 #include "room.h"
 
@@ -33,11 +34,17 @@ const uint32_t c_conversation_status_frequency = 30000;
 
 Conversation::Conversation(Room* room):
 	m_room(room),
-	m_conversation_private_key(PrivateKey::generate(true)),
+	m_conversation_private_key(EphemeralKeyPool::instance().take()),
 	m_interface(nullptr),
+	m_hash_suite(room->conversation_hash_suite()),
 	m_conversation_status_hash(crypto::nonce_hash()),
+	m_status_hash_builder(m_hash_suite),
 	m_encrypted_chat(this)
 {
+	invalidate_participant_status();
+	invalidate_invite_status();
+	invalidate_key_exchange_status();
+	
 	Participant self;
 	self.is_participant = true;
 	self.username = m_room->username();
@@ -53,12 +60,18 @@ Conversation::Conversation(Room* room):
 	m_encrypted_chat.create_solo_session(m_conversation_status_hash);
 }
 
-Conversation::Conversation(Room* room, const ConversationStatusMessage& conversation_status, const std::string& sender, const ConversationMessage& encoded_message):
+Conversation::Conversation(Room* room, const ConversationStatusMessage& conversation_status, const std::string& sender, const VerifiedConversationMessage& encoded_message):
 	m_room(room),
-	m_conversation_private_key(PrivateKey::generate(true)),
+	m_conversation_private_key(EphemeralKeyPool::instance().take()),
 	m_interface(nullptr),
+	m_hash_suite(conversation_status.hash_suite),
+	m_status_hash_builder(m_hash_suite),
 	m_encrypted_chat(this)
 {
+	invalidate_participant_status();
+	invalidate_invite_status();
+	invalidate_key_exchange_status();
+	
 	for (const ConversationStatusMessage::Participant& p : conversation_status.participants) {
 		Participant participant;
 		participant.is_participant = true;
@@ -220,7 +233,7 @@ Conversation::Conversation(Room* room, const ConversationStatusMessage& conversa
 		throw MessageFormatException();
 	}
 	
-	m_status_message_hash = crypto::hash(encoded_message.payload);
+	m_status_message_hash = m_status_hash_builder.update(encoded_message.payload()).final();
 	for (const auto& i : m_participants) {
 		m_unconfirmed_users.insert(i.second.username);
 	}
@@ -375,7 +388,12 @@ void Conversation::invite(const std::string& username, const PublicKey& long_ter
 		return;
 	}
 	
+	if (!m_room->user_supports_hash_suite(username, m_hash_suite)) {
+		return;
+	}
+	
 	m_own_invites[username] = long_term_public_key;
+	m_room->request_user_authentication(username);
 	
 	do_invite(username);
 }
@@ -432,21 +450,20 @@ void Conversation::send_chat(const std::string& message)
 
 
 
-void Conversation::message_received(const std::string& sender, const ConversationMessage& conversation_message)
+void Conversation::message_received(const std::string& sender, const VerifiedConversationMessage& conversation_message)
 {
 	assert(fsck());
 	
 	/*
 	 * Messages that match this filter get hashed.
 	 */
-	assert(conversation_message.verify());
 	if (m_participants.count(sender)) {
-		assert(conversation_message.conversation_public_key == m_participants.at(sender).conversation_public_key);
-	} else if (conversation_message.type != Message::Type::InviteAcceptance) {
+		assert(conversation_message.conversation_public_key() == m_participants.at(sender).conversation_public_key);
+	} else if (conversation_message.type() != Message::Type::InviteAcceptance) {
 		assert(false);
 	} else {
 		try {
-			InviteAcceptanceMessage message = InviteAcceptanceMessage::decode(conversation_message);
+			InviteAcceptanceMessage message = InviteAcceptanceMessage::decode(conversation_message.message());
 			assert(m_participants.count(message.inviter_username));
 			assert(m_participants.at(message.inviter_username).conversation_public_key == message.inviter_conversation_public_key);
 		} catch(MessageFormatException) {
@@ -454,12 +471,12 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		}
 	}
 	
-	hash_message(sender, conversation_message);
+	hash_message(sender, conversation_message.message());
 	
-	if (conversation_message.type == Message::Type::Invite) {
+	if (conversation_message.type() == Message::Type::Invite) {
 		InviteMessage message;
 		try {
-			message = InviteMessage::decode(conversation_message);
+			message = InviteMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -494,6 +511,7 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		
 		m_unconfirmed_invites[message.username][message.long_term_public_key] = std::move(invite);
 		m_participants[sender].invitees[message.username] = message.long_term_public_key;
+		invalidate_invite_status();
 		
 		Event consistency_check_event;
 		consistency_check_event.type = Message::Type::ConsistencyCheck;
@@ -517,22 +535,22 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		reply_event.type = Message::Type::ConversationStatus;
 		reply_event.conversation_status.invitee_username = message.username;
 		reply_event.conversation_status.invitee_long_term_public_key = message.long_term_public_key;
-		reply_event.conversation_status.status_message_hash = crypto::hash(reply.payload);
+		reply_event.conversation_status.status_message_hash = m_status_hash_builder.update(reply.payload).final();
 		reply_event.remaining_users.insert(sender);
 		declare_event(std::move(reply_event));
 		
 		if (sender == m_room->username()) {
 			send_message(reply);
 		}
-	} else if (conversation_message.type == Message::Type::ConversationStatus) {
+	} else if (conversation_message.type() == Message::Type::ConversationStatus) {
 		ConversationStatusMessage message;
 		try {
-			message = ConversationStatusMessage::decode(conversation_message);
+			message = ConversationStatusMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
 		
-		Hash status_message_hash = crypto::hash(conversation_message.payload);
+		Hash status_message_hash = m_status_hash_builder.update(conversation_message.payload()).final();
 		
 		auto first_event = first_user_event(sender);
 		if (!(
@@ -563,10 +581,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			reply.status_message_hash = status_message_hash;
 			send_message(reply.encode());
 		}
-	} else if (conversation_message.type == Message::Type::ConversationConfirmation) {
+	} else if (conversation_message.type() == Message::Type::ConversationConfirmation) {
 		ConversationConfirmationMessage message;
 		try {
-			message = ConversationConfirmationMessage::decode(conversation_message);
+			message = ConversationConfirmationMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -605,10 +623,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 				}
 			}
 		}
-	} else if (conversation_message.type == Message::Type::InviteAcceptance) {
+	} else if (conversation_message.type() == Message::Type::InviteAcceptance) {
 		InviteAcceptanceMessage message;
 		try {
-			message = InviteAcceptanceMessage::decode(conversation_message);
+			message = InviteAcceptanceMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -635,18 +653,19 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		participant.is_participant = false;
 		participant.username = sender;
 		participant.long_term_public_key = message.my_long_term_public_key;
-		participant.conversation_public_key = conversation_message.conversation_public_key;
+		participant.conversation_public_key = conversation_message.conversation_public_key();
 		participant.inviter = message.inviter_username;
 		participant.authenticated = false;
 		participant.timeout_in_flight = false;
 		participant.votekick_in_flight = false;
 		m_participants[sender] = std::move(participant);
+		invalidate_invite_status();
 		if (sender == m_room->username()) {
 			set_conversation_status_timer();
 		}
 		set_user_conversation_status_timer(sender);
 		
-		m_room->conversation_add_user(this, sender, conversation_message.conversation_public_key);
+		m_room->conversation_add_user(this, sender, conversation_message.conversation_public_key());
 		
 		if (am_confirmed()) {
 			if (sender == m_room->username()) {
@@ -673,10 +692,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 				send_message(authentication.encode());
 			}
 		}
-	} else if (conversation_message.type == Message::Type::AuthenticationRequest) {
+	} else if (conversation_message.type() == Message::Type::AuthenticationRequest) {
 		AuthenticationRequestMessage message;
 		try {
-			message = AuthenticationRequestMessage::decode(conversation_message);
+			message = AuthenticationRequestMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -699,10 +718,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 				send_message(authentication.encode());
 			}
 		}
-	} else if (conversation_message.type == Message::Type::Authentication) {
+	} else if (conversation_message.type() == Message::Type::Authentication) {
 		AuthenticationMessage message;
 		try {
-			message = AuthenticationMessage::decode(conversation_message);
+			message = AuthenticationMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -744,10 +763,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 				}
 			}
 		}
-	} else if (conversation_message.type == Message::Type::AuthenticateInvite) {
+	} else if (conversation_message.type() == Message::Type::AuthenticateInvite) {
 		AuthenticateInviteMessage message;
 		try {
-			message = AuthenticateInviteMessage::decode(conversation_message);
+			message = AuthenticateInviteMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -773,6 +792,7 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		m_participants[m_participants[message.username].inviter].invitees.erase(message.username);
 		m_participants[message.username].inviter = sender;
 		m_participants[sender].invitees[message.username] = message.long_term_public_key;
+		invalidate_invite_status();
 		
 		m_own_invites.erase(message.username);
 		
@@ -783,10 +803,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			ConversationInterface* interface = m_room->interface()->invited_to_conversation(this, sender);
 			set_interface(interface);
 		}
-	} else if (conversation_message.type == Message::Type::CancelInvite) {
+	} else if (conversation_message.type() == Message::Type::CancelInvite) {
 		CancelInviteMessage message;
 		try {
-			message = CancelInviteMessage::decode(conversation_message);
+			message = CancelInviteMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -804,10 +824,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		if (sender != m_room->username() && m_own_invites.count(message.username)) {
 			do_invite(sender);
 		}
-	} else if (conversation_message.type == Message::Type::Join) {
+	} else if (conversation_message.type() == Message::Type::Join) {
 		JoinMessage message;
 		try {
-			message = JoinMessage::decode(conversation_message);
+			message = JoinMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -825,6 +845,8 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		
 		m_participants[sender].is_participant = true;
 		m_participants[sender].inviter.clear();
+		invalidate_participant_status();
+		invalidate_invite_status();
 		
 		m_encrypted_chat.add_user(sender, m_participants.at(sender).long_term_public_key);
 		
@@ -836,19 +858,19 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			m_room->conversation_set_participant(this);
 			if (interface()) interface()->joined();
 		}
-	} else if (conversation_message.type == Message::Type::Leave) {
+	} else if (conversation_message.type() == Message::Type::Leave) {
 		LeaveMessage message;
 		try {
-			message = LeaveMessage::decode(conversation_message);
+			message = LeaveMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
 		
 		remove_user(sender);
-	} else if (conversation_message.type == Message::Type::ConsistencyStatus) {
+	} else if (conversation_message.type() == Message::Type::ConsistencyStatus) {
 		ConsistencyStatusMessage message;
 		try {
-			message = ConsistencyStatusMessage::decode(conversation_message);
+			message = ConsistencyStatusMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -865,10 +887,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			message.conversation_status_hash = m_conversation_status_hash;
 			send_message(message.encode());
 		}
-	} else if (conversation_message.type == Message::Type::ConsistencyCheck) {
+	} else if (conversation_message.type() == Message::Type::ConsistencyCheck) {
 		ConsistencyCheckMessage message;
 		try {
-			message = ConsistencyCheckMessage::decode(conversation_message);
+			message = ConsistencyCheckMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -882,10 +904,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			remove_user(sender);
 			return;
 		}
-	} else if (conversation_message.type == Message::Type::Timeout) {
+	} else if (conversation_message.type() == Message::Type::Timeout) {
 		TimeoutMessage message;
 		try {
-			message = TimeoutMessage::decode(conversation_message);
+			message = TimeoutMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -901,15 +923,18 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		
 		if (message.timeout) {
 			if (m_participants[sender].timeout_peers.insert(message.victim).second) {
+				invalidate_peer_status();
 				try_split(false);
 			}
 		} else {
-			m_participants[sender].timeout_peers.erase(message.victim);
+			if (m_participants[sender].timeout_peers.erase(message.victim) > 0) {
+				invalidate_peer_status();
+			}
 		}
-	} else if (conversation_message.type == Message::Type::Votekick) {
+	} else if (conversation_message.type() == Message::Type::Votekick) {
 		VotekickMessage message;
 		try {
-			message = VotekickMessage::decode(conversation_message);
+			message = VotekickMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -925,19 +950,21 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		
 		if (message.kick) {
 			if (m_participants[sender].votekick_peers.insert(message.victim).second) {
+				invalidate_peer_status();
 				if (interface()) interface()->votekick_registered(sender, message.victim, message.kick);
 				
 				try_split(true);
 			}
 		} else {
 			if (m_participants[sender].votekick_peers.erase(message.victim) > 0) {
+				invalidate_peer_status();
 				if (interface()) interface()->votekick_registered(sender, message.victim, message.kick);
 			}
 		}
-	} else if (conversation_message.type == Message::Type::KeyExchangePublicKey) {
+	} else if (conversation_message.type() == Message::Type::KeyExchangePublicKey) {
 		KeyExchangePublicKeyMessage message;
 		try {
-			message = KeyExchangePublicKeyMessage::decode(conversation_message);
+			message = KeyExchangePublicKeyMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -957,10 +984,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		}
 		
 		m_encrypted_chat.user_public_key(sender, message.key_id, message.public_key);
-	} else if (conversation_message.type == Message::Type::KeyExchangeSecretShare) {
+	} else if (conversation_message.type() == Message::Type::KeyExchangeSecretShare) {
 		KeyExchangeSecretShareMessage message;
 		try {
-			message = KeyExchangeSecretShareMessage::decode(conversation_message);
+			message = KeyExchangeSecretShareMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -980,10 +1007,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		}
 		
 		m_encrypted_chat.user_secret_share(sender, message.key_id, message.group_hash, message.secret_share);
-	} else if (conversation_message.type == Message::Type::KeyExchangeAcceptance) {
+	} else if (conversation_message.type() == Message::Type::KeyExchangeAcceptance) {
 		KeyExchangeAcceptanceMessage message;
 		try {
-			message = KeyExchangeAcceptanceMessage::decode(conversation_message);
+			message = KeyExchangeAcceptanceMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -1002,11 +1029,11 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 			return;
 		}
 		
-		m_encrypted_chat.user_key_hash(sender, message.key_id, message.key_hash);
-	} else if (conversation_message.type == Message::Type::KeyExchangeReveal) {
+		m_encrypted_chat.user_key_hash(sender, message.key_id, message.key_hash, message.cipher_suite);
+	} else if (conversation_message.type() == Message::Type::KeyExchangeReveal) {
 		KeyExchangeRevealMessage message;
 		try {
-			message = KeyExchangeRevealMessage::decode(conversation_message);
+			message = KeyExchangeRevealMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -1026,10 +1053,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		}
 		
 		m_encrypted_chat.user_private_key(sender, message.key_id, message.private_key);
-	} else if (conversation_message.type == Message::Type::KeyActivation) {
+	} else if (conversation_message.type() == Message::Type::KeyActivation) {
 		KeyActivationMessage message;
 		try {
-			message = KeyActivationMessage::decode(conversation_message);
+			message = KeyActivationMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -1047,10 +1074,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		if (m_encrypted_chat.have_session(message.key_id)) {
 			m_encrypted_chat.user_activation(sender, message.key_id);
 		}
-	} else if (conversation_message.type == Message::Type::KeyRatchet) {
+	} else if (conversation_message.type() == Message::Type::KeyRatchet) {
 		KeyRatchetMessage message;
 		try {
-			message = KeyRatchetMessage::decode(conversation_message);
+			message = KeyRatchetMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -1058,10 +1085,10 @@ void Conversation::message_received(const std::string& sender, const Conversatio
 		if (m_participants.at(sender).is_participant) {
 			m_encrypted_chat.replace_session(message.key_id);
 		}
-	} else if (conversation_message.type == Message::Type::Chat) {
+	} else if (conversation_message.type() == Message::Type::Chat) {
 		ChatMessage message;
 		try {
-			message = ChatMessage::decode(conversation_message);
+			message = ChatMessage::decode(conversation_message.message());
 		} catch(MessageFormatException) {
 			return;
 		}
@@ -1194,19 +1221,111 @@ void Conversation::hash_message(const std::string& sender, const UnsignedConvers
 
 void Conversation::hash_payload(const std::string& sender, uint8_t type, const std::string& message)
 {
-	PublicKey zero;
-	memset(zero.buffer, 0, sizeof(zero.buffer));
-	
-	std::string buffer = conversation_status(std::string(), zero).payload;
-	buffer += sender;
-	buffer += type;
-	buffer += message;
-	m_conversation_status_hash = crypto::hash(buffer);
+	update_status_cache();
+	
+	m_status_hash_builder.update(m_status_cache.participants.hash);
+	m_status_hash_builder.update(m_status_cache.invites.hash);
+	m_status_hash_builder.update(m_status_cache.peer_sets.hash);
+	m_status_hash_builder.update(m_status_cache.key_exchanges.hash);
+	m_status_hash_builder.update(m_status_cache.events.hash);
+	m_status_hash_builder.update(m_conversation_status_hash);
+	m_status_hash_builder.update(m_encrypted_chat.latest_session_id());
+	m_status_hash_builder.update(sender);
+	m_status_hash_builder.update(type);
+	m_status_hash_builder.update(message);
+	m_conversation_status_hash = m_status_hash_builder.final();
+}
+
+void Conversation::invalidate_participant_status()
+{
+	m_status_cache.participants.valid = false;
+	/*
+	 * Peer sets and events encode user sets relative to the participant and
+	 * confirmed invite lists.
+	 */
+	invalidate_peer_status();
+	invalidate_event_status();
+}
+
+void Conversation::invalidate_invite_status()
+{
+	m_status_cache.invites.valid = false;
+	invalidate_peer_status();
+	invalidate_event_status();
+}
+
+void Conversation::invalidate_peer_status()
+{
+	m_status_cache.peer_sets.valid = false;
+}
+
+void Conversation::invalidate_key_exchange_status()
+{
+	m_status_cache.key_exchanges.valid = false;
+	/*
+	 * Key exchange events encode whether their key exchange was cancelled.
+	 */
+	invalidate_event_status();
+}
+
+void Conversation::invalidate_event_status()
+{
+	m_status_cache.events.valid = false;
+}
+
+void Conversation::update_status_cache()
+{
+	StatusCache& cache = m_status_cache;
+	
+	if (!cache.participants.valid || !cache.invites.valid) {
+		cache.membership = status_membership();
+	} else if (!cache.peer_sets.valid) {
+		for (ConversationStatusMessage::Participant& participant : cache.membership.participants) {
+			assert(m_participants.count(participant.username));
+			participant.timeout_peers = m_participants.at(participant.username).timeout_peers;
+			participant.votekick_peers = m_participants.at(participant.username).votekick_peers;
+		}
+	}
+	
+	if (!cache.participants.valid) {
+		cache.sections.participants = cache.membership.encode_participants();
+		cache.participants.hash = m_status_hash_builder.update(cache.sections.participants).final();
+		cache.participants.valid = true;
+	}
+	
+	if (!cache.invites.valid) {
+		cache.sections.invites = cache.membership.encode_invites();
+		cache.invites.hash = m_status_hash_builder.update(cache.sections.invites).final();
+		cache.invites.valid = true;
+	}
+	
+	if (!cache.peer_sets.valid) {
+		cache.sections.peer_sets = cache.membership.encode_peer_sets();
+		cache.peer_sets.hash = m_status_hash_builder.update(cache.sections.peer_sets).final();
+		cache.peer_sets.valid = true;
+	}
+	
+	if (!cache.key_exchanges.valid) {
+		ConversationStatusMessage status;
+		status.key_exchanges = m_encrypted_chat.encode_key_exchanges();
+		cache.sections.key_exchanges = status.encode_key_exchanges();
+		cache.key_exchanges.hash = m_status_hash_builder.update(cache.sections.key_exchanges).final();
+		cache.key_exchanges.valid = true;
+	}
+	
+	if (!cache.events.valid) {
+		ConversationStatusMessage status;
+		status.events = status_events(cache.membership);
+		cache.sections.events = status.encode_events();
+		cache.events.hash = m_status_hash_builder.update(cache.sections.events).final();
+		cache.events.valid = true;
+	}
 }
 
 void Conversation::declare_event(Event&& event)
 {
 	std::list<Event>::iterator it = m_events.insert(m_events.end(), std::move(event));
+	invalidate_event_status();
 	for (const std::string& username : it->remaining_users) {
 		assert(m_participants.count(username));
 		m_participants[username].events.push_back(it);
@@ -1275,6 +1394,7 @@ void Conversation::remove_invite(std::string inviter, std::string username)
 		if (m_unconfirmed_invites.at(username).empty()) {
 			m_unconfirmed_invites.erase(username);
 		}
+		invalidate_invite_status();
 	}
 	
 	if (inviter != m_room->username() && m_own_invites.count(username)) {
@@ -1324,6 +1444,11 @@ void Conversation::do_remove_user(const std::string& username)
 	bool participant = m_participants.at(username).is_participant;
 	
 	m_participants.erase(username);
+	if (participant) {
+		invalidate_participant_status();
+	} else {
+		invalidate_invite_status();
+	}
 	
 	m_room->conversation_remove_user(this, username, conversation_public_key);
 	
@@ -1466,14 +1591,23 @@ void Conversation::try_split(bool because_votekick)
 
 
 
-UnsignedConversationMessage Conversation::conversation_status(const std::string& invitee_username, const PublicKey& invitee_long_term_public_key) const
+UnsignedConversationMessage Conversation::conversation_status(const std::string& invitee_username, const PublicKey& invitee_long_term_public_key)
 {
+	update_status_cache();
+	
 	ConversationStatusMessage result;
 	result.invitee_username = invitee_username;
 	result.invitee_long_term_public_key = invitee_long_term_public_key;
-	
 	result.conversation_status_hash = m_conversation_status_hash;
 	result.latest_session_id = m_encrypted_chat.latest_session_id();
+	result.hash_suite = m_hash_suite;
+	
+	return result.encode(m_status_cache.sections);
+}
+
+ConversationStatusMessage Conversation::status_membership() const
+{
+	ConversationStatusMessage result;
 	
 	for (const auto& i : m_participants) {
 		if (i.second.is_participant) {
@@ -1505,7 +1639,12 @@ UnsignedConversationMessage Conversation::conversation_status(const std::string&
 		}
 	}
 	
-	result.key_exchanges = m_encrypted_chat.encode_key_exchanges();
+	return result;
+}
+
+std::vector<ConversationEvent> Conversation::status_events(const ConversationStatusMessage& membership) const
+{
+	std::vector<ConversationEvent> result;
 	
 	for (const Event& event : m_events) {
 		if (event.type == Message::Type::ConversationStatus) {
@@ -1514,19 +1653,19 @@ UnsignedConversationMessage Conversation::conversation_status(const std::string&
 			conversation_status_event.invitee_long_term_public_key = event.conversation_status.invitee_long_term_public_key;
 			conversation_status_event.status_message_hash = event.conversation_status.status_message_hash;
 			conversation_status_event.remaining_users = event.remaining_users;
-			result.events.push_back(conversation_status_event.encode(result));
+			result.push_back(conversation_status_event.encode(membership));
 		} else if (event.type == Message::Type::ConversationConfirmation) {
 			ConversationConfirmationEvent conversation_confirmation_event;
 			conversation_confirmation_event.invitee_username = event.conversation_status.invitee_username;
 			conversation_confirmation_event.invitee_long_term_public_key = event.conversation_status.invitee_long_term_public_key;
 			conversation_confirmation_event.status_message_hash = event.conversation_status.status_message_hash;
 			conversation_confirmation_event.remaining_users = event.remaining_users;
-			result.events.push_back(conversation_confirmation_event.encode(result));
+			result.push_back(conversation_confirmation_event.encode(membership));
 		} else if (event.type == Message::Type::ConsistencyCheck) {
 			ConsistencyCheckEvent consistency_check_event;
 			consistency_check_event.conversation_status_hash = event.consistency_check.conversation_status_hash;
 			consistency_check_event.remaining_users = event.remaining_users;
-			result.events.push_back(consistency_check_event.encode(result));
+			result.push_back(consistency_check_event.encode(membership));
 		} else if (
 			   event.type == Message::Type::KeyExchangePublicKey
 			|| event.type == Message::Type::KeyExchangeSecretShare
@@ -1538,18 +1677,18 @@ UnsignedConversationMessage Conversation::conversation_status(const std::string&
 			key_exchange_event.key_id = event.key_event.key_id;
 			key_exchange_event.cancelled = !m_encrypted_chat.have_key_exchange(event.key_event.key_id);
 			key_exchange_event.remaining_users = event.remaining_users;
-			result.events.push_back(key_exchange_event.encode(result));
+			result.push_back(key_exchange_event.encode(membership));
 		} else if (event.type == Message::Type::KeyActivation) {
 			KeyActivationEvent key_activation_event;
 			key_activation_event.key_id = event.key_event.key_id;
 			key_activation_event.remaining_users = event.remaining_users;
-			result.events.push_back(key_activation_event.encode(result));
+			result.push_back(key_activation_event.encode(membership));
 		} else {
 			assert(false);
 		}
 	}
 	
-	return result.encode();
+	return result;
 }
 
 Conversation::EventReference Conversation::first_user_event(const std::string& username)
@@ -1566,10 +1705,11 @@ Conversation::EventReference Conversation::first_user_event(const std::string& u
 	
 	assert(it->remaining_users.count(username));
 	it->remaining_users.erase(username);
+	invalidate_event_status();
 	
 	check_timeout(username);
 	
-	return EventReference(&m_events, it);
+	return EventReference(this, it);
 }
 
 bool Conversation::fsck()
@@ -1645,12 +1785,18 @@ bool Conversation::fsck()
 	for (auto& i : m_participants) {
 		std::deque<std::list<Event>::iterator>::iterator user_it = i.second.events.begin();
 		
+		/*
+		 * user_it may reach the end of the user's events before event_it
+		 * does; it must not be dereferenced there, as the slot past the end
+		 * can still hold an iterator to a recycled event.
+		 */
 		for (std::list<Event>::iterator event_it = m_events.begin(); event_it != m_events.end(); event_it++) {
 			if (event_it->remaining_users.count(i.first)) {
+				assert(user_it != i.second.events.end());
 				assert(*user_it == event_it);
 				user_it++;
 			} else {
-				assert(*user_it != event_it);
+				assert(user_it == i.second.events.end() || *user_it != event_it);
 			}
 		}
 		assert(user_it == i.second.events.end());
@@ -1670,6 +1816,25 @@ bool Conversation::fsck()
 		assert(m_participants.count(username));
 	}
 	
+	if (m_status_cache.participants.valid && m_status_cache.invites.valid) {
+		ConversationStatusMessage membership = status_membership();
+		assert(m_status_cache.sections.participants == membership.encode_participants());
+		assert(m_status_cache.sections.invites == membership.encode_invites());
+		if (m_status_cache.peer_sets.valid) {
+			assert(m_status_cache.sections.peer_sets == membership.encode_peer_sets());
+		}
+		if (m_status_cache.events.valid) {
+			ConversationStatusMessage status;
+			status.events = status_events(membership);
+			assert(m_status_cache.sections.events == status.encode_events());
+		}
+	}
+	if (m_status_cache.key_exchanges.valid) {
+		ConversationStatusMessage status;
+		status.key_exchanges = m_encrypted_chat.encode_key_exchanges();
+		assert(m_status_cache.sections.key_exchanges == status.encode_key_exchanges());
+	}
+	
 	return true;
 }
 
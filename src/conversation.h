@@ -41,7 +41,7 @@ class Conversation
 {
 	public:
 	Conversation(Room* room);
-	Conversation(Room* room, const ConversationStatusMessage& conversation_status, const std::string& sender, const ConversationMessage& encoded_message);
+	Conversation(Room* room, const ConversationStatusMessage& conversation_status, const std::string& sender, const VerifiedConversationMessage& encoded_message);
 	
 	/*
 	 * Public API
@@ -180,7 +180,7 @@ class Conversation
 	 */
 	/* Callbacks */
 
-	void message_received(const std::string& sender, const ConversationMessage& conversation_message);
+	void message_received(const std::string& sender, const VerifiedConversationMessage& conversation_message);
 	void user_left(const std::string& username);
 
 	/* Accessors */
@@ -188,6 +188,7 @@ class Conversation
 	ConversationInterface* interface() const { return m_interface; }
 	void set_interface(ConversationInterface* interface) { m_interface = interface;	}
 	const Hash& conversation_status_hash() const { return m_conversation_status_hash; }
+	HashSuite hash_suite() const { return m_hash_suite; }
 	std::map<std::string, PublicKey> conversation_users() const;
 	
 	bool am_involved() const;
@@ -203,6 +204,16 @@ class Conversation
 	void remove_user(const std::string& username);
 	void remove_users(const std::set<std::string>& usernames);
 	
+	/*
+	 * Mark parts of the conversation status as changed. Every mutation of the
+	 * state that goes into conversation_status() must call one of these.
+	 */
+	void invalidate_participant_status();
+	void invalidate_invite_status();
+	void invalidate_peer_status();
+	void invalidate_key_exchange_status();
+	void invalidate_event_status();
+	
 	
 	
 	protected:
@@ -228,42 +239,43 @@ class Conversation
 	{
 		public:
 		EventReference():
-			m_list(nullptr)
+			m_conversation(nullptr)
 		{}
 		
-		explicit EventReference(std::list<Event>* list, std::list<Event>::iterator iterator):
-			m_list(list),
+		explicit EventReference(Conversation* conversation, std::list<Event>::iterator iterator):
+			m_conversation(conversation),
 			m_iterator(iterator)
 		{}
 		
 		EventReference(EventReference&& other):
-			m_list(nullptr)
+			m_conversation(nullptr)
 		{
 			*this = std::move(other);
 		}
 		
 		~EventReference()
 		{
-			if (m_list) {
+			if (m_conversation) {
 				if (m_iterator->remaining_users.empty()) {
-					m_list->erase(m_iterator);
+					m_conversation->m_events.erase(m_iterator);
+					m_conversation->invalidate_event_status();
 				}
 			}
 		}
 		
 		EventReference& operator=(EventReference&& other)
 		{
-			m_list = other.m_list;
-			if (m_list) {
+			m_conversation = other.m_conversation;
+			if (m_conversation) {
 				m_iterator = other.m_iterator;
 			}
-			other.m_list = nullptr;
+			other.m_conversation = nullptr;
 			return *this;
 		}
 		
 		operator bool() const
 		{
-			return m_list != nullptr;
+			return m_conversation != nullptr;
 		}
 		
 		Event* operator->()
@@ -272,7 +284,7 @@ class Conversation
 		}
 		
 		protected:
-		std::list<Event>* m_list;
+		Conversation* m_conversation;
 		std::list<Event>::iterator m_iterator;
 	};
 	
@@ -324,6 +336,30 @@ class Conversation
 		PublicKey long_term_public_key;
 	};
 	
+	/*
+	 * Encoded sections of the conversation status and their digests, kept up
+	 * to date lazily so that neither status replies nor message hashing
+	 * re-encode parts of the status that did not change.
+	 */
+	struct StatusSection
+	{
+		bool valid;
+		Hash hash;
+	};
+	
+	struct StatusCache
+	{
+		// participants and invites, without invitee or key exchange data
+		ConversationStatusMessage membership;
+		ConversationStatusMessage::EncodedSections sections;
+		
+		StatusSection participants;
+		StatusSection invites;
+		StatusSection peer_sets;
+		StatusSection key_exchanges;
+		StatusSection events;
+	};
+	
 	
 	
 	protected:
@@ -339,8 +375,12 @@ class Conversation
 	void set_user_conversation_status_timer(const std::string& username);
 	void try_split(bool because_votekick);
 	
+	void update_status_cache();
+	
 	/* Other */
-	UnsignedConversationMessage conversation_status(const std::string& invitee_username, const PublicKey& invitee_long_term_public_key) const;
+	UnsignedConversationMessage conversation_status(const std::string& invitee_username, const PublicKey& invitee_long_term_public_key);
+	ConversationStatusMessage status_membership() const;
+	std::vector<ConversationEvent> status_events(const ConversationStatusMessage& membership) const;
 	EventReference first_user_event(const std::string& username);
 	
 	bool fsck();
@@ -352,10 +392,14 @@ class Conversation
 	Room* m_room;
 	PrivateKey m_conversation_private_key;
 	ConversationInterface* m_interface;
+	/* Fixed for the lifetime of the conversation, see Room::conversation_hash_suite() */
+	HashSuite m_hash_suite;
 	
 	std::map<std::string, Participant> m_participants;
 	std::map<std::string, std::map<PublicKey, UnconfirmedInvite>> m_unconfirmed_invites;
 	Hash m_conversation_status_hash;
+	StatusCache m_status_cache;
+	HashBuilder m_status_hash_builder;
 	
 	std::list<Event> m_events;
 	
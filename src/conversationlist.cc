@@ -23,7 +23,8 @@ namespace np1sec
 {
 
 ConversationList::ConversationList(Room* room):
-	m_room(room)
+	m_room(room),
+	m_dropped_messages(0)
 {}
 
 void ConversationList::disconnect()
@@ -53,36 +54,69 @@ void ConversationList::create_conversation()
 	c->set_interface(interface);
 }
 
-void ConversationList::message_received(const std::string& sender, const ConversationMessage& conversation_message)
+bool ConversationList::is_relevant(const std::string& sender, const ConversationMessage& conversation_message) const
 {
-	assert(conversation_message.verify());
+	/*
+	 * While an invitation is pending, every message is recorded, as it may
+	 * concern the conversation we are about to join.
+	 */
+	if (!m_event_queue.empty()) {
+		return true;
+	}
+	
+	if (
+		   m_user_conversations.count(sender)
+		&& m_user_conversations.at(sender).count(conversation_message.conversation_public_key)
+	) {
+		return true;
+	}
+	
+	if (conversation_message.type == Message::Type::Invite) {
+		try {
+			InviteMessage message = InviteMessage::decode(conversation_message);
+			return
+				   message.username == m_room->username()
+				&& message.long_term_public_key == m_room->public_key();
+		} catch(MessageFormatException) {
+			return false;
+		}
+	}
+	
+	if (conversation_message.type == Message::Type::InviteAcceptance) {
+		return !interested_conversations(sender, conversation_message).empty();
+	}
 	
+	return false;
+}
+
+void ConversationList::message_received(const std::string& sender, const VerifiedConversationMessage& conversation_message)
+{
 	RoomEvent event;
 	event.sender = sender;
 	event.type = RoomEvent::Type::Message;
-	event.message = conversation_message;
+	event.message = std::make_shared<VerifiedConversationMessage>(conversation_message);
 	
-	for (Conversation* conversation : interested_conversations(sender, conversation_message)) {
+	for (Conversation* conversation : interested_conversations(sender, conversation_message.message())) {
 		handle_event(conversation, event);
 	}
 	
 	bool recorded = false;
-	if (conversation_message.type == Message::Type::Invite) {
+	if (conversation_message.type() == Message::Type::Invite) {
 		try {
-			InviteMessage message = InviteMessage::decode(conversation_message);
+			InviteMessage message = InviteMessage::decode(conversation_message.message());
 			if (
 				   message.username == m_room->username()
 				&& message.long_term_public_key == m_room->public_key()
 			) {
-				clear_invite(sender, conversation_message.conversation_public_key);
+				clear_invite(sender, conversation_message.conversation_public_key());
 				
 				event.waiting = true;
 				std::list<RoomEvent>::iterator it = m_event_queue.insert(m_event_queue.end(), std::move(event));
-				m_invitation_start_points[it->sender][it->message.conversation_public_key] = it;
+				m_invitation_start_points[it->sender][it->message->conversation_public_key()] = it;
 				
 				///// TODO 60000
 				it->timeout = Timer(m_room->interface(), 60000, [it, this] {
-					clear_invite(it->sender, it->message.conversation_public_key);
+					clear_invite(it->sender, it->message->conversation_public_key());
 				});
 				
 				recorded = true;
@@ -95,13 +129,13 @@ void ConversationList::message_received(const std::string& sender, const Convers
 		m_event_queue.push_back(std::move(event));
 	}
 	
-	if (conversation_message.type == Message::Type::ConversationStatus) {
+	if (conversation_message.type() == Message::Type::ConversationStatus) {
 		if (
 			   m_invitation_start_points.count(sender)
-			&& m_invitation_start_points.at(sender).count(conversation_message.conversation_public_key)
+			&& m_invitation_start_points.at(sender).count(conversation_message.conversation_public_key())
 		) {
 			try {
-				ConversationStatusMessage message = ConversationStatusMessage::decode(conversation_message);
+				ConversationStatusMessage message = ConversationStatusMessage::decode(conversation_message.message());
 
 				if (
 					   message.invitee_username == m_room->username()
@@ -116,11 +150,11 @@ void ConversationList::message_received(const std::string& sender, const Convers
 					}
 					m_conversations[c] = std::move(conversation);
 					
-					std::list<RoomEvent>::iterator it = m_invitation_start_points.at(sender).at(conversation_message.conversation_public_key);
+					std::list<RoomEvent>::iterator it = m_invitation_start_points.at(sender).at(conversation_message.conversation_public_key());
 					it++;
 					
 					while (m_conversations.count(c) && it != m_event_queue.end()) {
-						if (it->type == RoomEvent::Type::Message && !interested_conversations(it->sender, it->message).count(c)) {
+						if (it->type == RoomEvent::Type::Message && !interested_conversations(it->sender, it->message->message()).count(c)) {
 							it++;
 							continue;
 						}
@@ -130,11 +164,11 @@ void ConversationList::message_received(const std::string& sender, const Convers
 				}
 
 				if (message.invitee_username == m_room->username()) {
-					clear_invite(sender, conversation_message.conversation_public_key);
+					clear_invite(sender, conversation_message.conversation_public_key());
 				}
 			} catch(MessageFormatException) {
 				// TODO: Shouldn't we clear all invites from the sender at this point?
-				clear_invite(sender, conversation_message.conversation_public_key);
+				clear_invite(sender, conversation_message.conversation_public_key());
 			}
 		}
 	}
@@ -164,6 +198,8 @@ void ConversationList::conversation_add_user(Conversation* conversation, const s
 {
 	assert(m_conversations.count(conversation));
 	m_user_conversations[username][conversation_public_key].insert(conversation);
+	
+	m_room->request_user_authentication(username);
 }
 
 void ConversationList::conversation_remove_user(Conversation* conversation, const std::string& username, const PublicKey& conversation_public_key)
@@ -201,7 +237,7 @@ void ConversationList::handle_event(Conversation* conversation, const RoomEvent&
 	assert(conversation->am_involved());
 	
 	if (event.type == RoomEvent::Type::Message) {
-		conversation->message_received(event.sender, event.message);
+		conversation->message_received(event.sender, *event.message);
 	} else if (event.type == RoomEvent::Type::Leave) {
 		conversation->user_left(event.sender);
 	} else {
@@ -253,7 +289,7 @@ void ConversationList::clear_invite(const std::string& username, const PublicKey
 	clean_event_queue();
 }
 
-std::set<Conversation*> ConversationList::interested_conversations(const std::string& sender, const ConversationMessage& conversation_message)
+std::set<Conversation*> ConversationList::interested_conversations(const std::string& sender, const ConversationMessage& conversation_message) const
 {
 	std::set<Conversation*> result;
 	if (
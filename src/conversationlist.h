@@ -51,7 +51,25 @@ class ConversationList
 	void disconnect();
 	void create_conversation();
 	
-	void message_received(const std::string& sender, const ConversationMessage& conversation_message);
+	/*
+	 * True if message_received() could act on the message. This needs only
+	 * index lookups, so it runs before the signature is verified; messages
+	 * that fail it are dropped unverified.
+	 */
+	bool is_relevant(const std::string& sender, const ConversationMessage& conversation_message) const;
+	
+	/* Number of conversation messages dropped for failing is_relevant() */
+	uint64_t dropped_messages() const
+	{
+		return m_dropped_messages;
+	}
+	
+	void message_dropped()
+	{
+		m_dropped_messages++;
+	}
+	
+	void message_received(const std::string& sender, const VerifiedConversationMessage& conversation_message);
 	void user_left(const std::string& username);
 	
 	void conversation_add_user(Conversation* conversation, const std::string& username, const PublicKey& conversation_public_key);
@@ -65,7 +83,8 @@ class ConversationList
 		enum class Type { Message, Leave };
 		std::string sender;
 		Type type;
-		ConversationMessage message;
+		/* Null for Leave events */
+		std::shared_ptr<const VerifiedConversationMessage> message;
 		
 		bool waiting;
 		Timer timeout;
@@ -74,7 +93,7 @@ class ConversationList
 	void handle_event(Conversation* conversation, const RoomEvent& event);
 	void clean_event_queue();
 	void clear_invite(const std::string& username, const PublicKey& conversation_public_key);
-	std::set<Conversation*> interested_conversations(const std::string& sender, const ConversationMessage& conversation_message);
+	std::set<Conversation*> interested_conversations(const std::string& sender, const ConversationMessage& conversation_message) const;
 	
 	
 	protected:
@@ -88,6 +107,8 @@ class ConversationList
 	
 	std::set<Conversation*> m_authenticated_invites;
 	std::set<Conversation*> m_participant_conversations;
+	
+	uint64_t m_dropped_messages;
 };
 
 } // namespace np1sec
@@ -19,7 +19,17 @@
 #include "crypto.h"
 #include "message.h"
 
+#include <algorithm>
 #include <cassert>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
 
 extern "C" {
 #include "gcrypt.h"
@@ -54,23 +64,176 @@ namespace np1sec
 {
 
 static const int c_np1sec_hash = gcry_md_algos::GCRY_MD_SHA256;
-static const int c_np1sec_cipher = GCRY_CIPHER_AES256;
-static const int c_np1sec_cipher_mode = GCRY_CIPHER_MODE_GCM;
-static const int c_np1sec_cipher_iv_length = 16;
 static const int c_tdh_point_length = 65;
 
 
 
+HashBuilder::HashBuilder(bool secure):
+	HashBuilder(HashSuite::Sha256, secure)
+{}
+
+HashBuilder::HashBuilder(HashSuite suite, bool secure)
+{
+	switch (suite) {
+		case HashSuite::Sha256: m_algorithm = c_np1sec_hash; break;
+		case HashSuite::Blake2b: m_algorithm = GCRY_MD_BLAKE2B_256; break;
+		default: throw CryptoException();
+	}
+	
+	unsigned int flags = 0;
+	if (secure) {
+		flags |= GCRY_MD_FLAG_SECURE;
+	}
+	
+	if (gcry_md_open(&m_digest, m_algorithm, flags)) {
+		throw CryptoException();
+	}
+}
+
+HashBuilder::~HashBuilder()
+{
+	gcry_md_close(m_digest);
+}
+
+HashBuilder& HashBuilder::update(const void* data, size_t size)
+{
+	gcry_md_write(m_digest, data, size);
+	return *this;
+}
+
+Hash HashBuilder::final()
+{
+	unsigned char *digest_buffer = gcry_md_read(m_digest, m_algorithm);
+	
+	Hash result;
+	memcpy(result.buffer, digest_buffer, sizeof(result.buffer));
+	
+	gcry_md_reset(m_digest);
+	return result;
+}
+
 SymmetricKey::~SymmetricKey()
 {
 	secure_wipe(key.buffer, sizeof(key.buffer));
 }
 
-PrivateKey::PrivateKey():
-	m_private_key(nullptr)
+struct CipherSuiteParameters
+{
+	int algorithm;
+	int mode;
+};
+
+static CipherSuiteParameters cipher_suite_parameters(CipherSuite suite)
+{
+	switch (suite) {
+		case CipherSuite::Aes256Gcm: return CipherSuiteParameters{GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM};
+		case CipherSuite::ChaCha20Poly1305: return CipherSuiteParameters{GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305};
+	}
+	throw CryptoException();
+}
+
+Cipher::Cipher(const SymmetricKey& key, CipherSuite suite):
+	m_suite(suite)
+{
+	CipherSuiteParameters parameters = cipher_suite_parameters(suite);
+	if (gcry_cipher_open(&m_cipher, parameters.algorithm, parameters.mode, 0)) {
+		throw CryptoException();
+	}
+	if (gcry_cipher_setkey(m_cipher, key.key.buffer, sizeof(key.key.buffer))) {
+		gcry_cipher_close(m_cipher);
+		throw CryptoException();
+	}
+}
+
+Cipher::~Cipher()
+{
+	gcry_cipher_close(m_cipher);
+}
+
+size_t Cipher::encrypted_size(size_t plaintext_size)
+{
+	return c_cipher_iv_length + plaintext_size + c_cipher_tag_length;
+}
+
+size_t Cipher::decrypted_size(size_t ciphertext_size)
+{
+	if (ciphertext_size < c_cipher_iv_length + c_cipher_tag_length) {
+		throw MessageFormatException();
+	}
+	return ciphertext_size - c_cipher_iv_length - c_cipher_tag_length;
+}
+
+void Cipher::encrypt(unsigned char* ciphertext, const unsigned char* plaintext, size_t size, const InitializationVector& iv)
+{
+	memcpy(ciphertext, iv.buffer, c_cipher_iv_length);
+	
+	gcry_cipher_reset(m_cipher);
+	if (gcry_cipher_setiv(m_cipher, ciphertext, c_cipher_iv_length)) {
+		throw CryptoException();
+	}
+	if (gcry_cipher_encrypt(m_cipher, ciphertext + c_cipher_iv_length, size, plaintext, size)) {
+		throw CryptoException();
+	}
+	if (gcry_cipher_gettag(m_cipher, ciphertext + c_cipher_iv_length + size, c_cipher_tag_length)) {
+		throw CryptoException();
+	}
+}
+
+void Cipher::encrypt(unsigned char* ciphertext, const unsigned char* plaintext, size_t size)
+{
+	encrypt(ciphertext, plaintext, size, crypto::nonce<c_cipher_iv_length>());
+}
+
+void Cipher::decrypt(unsigned char* plaintext, const unsigned char* ciphertext, size_t size)
+{
+	size_t plaintext_size = decrypted_size(size);
+	
+	gcry_cipher_reset(m_cipher);
+	if (gcry_cipher_setiv(m_cipher, ciphertext, c_cipher_iv_length)) {
+		throw CryptoException();
+	}
+	if (gcry_cipher_decrypt(m_cipher, plaintext, plaintext_size, ciphertext + c_cipher_iv_length, plaintext_size)) {
+		throw CryptoException();
+	}
+	if (gcry_cipher_checktag(m_cipher, ciphertext + c_cipher_iv_length + plaintext_size, c_cipher_tag_length)) {
+		throw MessageFormatException();
+	}
+}
+
+namespace crypto
+{
+static gcry_sexp_t compute_private_key_scalar(gcry_sexp_t private_key);
+}
+
+struct PrivateKey::Data
+{
+	/* (private-key (ecc (curve Ed25519) (flags eddsa) (q ...) (d ...))), in secure memory */
+	gcry_sexp_t private_key;
+	PublicKey public_key;
+	
+	std::once_flag scalar_once;
+	gcry_sexp_t scalar;
+	
+	Data():
+		private_key(nullptr),
+		scalar(nullptr)
+	{}
+	
+	~Data()
+	{
+		gcry_sexp_release(scalar);
+		gcry_sexp_release(private_key);
+	}
+	
+	Data(const Data&) = delete;
+	Data& operator=(const Data&) = delete;
+};
+
+PrivateKey::PrivateKey()
 {}
 
-PrivateKey::PrivateKey(gcry_sexp_t sexp)
+PrivateKey::PrivateKey(gcry_sexp_t sexp):
+	m_data(std::make_shared<Data>())
 {
 	gcry_ctx_t public_key_parameters;
 	if (gcry_mpi_ec_new(&public_key_parameters, sexp, NULL)) {
@@ -95,47 +258,76 @@ PrivateKey::PrivateKey(gcry_sexp_t sexp)
 		gcry_sexp_release(q);
 		throw CryptoException();
 	}
-	assert(q_size == sizeof(m_public_key.buffer));
-	memcpy(m_public_key.buffer, q_buffer, sizeof(m_public_key.buffer));
+	assert(q_size == sizeof(m_data->public_key.buffer));
+	memcpy(m_data->public_key.buffer, q_buffer, sizeof(m_data->public_key.buffer));
 	gcry_sexp_release(q);
 	
-	if (gcry_sexp_build(&m_private_key, NULL, "%S", sexp)) {
+	gcry_sexp_t d = gcry_sexp_find_token(sexp, "d", 0);
+	if (!d) {
+		throw CryptoException();
+	}
+	size_t d_size;
+	const char *d_buffer = gcry_sexp_nth_data(d, 1, &d_size);
+	if (!d_buffer) {
+		gcry_sexp_release(d);
+		throw CryptoException();
+	}
+	
+	/*
+	 * Store the key in a normalized form that includes the public point,
+	 * so that signing does not need to recompute it. Building it from a
+	 * secure buffer places the resulting s-expression in secure memory.
+	 */
+	void* secure_d = gcry_malloc_secure(d_size);
+	if (!secure_d) {
+		gcry_sexp_release(d);
+		throw CryptoException();
+	}
+	memcpy(secure_d, d_buffer, d_size);
+	gcry_sexp_release(d);
+	
+	gcry_error_t error = gcry_sexp_build(
+		&m_data->private_key,
+		NULL,
+		"(private-key (ecc (curve Ed25519) (flags eddsa) (q %b) (d %b)))",
+		sizeof(m_data->public_key.buffer),
+		m_data->public_key.buffer,
+		d_size,
+		secure_d
+	);
+	secure_wipe(secure_d, d_size);
+	gcry_free(secure_d);
+	if (error) {
 		throw CryptoException();
 	}
 }
 
-PrivateKey::PrivateKey(const PrivateKey& other):
-	m_private_key(nullptr)
+gcry_sexp_t PrivateKey::sexp() const
 {
-	(*this) = other;
+	assert(m_data);
+	return m_data->private_key;
 }
 
-PrivateKey& PrivateKey::operator=(const PrivateKey& other)
+gcry_sexp_t PrivateKey::scalar_sexp() const
 {
-	if (this == &other) {
-		return *this;
-	}
-	
-	if (m_private_key) {
-		gcry_sexp_release(m_private_key);
-	}
-	
-	if (other.m_private_key) {
-		if (gcry_sexp_build(&m_private_key, NULL, "%S", other.m_private_key)) {
+	assert(m_data);
+	Data* data = m_data.get();
+	std::call_once(data->scalar_once, [data] {
+		data->scalar = crypto::compute_private_key_scalar(data->private_key);
+		if (!data->scalar) {
 			throw CryptoException();
 		}
-	} else {
-		m_private_key = nullptr;
-	}
-	
-	m_public_key = other.m_public_key;
-	
-	return *this;
+	});
+	return data->scalar;
 }
 
-PrivateKey::~PrivateKey()
+const PublicKey& PrivateKey::public_key() const
 {
-	gcry_sexp_release(m_private_key);
+	static const PublicKey null_public_key = PublicKey();
+	if (!m_data) {
+		return null_public_key;
+	}
+	return m_data->public_key;
 }
 
 PrivateKey PrivateKey::generate(bool transient)
@@ -166,7 +358,7 @@ PrivateKey PrivateKey::generate(bool transient)
 
 SerializedPrivateKey PrivateKey::serialize() const
 {
-	gcry_sexp_t d = gcry_sexp_find_token(m_private_key, "d", 0);
+	gcry_sexp_t d = gcry_sexp_find_token(sexp(), "d", 0);
 	if (!d) {
 		throw CryptoException();
 	}
@@ -205,102 +397,255 @@ PrivateKey PrivateKey::unserialize(const SerializedPrivateKey& serialized_key)
 namespace crypto
 {
 
-Hash hash(const std::string& buffer, bool secure)
+static gcry_sexp_t convert_ed25519_encryption_key(gcry_sexp_t public_key);
+
+/* The y coordinate, less the sign bit of x, must be below 2^255 - 19. */
+static bool canonical_point_encoding(const unsigned char* buffer)
 {
-	gcry_md_hd_t digest;
-	unsigned int flags = 0;
-	
-	if (secure) {
-		flags |= GCRY_MD_FLAG_SECURE;
+	if ((buffer[31] & 0x7f) != 0x7f) {
+		return true;
 	}
-	
-	if (gcry_md_open(&digest, c_np1sec_hash, flags)) {
-		throw CryptoException();
+	for (size_t i = 30; i > 0; i--) {
+		if (buffer[i] != 0xff) {
+			return true;
+		}
 	}
-	
-	gcry_md_write(digest, buffer.data(), buffer.size());
-	unsigned char *digest_buffer = gcry_md_read(digest, c_np1sec_hash);
-	
-	Hash result;
-	memcpy(result.buffer, digest_buffer, sizeof(result.buffer));
-	
-	gcry_md_close(digest);
-	return result;
+	return buffer[0] < 0xed;
 }
 
-void create_nonce(unsigned char *buffer, size_t size)
+/* Returns nullptr unless buffer is the canonical encoding of a curve point. */
+static gcry_mpi_point_t decode_point(const unsigned char* buffer, gcry_ctx_t context)
 {
-	gcry_create_nonce(buffer, size);
+	if (!canonical_point_encoding(buffer)) {
+		return nullptr;
+	}
+	gcry_mpi_t encoded = gcry_mpi_set_opaque_copy(NULL, buffer, 8 * 32);
+	gcry_mpi_point_t point = gcry_mpi_point_new(0);
+	gcry_error_t error = gcry_mpi_ec_decode_point(point, encoded, context);
+	gcry_mpi_release(encoded);
+	if (error || !gcry_mpi_ec_curve_point(point, context)) {
+		gcry_mpi_point_release(point);
+		return nullptr;
+	}
+	return point;
 }
 
-std::string encrypt(const std::string& plaintext, const SymmetricKey& key)
+/*
+ * A public key in the forms its users consume: the s-expression gcrypt
+ * takes and, computed on first use because they involve a point
+ * decompression, the curve point used for signature verification and the
+ * converted form used for Diffie-Hellman.
+ */
+class PreparedPublicKey
 {
-	gcry_cipher_hd_t cipher;
-	if (gcry_cipher_open(&cipher, c_np1sec_cipher, c_np1sec_cipher_mode, 0)) {
-		throw CryptoException();
+	public:
+	explicit PreparedPublicKey(const PublicKey& key):
+		m_key(key),
+		m_point(nullptr),
+		m_encryption_sexp(nullptr)
+	{
+		if (gcry_sexp_build(&m_sexp, NULL, "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))", sizeof(key.buffer), key.buffer)) {
+			throw CryptoException();
+		}
 	}
-	if (gcry_cipher_setkey(cipher, key.key.buffer, sizeof(key.key.buffer))) {
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	
+	~PreparedPublicKey()
+	{
+		gcry_sexp_release(m_encryption_sexp);
+		gcry_mpi_point_release(m_point);
+		gcry_sexp_release(m_sexp);
 	}
 	
-	ByteArray<c_np1sec_cipher_iv_length> initialization_vector = nonce<c_np1sec_cipher_iv_length>();
-	if (gcry_cipher_setiv(cipher, initialization_vector.buffer, sizeof(initialization_vector.buffer))) {
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	PreparedPublicKey(const PreparedPublicKey&) = delete;
+	PreparedPublicKey& operator=(const PreparedPublicKey&) = delete;
+	
+	gcry_sexp_t sexp() const
+	{
+		return m_sexp;
 	}
 	
-	unsigned char* ciphertext_buffer = new unsigned char[plaintext.size()];
-	if (gcry_cipher_encrypt(cipher, ciphertext_buffer, plaintext.size(), reinterpret_cast<const char *>(plaintext.data()), plaintext.size())) {
-		delete[] ciphertext_buffer;
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	/* The decoded key, or nullptr if it is not a valid point; copy before use. */
+	gcry_mpi_point_t point()
+	{
+		std::call_once(m_point_once, [this] {
+			gcry_ctx_t context;
+			if (gcry_mpi_ec_new(&context, NULL, "Ed25519")) {
+				throw CryptoException();
+			}
+			m_point = decode_point(m_key.buffer, context);
+			gcry_ctx_release(context);
+		});
+		return m_point;
 	}
 	
-	std::string ciphertext(reinterpret_cast<char *>(ciphertext_buffer), plaintext.size());
-	delete[] ciphertext_buffer;
-	gcry_cipher_close(cipher);
+	gcry_sexp_t encryption_sexp()
+	{
+		std::call_once(m_encryption_once, [this] {
+			m_encryption_sexp = convert_ed25519_encryption_key(m_sexp);
+			if (!m_encryption_sexp) {
+				throw CryptoException();
+			}
+		});
+		return m_encryption_sexp;
+	}
 	
-	// The encoded ciphertext consists of the initialization vector followed by the ciphertext proper.
-	return initialization_vector.as_string() + ciphertext;
-}
+	protected:
+	PublicKey m_key;
+	gcry_sexp_t m_sexp;
+	gcry_mpi_point_t m_point;
+	std::once_flag m_point_once;
+	gcry_sexp_t m_encryption_sexp;
+	std::once_flag m_encryption_once;
+};
 
-std::string decrypt(const std::string& ciphertext, const SymmetricKey& key)
+class PublicKeyCache
 {
-	// The encoded ciphertext consists of the initialization vector followed by the ciphertext proper.
-	if (ciphertext.size() < c_np1sec_cipher_iv_length) {
-		throw MessageFormatException();
-	}
+	public:
+	PublicKeyCache():
+		m_capacity(256),
+		m_hits(0),
+		m_misses(0),
+		m_evictions(0)
+	{}
 	
-	gcry_cipher_hd_t cipher;
-	if (gcry_cipher_open(&cipher, c_np1sec_cipher, c_np1sec_cipher_mode, 0)) {
-		throw CryptoException();
+	std::shared_ptr<PreparedPublicKey> get(const PublicKey& key)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		auto it = m_index.find(key);
+		if (it != m_index.end()) {
+			m_hits++;
+			m_entries.splice(m_entries.begin(), m_entries, it->second);
+			return it->second->second;
+		}
+		
+		m_misses++;
+		std::shared_ptr<PreparedPublicKey> prepared = std::make_shared<PreparedPublicKey>(key);
+		if (m_capacity == 0) {
+			return prepared;
+		}
+		m_entries.emplace_front(key, prepared);
+		m_index[key] = m_entries.begin();
+		shrink();
+		return prepared;
 	}
-	if (gcry_cipher_setkey(cipher, key.key.buffer, sizeof(key.key.buffer))) {
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	
+	PublicKeyCacheStatistics statistics()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		PublicKeyCacheStatistics result;
+		result.hits = m_hits;
+		result.misses = m_misses;
+		result.evictions = m_evictions;
+		result.size = m_entries.size();
+		result.capacity = m_capacity;
+		return result;
 	}
 	
-	if (gcry_cipher_setiv(cipher, ciphertext.data(), c_np1sec_cipher_iv_length)) {
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	void set_capacity(size_t capacity)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		m_capacity = capacity;
+		shrink();
 	}
 	
-	size_t plaintext_size = ciphertext.size() - c_np1sec_cipher_iv_length;
-	unsigned char* plaintext_buffer = new unsigned char[plaintext_size];
-	if (gcry_cipher_decrypt(cipher, plaintext_buffer, plaintext_size, ciphertext.data() + c_np1sec_cipher_iv_length, plaintext_size)) {
-		delete[] plaintext_buffer;
-		gcry_cipher_close(cipher);
-		throw CryptoException();
+	protected:
+	void shrink()
+	{
+		while (m_entries.size() > m_capacity) {
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+			m_evictions++;
+		}
 	}
 	
-	std::string plaintext(reinterpret_cast<char *>(plaintext_buffer), plaintext_size);
-	delete[] plaintext_buffer;
-	gcry_cipher_close(cipher);
+	typedef std::list<std::pair<PublicKey, std::shared_ptr<PreparedPublicKey>>> EntryList;
 	
+	std::mutex m_mutex;
+	size_t m_capacity;
+	/* Most recently used first. */
+	EntryList m_entries;
+	std::map<PublicKey, EntryList::iterator> m_index;
+	uint64_t m_hits;
+	uint64_t m_misses;
+	uint64_t m_evictions;
+};
+
+static PublicKeyCache& public_key_cache()
+{
+	static PublicKeyCache cache;
+	return cache;
+}
+
+PublicKeyCacheStatistics public_key_cache_statistics()
+{
+	return public_key_cache().statistics();
+}
+
+void set_public_key_cache_capacity(size_t capacity)
+{
+	public_key_cache().set_capacity(capacity);
+}
+
+Hash hash(const std::string& buffer, bool secure)
+{
+	/*
+	 * Reuse a digest handle per thread rather than opening one per call.
+	 */
+	static thread_local HashBuilder builder(false);
+	static thread_local HashBuilder secure_builder(true);
+	
+	return (secure ? secure_builder : builder).update(buffer).final();
+}
+
+void create_nonce(unsigned char *buffer, size_t size)
+{
+	gcry_create_nonce(buffer, size);
+}
+
+std::string encrypt(const std::string& plaintext, const SymmetricKey& key)
+{
+	Cipher cipher(key);
+	std::string ciphertext(Cipher::encrypted_size(plaintext.size()), 0);
+	cipher.encrypt(
+		reinterpret_cast<unsigned char*>(&ciphertext[0]),
+		reinterpret_cast<const unsigned char*>(plaintext.data()),
+		plaintext.size()
+	);
+	return ciphertext;
+}
+
+std::string decrypt(const std::string& ciphertext, const SymmetricKey& key)
+{
+	std::string plaintext(Cipher::decrypted_size(ciphertext.size()), 0);
+	Cipher cipher(key);
+	cipher.decrypt(
+		reinterpret_cast<unsigned char*>(&plaintext[0]),
+		reinterpret_cast<const unsigned char*>(ciphertext.data()),
+		ciphertext.size()
+	);
 	return plaintext;
 }
 
+bool hardware_aes_supported()
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__) && defined(__linux__)
+	return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+	return false;
+#endif
+}
+
+CipherSuite preferred_cipher_suite()
+{
+	static const CipherSuite suite = hardware_aes_supported() ? CipherSuite::Aes256Gcm : CipherSuite::ChaCha20Poly1305;
+	return suite;
+}
+
 Signature sign(const std::string& payload, const PrivateKey& key)
 {
 	assert(!key.is_null());
@@ -358,33 +703,429 @@ Signature sign(const std::string& payload, const PrivateKey& key)
 	return result;
 }
 
-bool verify(const std::string& payload, const Signature& signature, const PublicKey& key)
+/*
+ * Signatures are checked with the cofactored equation
+ *   [8]([S]B - R - [k]A) = identity
+ * which RFC 8032 permits, and which is the only form a batch can check
+ * consistently: for random 128-bit z_i, a batch checks
+ *   [8]([sum z_i S_i]B - sum [z_i]R_i - sum_A [sum over A_i = A of z_i k_i]A) = identity
+ * With the cofactor cleared, small-order components of R or A cannot make
+ * a batch disagree with the check of a single signature, which uses z = 1.
+ * Signatures with S out of range, or with a non-canonical or undecodable R
+ * or A, are rejected outright.
+ *
+ * The sum is computed with Straus' method: the terms are written in width-5
+ * non-adjacent form and share a single chain of doublings.
+ */
+class BatchVerifier
 {
-	gcry_sexp_t key_sexp;
-	if (gcry_sexp_build(&key_sexp, NULL, "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))", sizeof(key.buffer), key.buffer)) {
-		throw CryptoException();
+	public:
+	explicit BatchVerifier(const std::vector<SignatureVerification>& batch):
+		m_batch(batch),
+		m_context(nullptr),
+		m_order(nullptr),
+		m_field(nullptr),
+		m_negated_base(nullptr)
+	{
+		if (gcry_mpi_ec_new(&m_context, NULL, "Ed25519")) {
+			throw CryptoException();
+		}
+		m_order = gcry_mpi_ec_get_mpi("n", m_context, 1);
+		m_field = gcry_mpi_ec_get_mpi("p", m_context, 1);
+		gcry_mpi_point_t base = gcry_mpi_ec_get_point("g", m_context, 1);
+		if (!m_order || !m_field || !base) {
+			gcry_mpi_point_release(base);
+			release();
+			throw CryptoException();
+		}
+		m_negated_base = negate(base);
+		gcry_mpi_point_release(base);
 	}
 	
-	gcry_sexp_t signature_sexp;
-	if (gcry_sexp_build(&signature_sexp, NULL, "(sig-val (eddsa (r %b)(s %b)))", 32, signature.buffer, 32, signature.buffer + 32)) {
-		gcry_sexp_release(key_sexp);
-		throw CryptoException();
+	~BatchVerifier()
+	{
+		release();
 	}
 	
-	gcry_sexp_t payload_sexp;
-	if (gcry_sexp_build(&payload_sexp, NULL, "(data (flags eddsa) (hash-algo sha512) (value %b))", payload.size(), payload.data())) {
-		gcry_sexp_release(signature_sexp);
-		gcry_sexp_release(key_sexp);
-		throw CryptoException();
+	BatchVerifier(const BatchVerifier&) = delete;
+	BatchVerifier& operator=(const BatchVerifier&) = delete;
+	
+	std::vector<bool> run()
+	{
+		std::vector<bool> result(m_batch.size(), false);
+		
+		std::vector<size_t> batchable;
+		for (size_t i = 0; i < m_batch.size(); i++) {
+			if (prepare(m_batch[i])) {
+				batchable.push_back(i);
+			}
+		}
+		
+		verify_range(batchable, 0, batchable.size(), &result);
+		return result;
 	}
 	
-	gcry_error_t error = gcry_pk_verify(signature_sexp, payload_sexp, key_sexp);
+	protected:
+	struct Entry
+	{
+		gcry_mpi_t s;
+		gcry_mpi_t k;
+		gcry_mpi_point_t r;
+		gcry_mpi_point_t a;
+	};
 	
-	gcry_sexp_release(payload_sexp);
-	gcry_sexp_release(signature_sexp);
-	gcry_sexp_release(key_sexp);
+	static const int c_window = 5;
+	
+	void release()
+	{
+		for (Entry& entry : m_entries) {
+			gcry_mpi_release(entry.s);
+			gcry_mpi_release(entry.k);
+			gcry_mpi_point_release(entry.r);
+		}
+		m_entries.clear();
+		for (auto& i : m_public_keys) {
+			gcry_mpi_point_release(i.second);
+		}
+		m_public_keys.clear();
+		gcry_mpi_point_release(m_negated_base);
+		gcry_mpi_release(m_field);
+		gcry_mpi_release(m_order);
+		gcry_ctx_release(m_context);
+		m_negated_base = nullptr;
+		m_field = nullptr;
+		m_order = nullptr;
+		m_context = nullptr;
+	}
+	
+	/* Parses a little-endian number. */
+	static gcry_mpi_t scan_le(const unsigned char* buffer, size_t size)
+	{
+		std::vector<unsigned char> reversed(buffer, buffer + size);
+		std::reverse(reversed.begin(), reversed.end());
+		gcry_mpi_t result;
+		if (gcry_mpi_scan(&result, GCRYMPI_FMT_USG, reversed.data(), reversed.size(), NULL)) {
+			throw CryptoException();
+		}
+		return result;
+	}
+	
+	/* In projective coordinates, -(X : Y : Z) = (-X : Y : Z). */
+	gcry_mpi_point_t negate(gcry_mpi_point_t point)
+	{
+		gcry_mpi_t x = gcry_mpi_new(0);
+		gcry_mpi_t y = gcry_mpi_new(0);
+		gcry_mpi_t z = gcry_mpi_new(0);
+		gcry_mpi_point_get(x, y, z, point);
+		gcry_mpi_mod(x, x, m_field);
+		gcry_mpi_sub(x, m_field, x);
+		return gcry_mpi_point_snatch_set(NULL, x, y, z);
+	}
+	
+	/* The identity is (0 : Z : Z). */
+	bool is_identity(gcry_mpi_point_t point)
+	{
+		gcry_mpi_t x = gcry_mpi_new(0);
+		gcry_mpi_t y = gcry_mpi_new(0);
+		gcry_mpi_t z = gcry_mpi_new(0);
+		gcry_mpi_point_get(x, y, z, point);
+		gcry_mpi_mod(x, x, m_field);
+		gcry_mpi_sub(y, y, z);
+		gcry_mpi_mod(y, y, m_field);
+		bool identity = gcry_mpi_cmp_ui(x, 0) == 0 && gcry_mpi_cmp_ui(y, 0) == 0;
+		gcry_mpi_release(z);
+		gcry_mpi_release(y);
+		gcry_mpi_release(x);
+		return identity;
+	}
+	
+	/*
+	 * The width-c_window non-adjacent form of a scalar below 2^256: digits
+	 * are zero or odd and below 2^(c_window - 1) in magnitude, least
+	 * significant first.
+	 */
+	static std::vector<int> non_adjacent_form(gcry_mpi_t scalar)
+	{
+		unsigned char buffer[32];
+		size_t written;
+		if (gcry_mpi_print(GCRYMPI_FMT_USG, buffer, sizeof(buffer), &written, scalar)) {
+			throw CryptoException();
+		}
+		
+		/* Little-endian 32-bit words, with room for the final carry. */
+		uint32_t words[9] = {};
+		for (size_t i = 0; i < written; i++) {
+			words[i / 4] |= uint32_t(buffer[written - 1 - i]) << (8 * (i % 4));
+		}
+		
+		std::vector<int> result;
+		auto nonzero = [&words] {
+			for (uint32_t word : words) {
+				if (word) {
+					return true;
+				}
+			}
+			return false;
+		};
+		while (nonzero()) {
+			int digit = 0;
+			if (words[0] & 1) {
+				digit = words[0] & ((1 << c_window) - 1);
+				if (digit >= 1 << (c_window - 1)) {
+					digit -= 1 << c_window;
+				}
+				/* Subtract the digit, which clears the low c_window bits. */
+				uint64_t carry = digit < 0 ? uint32_t(-digit) : 0;
+				words[0] -= digit > 0 ? digit : 0;
+				for (size_t i = 0; i < 9 && carry; i++) {
+					uint64_t sum = uint64_t(words[i]) + carry;
+					words[i] = uint32_t(sum);
+					carry = sum >> 32;
+				}
+			}
+			result.push_back(digit);
+			for (size_t i = 0; i < 9; i++) {
+				words[i] = (words[i] >> 1) | (i < 8 ? words[i + 1] << 31 : 0);
+			}
+		}
+		return result;
+	}
+	
+	struct Term
+	{
+		std::vector<int> digits;
+		/* The odd multiples P, 3P, 5P, ... and their negations, as far as the digits need them. */
+		std::vector<gcry_mpi_point_t> multiples;
+		std::vector<gcry_mpi_point_t> negated_multiples;
+	};
+	
+	/* Computes sum [scalars_i]points_i, which the caller releases. */
+	gcry_mpi_point_t multi_scalar_multiply(const std::vector<gcry_mpi_t>& scalars, const std::vector<gcry_mpi_point_t>& points)
+	{
+		std::vector<Term> terms(scalars.size());
+		size_t length = 0;
+		for (size_t i = 0; i < terms.size(); i++) {
+			Term& term = terms[i];
+			term.digits = non_adjacent_form(scalars[i]);
+			length = std::max(length, term.digits.size());
+			
+			int largest = 0;
+			for (int digit : term.digits) {
+				largest = std::max(largest, digit < 0 ? -digit : digit);
+			}
+			if (largest == 0) {
+				continue;
+			}
+			term.multiples.push_back(gcry_mpi_point_copy(points[i]));
+			if (largest > 1) {
+				gcry_mpi_point_t doubled = gcry_mpi_point_new(0);
+				gcry_mpi_ec_dup(doubled, points[i], m_context);
+				for (int multiple = 3; multiple <= largest; multiple += 2) {
+					gcry_mpi_point_t next = gcry_mpi_point_new(0);
+					gcry_mpi_ec_add(next, term.multiples.back(), doubled, m_context);
+					term.multiples.push_back(next);
+				}
+				gcry_mpi_point_release(doubled);
+			}
+			for (gcry_mpi_point_t multiple : term.multiples) {
+				term.negated_multiples.push_back(negate(multiple));
+			}
+		}
+		
+		gcry_mpi_t zero = gcry_mpi_set_ui(NULL, 0);
+		gcry_mpi_t one = gcry_mpi_set_ui(NULL, 1);
+		gcry_mpi_point_t sum = gcry_mpi_point_set(NULL, zero, one, one);
+		gcry_mpi_point_t scratch = gcry_mpi_point_new(0);
+		gcry_mpi_release(one);
+		gcry_mpi_release(zero);
+		
+		bool started = false;
+		for (size_t position = length; position-- > 0;) {
+			if (started) {
+				gcry_mpi_ec_dup(scratch, sum, m_context);
+				std::swap(sum, scratch);
+			}
+			for (const Term& term : terms) {
+				if (position >= term.digits.size() || term.digits[position] == 0) {
+					continue;
+				}
+				int digit = term.digits[position];
+				gcry_mpi_point_t addend = digit > 0 ? term.multiples[digit / 2] : term.negated_multiples[-digit / 2];
+				gcry_mpi_ec_add(scratch, sum, addend, m_context);
+				std::swap(sum, scratch);
+				started = true;
+			}
+		}
+		
+		gcry_mpi_point_release(scratch);
+		for (Term& term : terms) {
+			for (gcry_mpi_point_t multiple : term.multiples) {
+				gcry_mpi_point_release(multiple);
+			}
+			for (gcry_mpi_point_t multiple : term.negated_multiples) {
+				gcry_mpi_point_release(multiple);
+			}
+		}
+		return sum;
+	}
 	
-	return error == 0;
+	bool prepare(const SignatureVerification& item)
+	{
+		const unsigned char* r_buffer = item.signature.buffer;
+		const unsigned char* s_buffer = item.signature.buffer + 32;
+		
+		auto it = m_public_keys.find(item.public_key);
+		if (it == m_public_keys.end()) {
+			gcry_mpi_point_t point = public_key_cache().get(item.public_key)->point();
+			it = m_public_keys.insert(std::make_pair(item.public_key, point ? gcry_mpi_point_copy(point) : nullptr)).first;
+		}
+		if (!it->second) {
+			return false;
+		}
+		
+		Entry entry;
+		entry.s = scan_le(s_buffer, 32);
+		if (gcry_mpi_cmp(entry.s, m_order) >= 0) {
+			gcry_mpi_release(entry.s);
+			return false;
+		}
+		
+		entry.r = decode_point(r_buffer, m_context);
+		if (!entry.r) {
+			gcry_mpi_release(entry.s);
+			return false;
+		}
+		entry.a = it->second;
+		
+		gcry_md_hd_t digest;
+		if (gcry_md_open(&digest, GCRY_MD_SHA512, 0)) {
+			gcry_mpi_release(entry.s);
+			gcry_mpi_point_release(entry.r);
+			throw CryptoException();
+		}
+		gcry_md_write(digest, r_buffer, 32);
+		gcry_md_write(digest, item.public_key.buffer, sizeof(item.public_key.buffer));
+		gcry_md_write(digest, item.payload.data(), item.payload.size());
+		entry.k = scan_le(gcry_md_read(digest, GCRY_MD_SHA512), 64);
+		gcry_md_close(digest);
+		gcry_mpi_mod(entry.k, entry.k, m_order);
+		
+		m_entries.push_back(entry);
+		return true;
+	}
+	
+	/*
+	 * Verifies the entries batchable[begin, end) together, splitting the
+	 * range in two whenever the combined check fails.
+	 */
+	void verify_range(const std::vector<size_t>& batchable, size_t begin, size_t end, std::vector<bool>* result)
+	{
+		if (begin == end) {
+			return;
+		}
+		if (check(begin, end)) {
+			for (size_t i = begin; i < end; i++) {
+				(*result)[batchable[i]] = true;
+			}
+			return;
+		}
+		if (end - begin == 1) {
+			return;
+		}
+		size_t middle = begin + (end - begin) / 2;
+		verify_range(batchable, begin, middle, result);
+		verify_range(batchable, middle, end, result);
+	}
+	
+	/* Entries are stored in the order of batchable, so ranges coincide. */
+	bool check(size_t begin, size_t end)
+	{
+		std::vector<unsigned char> z_buffer;
+		if (end - begin > 1) {
+			z_buffer.resize(16 * (end - begin));
+			gcry_randomize(z_buffer.data(), z_buffer.size(), GCRY_STRONG_RANDOM);
+		}
+		
+		std::vector<gcry_mpi_t> scalars;
+		std::vector<gcry_mpi_point_t> points;
+		gcry_mpi_t s_sum = gcry_mpi_set_ui(NULL, 0);
+		std::map<gcry_mpi_point_t, gcry_mpi_t> a_coefficients;
+		
+		for (size_t i = begin; i < end; i++) {
+			const Entry& entry = m_entries[i];
+			
+			gcry_mpi_t z;
+			if (z_buffer.empty()) {
+				z = gcry_mpi_set_ui(NULL, 1);
+			} else if (gcry_mpi_scan(&z, GCRYMPI_FMT_USG, &z_buffer[16 * (i - begin)], 16, NULL)) {
+				throw CryptoException();
+			}
+			
+			gcry_mpi_t term = gcry_mpi_new(0);
+			gcry_mpi_mulm(term, z, entry.s, m_order);
+			gcry_mpi_addm(s_sum, s_sum, term, m_order);
+			
+			gcry_mpi_mulm(term, z, entry.k, m_order);
+			auto it = a_coefficients.find(entry.a);
+			if (it != a_coefficients.end()) {
+				gcry_mpi_addm(it->second, it->second, term, m_order);
+				gcry_mpi_release(term);
+			} else {
+				a_coefficients[entry.a] = term;
+			}
+			
+			scalars.push_back(z);
+			points.push_back(entry.r);
+		}
+		for (auto& i : a_coefficients) {
+			scalars.push_back(i.second);
+			points.push_back(i.first);
+		}
+		scalars.push_back(s_sum);
+		points.push_back(m_negated_base);
+		
+		/* The sum is -([sum z_i S_i]B - sum [z_i]R_i - sum [z_i k_i]A_i). */
+		gcry_mpi_point_t sum = multi_scalar_multiply(scalars, points);
+		for (gcry_mpi_t scalar : scalars) {
+			gcry_mpi_release(scalar);
+		}
+		
+		gcry_mpi_point_t scratch = gcry_mpi_point_new(0);
+		for (int i = 0; i < 3; i++) {
+			gcry_mpi_ec_dup(scratch, sum, m_context);
+			std::swap(sum, scratch);
+		}
+		bool identity = is_identity(sum);
+		
+		gcry_mpi_point_release(scratch);
+		gcry_mpi_point_release(sum);
+		return identity;
+	}
+	
+	const std::vector<SignatureVerification>& m_batch;
+	gcry_ctx_t m_context;
+	gcry_mpi_t m_order;
+	gcry_mpi_t m_field;
+	gcry_mpi_point_t m_negated_base;
+	std::map<PublicKey, gcry_mpi_point_t> m_public_keys;
+	std::vector<Entry> m_entries;
+};
+
+bool verify(const std::string& payload, const Signature& signature, const PublicKey& key)
+{
+	std::vector<SignatureVerification> batch(1);
+	batch[0].payload = payload;
+	batch[0].signature = signature;
+	batch[0].public_key = key;
+	
+	BatchVerifier verifier(batch);
+	return verifier.run()[0];
+}
+
+std::vector<bool> verify_batch(const std::vector<SignatureVerification>& batch)
+{
+	BatchVerifier verifier(batch);
+	return verifier.run();
 }
 
 
@@ -428,9 +1169,13 @@ static gcry_sexp_t compute_private_key_scalar(gcry_sexp_t private_key)
 	gcry_md_close(digest);
 	
 	gcry_mpi_t a;
-	if (gcry_mpi_scan(&a, GCRYMPI_FMT_STD, hash_buffer, sizeof hash_buffer, NULL)) {
+	gcry_error_t error = gcry_mpi_scan(&a, GCRYMPI_FMT_STD, hash_buffer, sizeof hash_buffer, NULL);
+	secure_wipe(hash_buffer, sizeof hash_buffer);
+	if (error) {
 		return nullptr;
 	}
+	/* Moves the scalar, and the s-expression built from it, into secure memory. */
+	gcry_mpi_set_flag(a, GCRYMPI_FLAG_SECURE);
 	gcry_sexp_t result;
 	if (gcry_sexp_build(&result, NULL, "%m", a)) {
 		gcry_mpi_release(a);
@@ -482,33 +1227,13 @@ static ByteArray<c_tdh_point_length> compute_dh_token(const PrivateKey& private_
 {
 	assert(!private_key.is_null());
 	
-	gcry_sexp_t private_scalar_sexp = compute_private_key_scalar(private_key.sexp());
-	if (!private_scalar_sexp) {
-		throw CryptoException();
-	}
-	
-	gcry_sexp_t public_key_sexp;
-	if (gcry_sexp_build(&public_key_sexp, NULL, "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))", sizeof(public_key.buffer), public_key.buffer)) {
-		gcry_sexp_release(private_scalar_sexp);
-		throw CryptoException();
-	}
-	
-	gcry_sexp_t public_encryption_key_sexp = convert_ed25519_encryption_key(public_key_sexp);
-	if (!public_encryption_key_sexp) {
-		gcry_sexp_release(public_key_sexp);
-		gcry_sexp_release(private_scalar_sexp);
-		throw CryptoException();
-	}
-	gcry_sexp_release(public_key_sexp);
+	std::shared_ptr<PreparedPublicKey> prepared_public_key = public_key_cache().get(public_key);
+	gcry_sexp_t public_encryption_key_sexp = prepared_public_key->encryption_sexp();
 	
 	gcry_sexp_t point_sexp;
-	if (gcry_pk_encrypt(&point_sexp, private_scalar_sexp, public_encryption_key_sexp)) {
-		gcry_sexp_release(public_encryption_key_sexp);
-		gcry_sexp_release(private_scalar_sexp);
+	if (gcry_pk_encrypt(&point_sexp, private_key.scalar_sexp(), public_encryption_key_sexp)) {
 		throw CryptoException();
 	}
-	gcry_sexp_release(public_encryption_key_sexp);
-	gcry_sexp_release(private_scalar_sexp);
 	
 	gcry_sexp_t s_sexp = gcry_sexp_find_token(point_sexp, "s", 0);
 	if (!s_sexp) {
@@ -537,37 +1262,16 @@ static Hash triple_diffie_hellman_token(
 	const ByteArray<c_tdh_point_length>& part_3
 )
 {
-	std::string hash_buffer;
-	if (part_1 <= part_2 && part_1 <= part_3) {
-		hash_buffer += part_1.as_string();
-		if (part_2 <= part_3) {
-			hash_buffer += part_2.as_string();
-			hash_buffer += part_3.as_string();
-		} else {
-			hash_buffer += part_3.as_string();
-			hash_buffer += part_2.as_string();
-		}
-	} else if (part_2 <= part_1 && part_2 <= part_3) {
-		hash_buffer += part_2.as_string();
-		if (part_1 <= part_3) {
-			hash_buffer += part_1.as_string();
-			hash_buffer += part_3.as_string();
-		} else {
-			hash_buffer += part_3.as_string();
-			hash_buffer += part_1.as_string();
-		}
-	} else {
-		hash_buffer += part_3.as_string();
-		if (part_1 <= part_2) {
-			hash_buffer += part_1.as_string();
-			hash_buffer += part_2.as_string();
-		} else {
-			hash_buffer += part_2.as_string();
-			hash_buffer += part_1.as_string();
-		}
-	}
+	const ByteArray<c_tdh_point_length>* parts[3] = { &part_1, &part_2, &part_3 };
+	std::sort(parts, parts + 3, [] (const ByteArray<c_tdh_point_length>* a, const ByteArray<c_tdh_point_length>* b) {
+		return *a < *b;
+	});
 	
-	return crypto::hash(hash_buffer, true);
+	HashBuilder builder(true);
+	for (const ByteArray<c_tdh_point_length>* part : parts) {
+		builder.update(*part);
+	}
+	return builder.final();
 }
 
 Hash triple_diffie_hellman(
@@ -19,12 +19,19 @@
 #ifndef SRC_CRYPTO_H_
 #define SRC_CRYPTO_H_
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "bytearray.h"
 
 struct gcry_sexp;
 typedef gcry_sexp* gcry_sexp_t;
+struct gcry_cipher_handle;
+typedef gcry_cipher_handle* gcry_cipher_hd_t;
+struct gcry_md_handle;
+typedef gcry_md_handle* gcry_md_hd_t;
 
 namespace np1sec
 {
@@ -34,9 +41,58 @@ namespace np1sec
 	const size_t c_signature_length = 64;
 	const size_t c_public_key_length = 32;
 	const size_t c_private_key_length = 32;
+	const size_t c_cipher_iv_length = 12;
+	const size_t c_cipher_tag_length = 16;
 	
 	typedef ByteArray<c_hash_length> Hash;
 	
+	/*
+	 * Hash functions a conversation can use for its status and key
+	 * exchange hashes. Both produce c_hash_length bytes.
+	 */
+	enum class HashSuite : uint8_t {
+		Sha256 = 0,
+		Blake2b = 1,
+	};
+	
+	//! Incremental hash computation over data that need not be contiguous
+	/**
+	 * final() resets the builder, so one builder can hash many inputs
+	 * without reopening the digest handle. In secure mode, the digest
+	 * state is kept in secure memory.
+	 */
+	class HashBuilder
+	{
+		protected:
+		gcry_md_hd_t m_digest;
+		int m_algorithm;
+		
+		public:
+		explicit HashBuilder(bool secure = false);
+		explicit HashBuilder(HashSuite suite, bool secure = false);
+		~HashBuilder();
+		
+		HashBuilder(const HashBuilder&) = delete;
+		HashBuilder& operator=(const HashBuilder&) = delete;
+		
+		HashBuilder& update(const void* data, size_t size);
+		HashBuilder& update(const std::string& data)
+		{
+			return update(data.data(), data.size());
+		}
+		template<int n> HashBuilder& update(const ByteArray<n>& data)
+		{
+			return update(data.buffer, n);
+		}
+		HashBuilder& update(uint8_t byte)
+		{
+			return update(&byte, 1);
+		}
+		
+		/** Return the hash of everything written so far, and reset */
+		Hash final();
+	};
+	
 	struct SymmetricKey
 	{
 		ByteArray<c_hash_length> key;
@@ -44,47 +100,100 @@ namespace np1sec
 		~SymmetricKey();
 	};
 	
+	typedef ByteArray<c_cipher_iv_length> InitializationVector;
+	
+	/*
+	 * Authenticated encryption suites a session can use. Participants of a
+	 * key exchange announce the suite they prefer; if any of them prefers
+	 * ChaCha20-Poly1305, the resulting session uses it.
+	 */
+	enum class CipherSuite : uint8_t {
+		Aes256Gcm = 0,
+		ChaCha20Poly1305 = 1,
+	};
+	
+	//! Symmetric cipher keyed once and reused for every message under that key
+	/**
+	 * The ciphertext consists of the IV, the encrypted payload, and the
+	 * authentication tag.
+	 */
+	class Cipher
+	{
+		protected:
+		gcry_cipher_hd_t m_cipher;
+		CipherSuite m_suite;
+		
+		public:
+		explicit Cipher(const SymmetricKey& key, CipherSuite suite = CipherSuite::Aes256Gcm);
+		~Cipher();
+		
+		Cipher(const Cipher&) = delete;
+		Cipher& operator=(const Cipher&) = delete;
+		
+		/** Size of the encrypted form of \p plaintext_size bytes */
+		static size_t encrypted_size(size_t plaintext_size);
+		
+		/** Size of the plaintext in \p ciphertext_size bytes; throws MessageFormatException if too short */
+		static size_t decrypted_size(size_t ciphertext_size);
+		
+		CipherSuite suite() const
+		{
+			return m_suite;
+		}
+		
+		/**
+		 * Encrypt \p size bytes of \p plaintext into \p ciphertext,
+		 * which must hold encrypted_size(size) bytes, using \p iv.
+		 * An IV must never be used twice under the same key.
+		 */
+		void encrypt(unsigned char* ciphertext, const unsigned char* plaintext, size_t size, const InitializationVector& iv);
+		
+		/** As above, using a random IV */
+		void encrypt(unsigned char* ciphertext, const unsigned char* plaintext, size_t size);
+		
+		/**
+		 * Decrypt \p size bytes of \p ciphertext into \p plaintext,
+		 * which must hold decrypted_size(size) bytes. Throws
+		 * MessageFormatException if the ciphertext fails authentication.
+		 */
+		void decrypt(unsigned char* plaintext, const unsigned char* ciphertext, size_t size);
+	};
+	
 	typedef ByteArray<c_public_key_length> PublicKey;
 	
 	typedef ByteArray<c_private_key_length> SerializedPrivateKey;
 	
 	//! Structure representing cryptographic key pair
+	/**
+	 * PrivateKey is an immutable handle to reference counted key material;
+	 * copying a key shares it. Values derived from the key, such as the
+	 * Diffie-Hellman scalar, are computed once per key and kept in secure
+	 * memory until the last copy is destroyed.
+	 */
 	class PrivateKey
 	{
 		protected:
-		gcry_sexp_t m_private_key;
-		PublicKey m_public_key;
+		struct Data;
+		std::shared_ptr<Data> m_data;
 		
 		explicit PrivateKey(gcry_sexp_t sexp);
 		
 		public:
 		/** Constructor */
 		PrivateKey();
-
-		/** Copy constructor */
-		PrivateKey(const PrivateKey& other);
-
-		/** Assignment operator */
-		PrivateKey& operator=(const PrivateKey& other);
-
-		/** Destructor */
-		~PrivateKey();
 		
 		bool is_null() const
 		{
-			return m_private_key == nullptr;
+			return !m_data;
 		}
 		
-		gcry_sexp_t sexp() const
-		{
-			return m_private_key;
-		}
+		gcry_sexp_t sexp() const;
+		
+		/** Return the expanded private scalar, in the form gcry_pk_encrypt() takes */
+		gcry_sexp_t scalar_sexp() const;
 		
 		/** Return the public key */
-		const PublicKey& public_key() const
-		{
-			return m_public_key;
-		}
+		const PublicKey& public_key() const;
 		
 		/** Generate a cryptographic key pair */
 		static PrivateKey generate(bool transient);
@@ -115,10 +224,36 @@ namespace np1sec
 		
 		std::string decrypt(const std::string& ciphertext, const SymmetricKey& key);
 		
+		/** True if the CPU has instructions that accelerate AES */
+		bool hardware_aes_supported();
+		
+		/** The suite this machine runs fastest: AES-256-GCM with hardware AES, ChaCha20-Poly1305 otherwise */
+		CipherSuite preferred_cipher_suite();
+		
 		Signature sign(const std::string& payload, const PrivateKey& key);
 		
+		/*
+		 * Checks the cofactored Ed25519 equation [8][S]B = [8]R + [8][k]A,
+		 * as RFC 8032 permits, so that verify_batch() can reach the same
+		 * verdict for every signature.
+		 */
 		bool verify(const std::string& payload, const Signature& signature, const PublicKey& key);
 		
+		struct SignatureVerification
+		{
+			std::string payload;
+			Signature signature;
+			PublicKey public_key;
+		};
+		/*
+		 * Verifies many signatures at once using randomized batch
+		 * verification, returning one result per entry. When a batch
+		 * fails it is split to find the bad signatures, so the results
+		 * match those of verify() for each entry individually.
+		 * test/benchmark/signature.cc compares the two.
+		 */
+		std::vector<bool> verify_batch(const std::vector<SignatureVerification>& batch);
+		
 		Hash triple_diffie_hellman(
 			const PrivateKey& my_long_term_key,
 			const PrivateKey& my_ephemeral_key,
@@ -140,6 +275,21 @@ namespace np1sec
 			const Hash& nonce,
 			const std::string& username
 		);
+		
+		/*
+		 * verify() and the Diffie-Hellman functions look public keys up in a
+		 * process-wide, bounded LRU cache of their prepared gcrypt forms.
+		 */
+		struct PublicKeyCacheStatistics
+		{
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t evictions;
+			size_t size;
+			size_t capacity;
+		};
+		PublicKeyCacheStatistics public_key_cache_statistics();
+		void set_public_key_cache_capacity(size_t capacity);
 	}
 }
 
@@ -27,6 +27,8 @@ std::ostream& operator<<(std::ostream& os, np1sec::Message::Type type)
 		case Type::Hello: os << "Hello"; break;
 		case Type::RoomAuthenticationRequest: os << "RoomAuthenticationRequest"; break;
 		case Type::RoomAuthentication: os << "RoomAuthentication"; break;
+		case Type::RoomAuthenticationBatch: os << "RoomAuthenticationBatch"; break;
+		case Type::Resume: os << "Resume"; break;
 
 		case Type::Invite: os << "Invite"; break;
 		case Type::ConversationStatus: os << "ConversationStatus"; break;
@@ -65,6 +67,9 @@ std::ostream& operator<<(std::ostream& os, const np1sec::Hash& hash)
 std::ostream& operator<<(std::ostream& os, const np1sec::HelloMessage& msg)
 {
 	os << "reply:" << msg.reply << " reply_to_username:" << msg.reply_to_username;
+	if (msg.aggregated_join) {
+		os << " roster:" << msg.roster.size();
+	}
 	return os;
 }
 
@@ -81,6 +86,18 @@ std::ostream& operator<<(std::ostream& os, const np1sec::RoomAuthenticationMessa
 	return os;
 }
 
+std::ostream& operator<<(std::ostream& os, const np1sec::ResumeMessage& msg)
+{
+	os << "counter:" << msg.counter;
+	return os;
+}
+
+std::ostream& operator<<(std::ostream& os, const np1sec::RoomAuthenticationBatchMessage& msg)
+{
+	os << "authentications:" << msg.authentications.size();
+	return os;
+}
+
 std::ostream& operator<<(std::ostream& os, const np1sec::InviteMessage& msg)
 {
 	os << "username:" << msg.username;
@@ -200,7 +217,8 @@ std::ostream& operator<<(std::ostream& os, const np1sec::KeyExchangeSecretShareM
 std::ostream& operator<<(std::ostream& os, const np1sec::KeyExchangeAcceptanceMessage& msg)
 {
 	os << "key_id:" << msg.key_id
-		<< " key_hash:" << msg.key_hash;
+		<< " key_hash:" << msg.key_hash
+		<< " cipher_suite:" << int(msg.cipher_suite);
 	return os;
 }
 
@@ -247,6 +265,8 @@ std::ostream& operator<<(std::ostream& os, const np1sec::Message& msg)
 		case Type::Quit: os << msg.type << " " << QuitMessage::decode(msg); break;
 		case Type::RoomAuthenticationRequest: os << msg.type << " " << RoomAuthenticationRequestMessage::decode(msg); break;
 		case Type::RoomAuthentication: os << msg.type << " " << RoomAuthenticationMessage::decode(msg); break;
+		case Type::RoomAuthenticationBatch: os << msg.type << " " << RoomAuthenticationBatchMessage::decode(msg); break;
+		case Type::Resume: os << msg.type << " " << ResumeMessage::decode(msg); break;
 		case Type::Invite: os << ConvMsg<InviteMessage>{msg}; break;
 		case Type::ConsistencyCheck: os << ConvMsg<ConsistencyCheckMessage>{msg}; break;
 		case Type::ConversationStatus: os << ConvMsg<ConversationStatusMessage>{msg}; break;
@@ -0,0 +1,90 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "crypto.h"
+#include "echoqueue.h"
+
+namespace np1sec
+{
+
+const size_t c_initial_capacity = 16;
+
+EchoQueue::EchoQueue():
+	m_buffer(c_initial_capacity),
+	m_front(0),
+	m_size(0)
+{}
+
+void EchoQueue::push(const std::string& message)
+{
+	if (m_size == m_buffer.size()) {
+		std::vector<Fingerprint> buffer(m_buffer.size() * 2);
+		for (size_t i = 0; i < m_size; i++) {
+			buffer[i] = m_buffer[(m_front + i) & (m_buffer.size() - 1)];
+		}
+		m_buffer = std::move(buffer);
+		m_front = 0;
+	}
+	
+	m_buffer[(m_front + m_size) & (m_buffer.size() - 1)] = fingerprint(message);
+	m_size++;
+}
+
+bool EchoQueue::pop_if_front(const std::string& message)
+{
+	if (m_size == 0) {
+		return false;
+	}
+	
+	const Fingerprint& front = m_buffer[m_front];
+	if (front.length != message.size()) {
+		return false;
+	}
+	if (front.hash != fingerprint(message).hash) {
+		return false;
+	}
+	
+	m_front = (m_front + 1) & (m_buffer.size() - 1);
+	m_size--;
+	return true;
+}
+
+void EchoQueue::clear()
+{
+	m_front = 0;
+	m_size = 0;
+}
+
+/*
+ * A truncated SHA-256; matching an echo needs a second preimage of a
+ * message of the same length, not merely a collision.
+ */
+EchoQueue::Fingerprint EchoQueue::fingerprint(const std::string& message)
+{
+	Hash hash = crypto::hash(message);
+	Fingerprint result;
+	result.hash = 0;
+	for (size_t i = 0; i < sizeof(result.hash); i++) {
+		result.hash = (result.hash << 8) | hash.buffer[i];
+	}
+	result.length = message.size();
+	return result;
+}
+
+} // namespace np1sec
@@ -0,0 +1,81 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef SRC_ECHOQUEUE_H_
+#define SRC_ECHOQUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace np1sec
+{
+
+/*
+ * The messages we have sent to the room but have not seen echoed back yet,
+ * in sending order. Only a fixed-size fingerprint of each message is kept,
+ * so that neither memory use nor matching an echo depends on the size of
+ * the messages. The fingerprints live in a ring buffer that only grows
+ * when more messages are in flight than ever before.
+ */
+class EchoQueue
+{
+	public:
+	EchoQueue();
+	
+	void push(const std::string& message);
+	
+	/*
+	 * If \p message is the oldest message still in flight, remove it and
+	 * return true. Otherwise leave the queue untouched and return false.
+	 */
+	bool pop_if_front(const std::string& message);
+	
+	void clear();
+	
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+	
+	size_t size() const
+	{
+		return m_size;
+	}
+	
+	protected:
+	struct Fingerprint
+	{
+		uint64_t hash;
+		size_t length;
+	};
+	
+	static Fingerprint fingerprint(const std::string& message);
+	
+	protected:
+	// the capacity is always a power of two
+	std::vector<Fingerprint> m_buffer;
+	size_t m_front;
+	size_t m_size;
+};
+
+} // namespace np1sec
+
+#endif
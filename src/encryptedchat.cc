@@ -17,6 +17,7 @@
  */
 
 #include "conversation.h"
+#include "ephemeralkeypool.h"
 #include "encryptedchat.h"
 #include "room.h"
 
@@ -36,7 +37,7 @@ void EncryptedChat::unserialize_key_exchange(const KeyExchangeState& exchange)
 {
 	assert(!m_key_exchanges.count(exchange.key_id));
 	
-	std::unique_ptr<KeyExchange> key_exchange(new KeyExchange(exchange));
+	std::unique_ptr<KeyExchange> key_exchange(new KeyExchange(exchange, m_conversation->hash_suite()));
 	insert_key_exchange(std::move(key_exchange));
 }
 
@@ -95,7 +96,7 @@ void EncryptedChat::create_solo_session(const Hash& session_id)
 	
 	m_session_queue.push_back(session_id);
 	
-	PrivateKey session_private_key = PrivateKey::generate(true);
+	PrivateKey session_private_key = EphemeralKeyPool::instance().take();
 	KeyExchange::AcceptedUser self_user;
 	self_user.username = m_conversation->room()->username();
 	self_user.long_term_public_key = m_conversation->room()->public_key();
@@ -109,7 +110,7 @@ void EncryptedChat::create_solo_session(const Hash& session_id)
 	SessionData session;
 	session.active = true;
 	session.participants.insert(self);
-	session.session = std::unique_ptr<Session>(new Session(m_conversation, session_id, accepted_users, session_symmetric_key, session_private_key));
+	session.session = std::unique_ptr<Session>(new Session(m_conversation, session_id, accepted_users, session_symmetric_key, m_conversation->room()->preferred_cipher_suite(), session_private_key));
 	m_sessions[session_id] = std::move(session);
 	
 	prepare_session_replacement(session_id);
@@ -183,6 +184,7 @@ void EncryptedChat::user_public_key(const std::string& username, const Hash& key
 	assert(m_key_exchanges.count(key_id));
 	assert(m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::PublicKey);
 	m_key_exchanges[key_id].key_exchange->set_public_key(username, public_key);
+	m_conversation->invalidate_key_exchange_status();
 	if (m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::SecretShare) {
 		m_conversation->add_key_exchange_event(Message::Type::KeyExchangeSecretShare, key_id, m_key_exchanges.at(key_id).key_exchange->users());
 		
@@ -206,6 +208,7 @@ void EncryptedChat::user_secret_share(const std::string& username, const Hash& k
 		return;
 	}
 	m_key_exchanges[key_id].key_exchange->set_secret_share(username, secret_share);
+	m_conversation->invalidate_key_exchange_status();
 	if (m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::Acceptance) {
 		m_conversation->add_key_exchange_event(Message::Type::KeyExchangeAcceptance, key_id, m_key_exchanges.at(key_id).key_exchange->users());
 		
@@ -213,17 +216,19 @@ void EncryptedChat::user_secret_share(const std::string& username, const Hash& k
 			KeyExchangeAcceptanceMessage message;
 			message.key_id = key_id;
 			message.key_hash = m_key_exchanges[key_id].key_exchange->key_hash();
+			message.cipher_suite = m_conversation->room()->preferred_cipher_suite();
 			m_conversation->send_message(message.encode());
 		}
 	}
 }
 
-void EncryptedChat::user_key_hash(const std::string& username, const Hash& key_id, const Hash& key_hash)
+void EncryptedChat::user_key_hash(const std::string& username, const Hash& key_id, const Hash& key_hash, CipherSuite cipher_suite)
 {
 	assert(m_participants.count(username));
 	assert(m_key_exchanges.count(key_id));
 	assert(m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::Acceptance);
-	m_key_exchanges[key_id].key_exchange->set_key_hash(username, key_hash);
+	m_key_exchanges[key_id].key_exchange->set_key_hash(username, key_hash, cipher_suite);
+	m_conversation->invalidate_key_exchange_status();
 	if (m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::KeyAccepted) {
 		m_conversation->add_key_exchange_event(Message::Type::KeyActivation, key_id, m_key_exchanges.at(key_id).key_exchange->users());
 		m_latest_session_id = key_id;
@@ -254,6 +259,7 @@ void EncryptedChat::user_private_key(const std::string& username, const Hash& ke
 	assert(m_key_exchanges.count(key_id));
 	assert(m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::Reveal);
 	m_key_exchanges[key_id].key_exchange->set_private_key(username, private_key);
+	m_conversation->invalidate_key_exchange_status();
 	if (m_key_exchanges.at(key_id).key_exchange->state() == KeyExchange::State::RevealFinished) {
 		std::set<std::string> malicious_users = m_key_exchanges.at(key_id).key_exchange->malicious_users();
 		
@@ -327,6 +333,8 @@ void EncryptedChat::insert_key_exchange(std::unique_ptr<KeyExchange>&& key_excha
 	}
 	m_key_exchanges[key_id].has_next = false;
 	m_key_exchange_last = key_id;
+	
+	m_conversation->invalidate_key_exchange_status();
 }
 
 void EncryptedChat::erase_key_exchange(Hash key_id)
@@ -365,6 +373,8 @@ void EncryptedChat::erase_key_exchange(Hash key_id)
 		m_participants[username].key_exchanges.erase(key_id);
 	}
 	m_key_exchanges.erase(key_id);
+	
+	m_conversation->invalidate_key_exchange_status();
 }
 
 void EncryptedChat::create_key_exchange()
@@ -376,7 +386,7 @@ void EncryptedChat::create_key_exchange()
 	for (const auto& i : m_participants) {
 		users[i.second.username] = i.second.long_term_public_key;
 	}
-	std::unique_ptr<KeyExchange> exchange(new KeyExchange(key_id, users, m_conversation->room()));
+	std::unique_ptr<KeyExchange> exchange(new KeyExchange(key_id, users, m_conversation->hash_suite(), m_conversation->room()));
 	insert_key_exchange(std::move(exchange));
 	
 	m_conversation->add_key_exchange_event(Message::Type::KeyExchangePublicKey, key_id, m_key_exchanges.at(key_id).key_exchange->users());
@@ -396,8 +406,9 @@ void EncryptedChat::create_session(const Hash& key_id)
 	assert(m_key_exchanges.at(key_id).key_exchange->contains(m_conversation->room()->username()));
 	assert(!m_sessions.count(key_id));
 	
-	std::vector<KeyExchange::AcceptedUser> users = m_key_exchanges.at(key_id).key_exchange->accepted_users();
-	std::unique_ptr<Session> session(new Session(m_conversation, key_id, users, m_key_exchanges.at(key_id).key_exchange->symmetric_key(), m_key_exchanges.at(key_id).key_exchange->private_key()));
+	const KeyExchange& key_exchange = *m_key_exchanges.at(key_id).key_exchange;
+	std::vector<KeyExchange::AcceptedUser> users = key_exchange.accepted_users();
+	std::unique_ptr<Session> session(new Session(m_conversation, key_id, users, key_exchange.symmetric_key(), key_exchange.cipher_suite(), key_exchange.private_key()));
 	
 	for (const auto& user : users) {
 		m_participants[user.username].session_list.push_back(key_id);
@@ -59,6 +59,11 @@ class EncryptedChat
 	{
 		return m_latest_session_id;
 	}
+	CipherSuite session_cipher_suite(const Hash& key_id) const
+	{
+		assert(m_sessions.count(key_id));
+		return m_sessions.at(key_id).session->cipher_suite();
+	}
 	
 	
 	
@@ -73,7 +78,7 @@ class EncryptedChat
 	
 	void user_public_key(const std::string& username, const Hash& key_id, const PublicKey& public_key);
 	void user_secret_share(const std::string& username, const Hash& key_id, const Hash& group_hash, const Hash& secret_share);
-	void user_key_hash(const std::string& username, const Hash& key_id, const Hash& key_hash);
+	void user_key_hash(const std::string& username, const Hash& key_id, const Hash& key_hash, CipherSuite cipher_suite);
 	void user_private_key(const std::string& username, const Hash& key_id, const SerializedPrivateKey& private_key);
 	
 	void user_activation(const std::string& username, const Hash& key_id);
@@ -0,0 +1,122 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ephemeralkeypool.h"
+
+namespace np1sec
+{
+
+EphemeralKeyPool::EphemeralKeyPool(size_t capacity):
+	m_capacity(capacity),
+	m_stopping(false)
+{}
+
+EphemeralKeyPool::~EphemeralKeyPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_refill.notify_all();
+	if (m_worker.joinable()) {
+		m_worker.join();
+	}
+}
+
+PrivateKey EphemeralKeyPool::take()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_capacity > 0 && !m_worker.joinable()) {
+			m_worker = std::thread([this] { run(); });
+		}
+		
+		if (!m_keys.empty()) {
+			PrivateKey key = std::move(m_keys.front());
+			m_keys.pop_front();
+			lock.unlock();
+			m_refill.notify_one();
+			return key;
+		}
+	}
+	
+	m_refill.notify_one();
+	return PrivateKey::generate(true);
+}
+
+void EphemeralKeyPool::set_capacity(size_t capacity)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_capacity = capacity;
+		while (m_keys.size() > m_capacity) {
+			m_keys.pop_back();
+		}
+	}
+	m_refill.notify_one();
+}
+
+size_t EphemeralKeyPool::capacity() const
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_capacity;
+}
+
+size_t EphemeralKeyPool::available() const
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_keys.size();
+}
+
+EphemeralKeyPool& EphemeralKeyPool::instance()
+{
+	static EphemeralKeyPool pool;
+	return pool;
+}
+
+void EphemeralKeyPool::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_refill.wait(lock, [this] { return m_stopping || m_keys.size() < m_capacity; });
+		if (m_stopping) {
+			return;
+		}
+		
+		lock.unlock();
+		PrivateKey key;
+		try {
+			key = PrivateKey::generate(true);
+		} catch(CryptoException) {
+			/*
+			 * Leave the pool short until the next take(), which
+			 * generates its key itself and reports any failure.
+			 */
+			lock.lock();
+			m_refill.wait(lock);
+			continue;
+		}
+		lock.lock();
+		
+		if (m_keys.size() < m_capacity) {
+			m_keys.push_back(std::move(key));
+		}
+	}
+}
+
+} // namespace np1sec
@@ -0,0 +1,75 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_EPHEMERALKEYPOOL_H_
+#define SRC_EPHEMERALKEYPOOL_H_
+
+#include "crypto.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace np1sec
+{
+
+/*
+ * A pool of pre-generated transient key pairs, refilled on a worker
+ * thread, so that key generation stays off the message handling path.
+ *
+ * take() never blocks on the worker; if the pool is empty, it generates
+ * a key synchronously. The worker thread is started on first use.
+ */
+class EphemeralKeyPool
+{
+	public:
+	static const size_t c_default_capacity = 8;
+	
+	explicit EphemeralKeyPool(size_t capacity = c_default_capacity);
+	~EphemeralKeyPool();
+	
+	EphemeralKeyPool(const EphemeralKeyPool&) = delete;
+	EphemeralKeyPool& operator=(const EphemeralKeyPool&) = delete;
+	
+	/** Return a fresh transient key pair */
+	PrivateKey take();
+	
+	/** Change the number of keys kept ready; 0 disables pre-generation */
+	void set_capacity(size_t capacity);
+	size_t capacity() const;
+	size_t available() const;
+	
+	/** The process-wide pool used by the library */
+	static EphemeralKeyPool& instance();
+	
+	protected:
+	void run();
+	
+	protected:
+	mutable std::mutex m_mutex;
+	std::condition_variable m_refill;
+	std::deque<PrivateKey> m_keys;
+	size_t m_capacity;
+	bool m_stopping;
+	std::thread m_worker;
+};
+
+} // namespace np1sec
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "inboundqueue.h"
+
+namespace np1sec
+{
+
+InboundQueue::InboundQueue():
+	m_head(&m_stub),
+	m_tail(&m_stub)
+{
+	m_stub.next.store(nullptr, std::memory_order_relaxed);
+}
+
+InboundQueue::~InboundQueue()
+{
+	while (pop()) {}
+}
+
+void InboundQueue::push(Type type, const std::string& sender, const std::string& text_message)
+{
+	Entry* entry = new Entry;
+	entry->type = type;
+	entry->sender = sender;
+	entry->text_message = text_message;
+	push(entry);
+}
+
+void InboundQueue::push(Entry* entry)
+{
+	entry->next.store(nullptr, std::memory_order_relaxed);
+	Entry* previous = m_head.exchange(entry, std::memory_order_acq_rel);
+	/*
+	 * Until this store, the consumer cannot see past the previous entry.
+	 */
+	previous->next.store(entry, std::memory_order_release);
+}
+
+std::unique_ptr<InboundQueue::Entry> InboundQueue::pop()
+{
+	Entry* tail = m_tail;
+	Entry* next = tail->next.load(std::memory_order_acquire);
+	
+	if (tail == &m_stub) {
+		if (!next) {
+			return nullptr;
+		}
+		m_tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	
+	if (next) {
+		m_tail = next;
+		return std::unique_ptr<Entry>(tail);
+	}
+	
+	if (tail != m_head.load(std::memory_order_acquire)) {
+		return nullptr;
+	}
+	
+	/*
+	 * The tail is the last entry; put the stub behind it so that it can be
+	 * handed out without leaving the list empty.
+	 */
+	push(&m_stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next) {
+		m_tail = next;
+		return std::unique_ptr<Entry>(tail);
+	}
+	return nullptr;
+}
+
+} // namespace np1sec
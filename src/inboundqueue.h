@@ -0,0 +1,84 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef SRC_INBOUNDQUEUE_H_
+#define SRC_INBOUNDQUEUE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace np1sec
+{
+
+/*
+ * Room input handed over from arbitrary threads to the thread that owns
+ * the room. Any number of threads may push concurrently without locking;
+ * only the owning thread may pop. Entries pop in the order their pushes
+ * took effect, so entries pushed by the same thread keep their order.
+ *
+ * This is an intrusive linked list with a stub node, after Dmitry Vyukov's
+ * MPSC queue: a push is one atomic exchange on the head plus one store.
+ */
+class InboundQueue
+{
+	public:
+	enum class Type { MessageReceived, UserLeft };
+	
+	struct Entry
+	{
+		Type type;
+		std::string sender;
+		std::string text_message;
+		
+		std::atomic<Entry*> next;
+	};
+	
+	InboundQueue();
+	~InboundQueue();
+	
+	InboundQueue(const InboundQueue&) = delete;
+	InboundQueue& operator=(const InboundQueue&) = delete;
+	
+	/*
+	 * Safe to call from any thread.
+	 */
+	void push(Type type, const std::string& sender, const std::string& text_message);
+	
+	/*
+	 * Owning thread only. Returns nullptr when the queue is empty, or when
+	 * the oldest entry is still being pushed; the pushing thread notices
+	 * its entry is pending once its push completes.
+	 */
+	std::unique_ptr<Entry> pop();
+	
+	protected:
+	void push(Entry* entry);
+	
+	protected:
+	Entry m_stub;
+	// producers append here
+	std::atomic<Entry*> m_head;
+	// the consumer pops here
+	Entry* m_tail;
+};
+
+} // namespace np1sec
+
+#endif
@@ -156,6 +156,9 @@ class ConversationInterface
 
 
 
+//! UserPresence
+enum class UserPresence { Unauthenticated, Authenticated };
+
 //! Room interface
 class RoomInterface
 {
@@ -173,6 +176,21 @@ class RoomInterface
 	 */
 	virtual void send_message(const std::string& message) = 0;
 
+	/**
+	 * Used by the library to decide whether messages may be sent
+	 * as raw binary frames rather than base64 armored text.
+	 *
+	 * Return true only if messages passed to RoomInterface::send_message
+	 * reach the Room::message_received function of every user unmodified,
+	 * regardless of their content. The library only sends binary frames
+	 * once every user in the room has announced a binary-safe transport;
+	 * rooms containing other users keep using the text armor.
+	 */
+	virtual bool binary_transport() const
+	{
+		return false;
+	}
+
 	/**
 	 * Used by the library to set timers 
 	 * 
@@ -196,7 +214,20 @@ class RoomInterface
 	 * * After the room creating this token is destroyed
 	 */
 	virtual TimerToken* set_timer(uint32_t interval, TimerCallback* callback) = 0;
-	
+
+	/**
+	 * Used by the library to ask for Room::process_queue to be called
+	 * once input was queued through Room::queue_message_received or
+	 * Room::queue_user_left.
+	 *
+	 * This is executed on the thread that queued the input, which need
+	 * not be the room's thread. The implementation must not call into
+	 * the room directly, but schedule Room::process_queue on the room's
+	 * own thread (e.g. by posting it to its event loop). It is not
+	 * executed again until Room::process_queue has been called.
+	 */
+	virtual void queue_ready() {}
+
 	/*
 	 * Callbacks
 	 */
@@ -223,8 +254,31 @@ class RoomInterface
 	 */
 	virtual void user_joined(const std::string& username, const PublicKey& public_key) = 0;
 
+	/**
+	 * Indicate that a user in this communication channel is using (n+1)sec,
+	 * and whether she's been proven to possess the private key corresponding
+	 * to the \p public_key yet.
+	 *
+	 * Users are only reported as UserPresence::Unauthenticated when lazy
+	 * room authentication is enabled (see Room::set_lazy_authentication).
+	 * Such users are reported again as UserPresence::Authenticated once we
+	 * invite them or share a conversation with them.
+	 *
+	 * By default, authenticated users are passed on to user_joined(username,
+	 * public_key) and unauthenticated users are ignored.
+	 */
+	virtual void user_joined(const std::string& username, const PublicKey& public_key, UserPresence presence)
+	{
+		if (presence == UserPresence::Authenticated) {
+			user_joined(username, public_key);
+		}
+	}
+
 	/**
 	 * Executed when the library detected that a user has left.
+	 *
+	 * With lazy room authentication, this includes users that were only
+	 * reported as UserPresence::Unauthenticated.
 	 */
 	virtual void user_left(const std::string& username, const PublicKey& public_key) = 0;
 
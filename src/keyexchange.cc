@@ -16,17 +16,22 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "ephemeralkeypool.h"
 #include "keyexchange.h"
 #include "room.h"
+#include "threadpool.h"
+
+#include <iterator>
 
 namespace np1sec
 {
 
-KeyExchange::KeyExchange(const Hash& key_id, const std::map<std::string, PublicKey>& participants, Room* room):
+KeyExchange::KeyExchange(const Hash& key_id, const std::map<std::string, PublicKey>& participants, HashSuite hash_suite, Room* room):
 	m_key_id(key_id),
+	m_hash_suite(hash_suite),
 	m_room(room),
 	m_state(State::PublicKey),
-	m_ephemeral_private_key(PrivateKey::generate(true))
+	m_ephemeral_private_key(EphemeralKeyPool::instance().take())
 {
 	if (!m_room || !participants.count(m_room->username())) {
 		m_room = nullptr;
@@ -39,17 +44,37 @@ KeyExchange::KeyExchange(const Hash& key_id, const std::map<std::string, PublicK
 		participant.has_ephemeral_public_key = false;
 		participant.has_secret_share = false;
 		participant.has_key_hash = false;
+		participant.cipher_suite = CipherSuite::Aes256Gcm;
 		participant.has_ephemeral_private_key = false;
 		m_participants[i.first] = std::move(participant);
 	}
 	
 	m_contributions_remaining = m_participants.size();
+	
+	m_has_neighbour_token[0] = false;
+	m_has_neighbour_token[1] = false;
+	if (m_room) {
+		auto self_iterator = m_participants.find(m_room->username());
+		assert(self_iterator != m_participants.end());
+		
+		auto right_iterator = std::next(self_iterator);
+		if (right_iterator == m_participants.end()) {
+			right_iterator = m_participants.begin();
+		}
+		m_neighbours[0] = right_iterator->first;
+		
+		auto left_iterator = self_iterator == m_participants.begin() ? std::prev(m_participants.end()) : std::prev(self_iterator);
+		m_neighbours[1] = left_iterator->first;
+	}
 }
 
-KeyExchange::KeyExchange(const KeyExchangeState& encoded_state):
+KeyExchange::KeyExchange(const KeyExchangeState& encoded_state, HashSuite hash_suite):
+	m_hash_suite(hash_suite),
 	m_room(nullptr)
 {
 	m_contributions_remaining = 0;
+	m_has_neighbour_token[0] = false;
+	m_has_neighbour_token[1] = false;
 	
 	if (encoded_state.state == KeyExchangeState::State::PublicKey) {
 		PublicKeyKeyExchangeState state = PublicKeyKeyExchangeState::decode(encoded_state);
@@ -78,6 +103,7 @@ KeyExchange::KeyExchange(const KeyExchangeState& encoded_state):
 			}
 			p.has_secret_share = false;
 			p.has_key_hash = false;
+			p.cipher_suite = CipherSuite::Aes256Gcm;
 			p.has_ephemeral_private_key = false;
 			m_participants[p.username] = p;
 		}
@@ -109,6 +135,7 @@ KeyExchange::KeyExchange(const KeyExchangeState& encoded_state):
 				m_contributions_remaining++;
 			}
 			p.has_key_hash = false;
+			p.cipher_suite = CipherSuite::Aes256Gcm;
 			p.has_ephemeral_private_key = false;
 			m_participants[p.username] = p;
 		}
@@ -136,6 +163,7 @@ KeyExchange::KeyExchange(const KeyExchangeState& encoded_state):
 			p.has_secret_share = true;
 			p.secret_share = participant.secret_share;
 			p.has_key_hash = participant.has_key_hash;
+			p.cipher_suite = participant.cipher_suite;
 			if (p.has_key_hash) {
 				p.key_hash = participant.key_hash;
 			} else {
@@ -168,6 +196,7 @@ KeyExchange::KeyExchange(const KeyExchangeState& encoded_state):
 			p.has_secret_share = true;
 			p.secret_share = participant.secret_share;
 			p.has_key_hash = true;
+			p.cipher_suite = participant.cipher_suite;
 			p.key_hash = participant.key_hash;
 			p.has_ephemeral_private_key = participant.has_ephemeral_private_key;
 			if (p.has_ephemeral_private_key) {
@@ -234,6 +263,7 @@ KeyExchangeState KeyExchange::encode() const
 			if (p.has_key_hash) {
 				p.key_hash = i.second.key_hash;
 			}
+			p.cipher_suite = i.second.cipher_suite;
 			result.participants.push_back(p);
 		}
 		return result.encode();
@@ -247,6 +277,7 @@ KeyExchangeState KeyExchange::encode() const
 			p.ephemeral_public_key = i.second.ephemeral_public_key;
 			p.secret_share = i.second.secret_share;
 			p.key_hash = i.second.key_hash;
+			p.cipher_suite = i.second.cipher_suite;
 			p.has_ephemeral_private_key = i.second.has_ephemeral_private_key;
 			if (p.has_ephemeral_private_key) {
 				p.ephemeral_private_key = i.second.ephemeral_private_key;
@@ -259,6 +290,17 @@ KeyExchangeState KeyExchange::encode() const
 	}
 }
 
+CipherSuite KeyExchange::cipher_suite() const
+{
+	assert(m_state == State::KeyAccepted);
+	for (const auto& i : m_participants) {
+		if (i.second.cipher_suite == CipherSuite::ChaCha20Poly1305) {
+			return CipherSuite::ChaCha20Poly1305;
+		}
+	}
+	return CipherSuite::Aes256Gcm;
+}
+
 bool KeyExchange::contains(const std::string& username) const
 {
 	return m_participants.count(username) > 0;
@@ -309,6 +351,19 @@ void KeyExchange::set_public_key(const std::string& username, const PublicKey& p
 	
 	m_participants[username].ephemeral_public_key = public_key;
 	m_participants[username].has_ephemeral_public_key = true;
+	
+	/*
+	 * Our secret share needs only our neighbours' keys, plus a group hash
+	 * that is mixed in later; start on the expensive part right away.
+	 */
+	if (m_room && m_contributions_remaining > 1) {
+		for (size_t i = 0; i < 2; i++) {
+			if (username == m_neighbours[i] && !m_has_neighbour_token[i] && !copy_neighbour_token(i)) {
+				compute_neighbour_token(i);
+			}
+		}
+	}
+	
 	m_contributions_remaining--;
 	if (m_contributions_remaining == 0) {
 		finish_public_key();
@@ -333,7 +388,7 @@ void KeyExchange::set_secret_share(const std::string& username, const Hash& secr
 	}
 }
 
-void KeyExchange::set_key_hash(const std::string& username, const Hash& key_hash)
+void KeyExchange::set_key_hash(const std::string& username, const Hash& key_hash, CipherSuite cipher_suite)
 {
 	assert(m_state == State::Acceptance);
 	assert(m_participants.count(username));
@@ -345,6 +400,7 @@ void KeyExchange::set_key_hash(const std::string& username, const Hash& key_hash
 	
 	m_participants[username].key_hash = key_hash;
 	m_participants[username].has_key_hash = true;
+	m_participants[username].cipher_suite = cipher_suite;
 	m_contributions_remaining--;
 	if (m_contributions_remaining == 0) {
 		finish_acceptance();
@@ -381,43 +437,33 @@ void KeyExchange::finish_public_key()
 	m_group_hash = compute_group_hash();
 	
 	if (m_room) {
-		auto self_iterator = m_participants.find(m_room->username());
-		assert(self_iterator != m_participants.end());
+		assert(m_participants.count(m_room->username()));
 		
-		const Participant* left_neighbour;
-		if (self_iterator == m_participants.begin()) {
-			left_neighbour = &m_participants.rbegin()->second;
-		} else {
-			auto i = self_iterator;
-			--i;
-			left_neighbour = &i->second;
+		/*
+		 * Normally set_public_key() computed the neighbour tokens as the
+		 * keys arrived; only those still missing are computed here.
+		 */
+		std::vector<size_t> missing;
+		for (size_t i = 0; i < 2; i++) {
+			if (m_has_neighbour_token[i] || copy_neighbour_token(i)) {
+				continue;
+			}
+			if (i == 1 && m_neighbours[1] == m_neighbours[0]) {
+				continue;
+			}
+			missing.push_back(i);
 		}
-		
-		const Participant* right_neighbour;
-		++self_iterator;
-		if (self_iterator == m_participants.end()) {
-			right_neighbour = &m_participants.begin()->second;
-		} else {
-			right_neighbour = &self_iterator->second;
+		ThreadPool::instance().parallel_for(missing.size(), [&] (size_t i) {
+			compute_neighbour_token(missing[i]);
+		});
+		if (!m_has_neighbour_token[1]) {
+			copy_neighbour_token(1);
 		}
+		assert(m_has_neighbour_token[0] && m_has_neighbour_token[1]);
 		
-		auto secret_share = [this] (const Participant* participant) {
-			assert(participant->has_ephemeral_public_key);
-			Hash token = crypto::triple_diffie_hellman(
-				m_room->private_key(),
-				m_ephemeral_private_key,
-				participant->long_term_public_key,
-				participant->ephemeral_public_key
-			);
-			
-			std::string buffer;
-			buffer += token.as_string();
-			buffer += m_group_hash.as_string();
-			return crypto::hash(buffer);
-		};
-		
-		m_right_secret_share = secret_share(right_neighbour);
-		Hash left_secret_share = secret_share(left_neighbour);
+		HashBuilder builder(m_hash_suite);
+		m_right_secret_share = builder.update(m_neighbour_tokens[0]).update(m_group_hash).final();
+		Hash left_secret_share = builder.update(m_neighbour_tokens[1]).update(m_group_hash).final();
 		for (size_t i = 0; i < sizeof(m_secret_share.buffer); i++) {
 			m_secret_share.buffer[i] = m_right_secret_share.buffer[i] ^ left_secret_share.buffer[i];
 		}
@@ -456,16 +502,13 @@ void KeyExchange::finish_secret_share()
 			}
 		}
 		
-		std::string buffer;
+		HashBuilder builder(m_hash_suite, true);
 		for (size_t i = 0; i < secret_shares.size(); i++) {
-			buffer += secret_shares[i].as_string();
+			builder.update(secret_shares[i]);
 		}
-		m_symmetric_key.key = crypto::hash(buffer, true);
+		m_symmetric_key.key = builder.final();
 		
-		std::string key_hash_buffer;
-		key_hash_buffer += m_symmetric_key.key.as_string();
-		key_hash_buffer += m_group_hash.as_string();
-		m_key_hash = crypto::hash(key_hash_buffer, true);
+		m_key_hash = builder.update(m_symmetric_key.key).update(m_group_hash).final();
 	}
 }
 
@@ -519,19 +562,21 @@ void KeyExchange::finish_reveal()
 		return;
 	}
 	
-	std::vector<Hash> right_secret_shares;
-	for (size_t i = 0; i < participants.size(); i++) {
+	std::vector<Hash> tokens(participants.size());
+	ThreadPool::instance().parallel_for(participants.size(), [&] (size_t i) {
 		size_t next = (i + 1) % participants.size();
-		Hash token = crypto::reconstruct_triple_diffie_hellman(
+		tokens[i] = crypto::reconstruct_triple_diffie_hellman(
 			participants[i]->long_term_public_key,
 			private_keys[i],
 			participants[next]->long_term_public_key,
 			private_keys[next]
 		);
-		std::string buffer;
-		buffer += token.as_string();
-		buffer += m_group_hash.as_string();
-		right_secret_shares.push_back(crypto::hash(buffer));
+	});
+	
+	HashBuilder builder(m_hash_suite);
+	std::vector<Hash> right_secret_shares;
+	for (size_t i = 0; i < participants.size(); i++) {
+		right_secret_shares.push_back(builder.update(tokens[i]).update(m_group_hash).final());
 	}
 	
 	for (size_t i = 0; i < participants.size(); i++) {
@@ -549,16 +594,12 @@ void KeyExchange::finish_reveal()
 		return;
 	}
 	
-	std::string buffer;
 	for (size_t i = 0; i < right_secret_shares.size(); i++) {
-		buffer += right_secret_shares[i].as_string();
+		builder.update(right_secret_shares[i]);
 	}
-	Hash symmetric_key = crypto::hash(buffer);
+	Hash symmetric_key = builder.final();
 	
-	std::string key_hash_buffer;
-	key_hash_buffer += symmetric_key.as_string();
-	key_hash_buffer += m_group_hash.as_string();
-	Hash key_hash = crypto::hash(key_hash_buffer);
+	Hash key_hash = builder.update(symmetric_key).update(m_group_hash).final();
 	
 	for (size_t i = 0; i < participants.size(); i++) {
 		if (participants[i]->key_hash != key_hash) {
@@ -571,17 +612,51 @@ void KeyExchange::finish_reveal()
 
 
 
+/*
+ * Touches only the state of this one neighbour, so that both neighbours
+ * can be computed in parallel.
+ */
+void KeyExchange::compute_neighbour_token(size_t neighbour)
+{
+	assert(m_room);
+	
+	const Participant& participant = m_participants.at(m_neighbours[neighbour]);
+	assert(participant.has_ephemeral_public_key);
+	m_neighbour_tokens[neighbour] = crypto::triple_diffie_hellman(
+		m_room->private_key(),
+		m_ephemeral_private_key,
+		participant.long_term_public_key,
+		participant.ephemeral_public_key
+	);
+	m_has_neighbour_token[neighbour] = true;
+}
+
+/*
+ * With two participants, both neighbours are the same user and share a
+ * token. Returns false if there is no token to copy yet.
+ */
+bool KeyExchange::copy_neighbour_token(size_t neighbour)
+{
+	size_t other = 1 - neighbour;
+	if (!m_has_neighbour_token[other] || m_neighbours[other] != m_neighbours[neighbour]) {
+		return false;
+	}
+	m_neighbour_tokens[neighbour] = m_neighbour_tokens[other];
+	m_has_neighbour_token[neighbour] = true;
+	return true;
+}
+
 Hash KeyExchange::compute_group_hash() const
 {
 	assert(m_state >= State::PublicKey);
-	std::string buffer;
+	HashBuilder builder(m_hash_suite);
 	for (const auto& i : m_participants) {
 		assert(i.second.has_ephemeral_public_key);
-		buffer += i.second.username;
-		buffer += i.second.long_term_public_key.as_string();
-		buffer += i.second.ephemeral_public_key.as_string();
+		builder.update(i.second.username);
+		builder.update(i.second.long_term_public_key);
+		builder.update(i.second.ephemeral_public_key);
 	}
-	return crypto::hash(buffer);
+	return builder.final();
 }
 
 } // namespace np1sec
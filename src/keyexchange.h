@@ -44,8 +44,8 @@ class KeyExchange
 	};
 	
 	
-	KeyExchange(const Hash& key_id, const std::map<std::string, PublicKey>& participants, Room* room);
-	KeyExchange(const KeyExchangeState& state);
+	KeyExchange(const Hash& key_id, const std::map<std::string, PublicKey>& participants, HashSuite hash_suite, Room* room);
+	KeyExchange(const KeyExchangeState& state, HashSuite hash_suite);
 	
 	KeyExchangeState encode() const;
 	
@@ -154,6 +154,12 @@ class KeyExchange
 		return output;
 	}
 	
+	/*
+	 * Defined for the KeyAccepted state only. ChaCha20-Poly1305 if any
+	 * participant prefers it, AES-256-GCM otherwise.
+	 */
+	CipherSuite cipher_suite() const;
+	
 	/* Defined for the RevealFinished state only. */
 	const std::set<std::string>& malicious_users() const
 	{
@@ -173,7 +179,7 @@ class KeyExchange
 	void set_secret_share(const std::string& username, const Hash& secret_share);
 	
 	/* Valid only in the Acceptance state. */
-	void set_key_hash(const std::string& username, const Hash& key_hash);
+	void set_key_hash(const std::string& username, const Hash& key_hash, CipherSuite cipher_suite);
 	
 	/* Valid only in the Reveal state. */
 	void set_private_key(const std::string& username, const SerializedPrivateKey& private_key);
@@ -186,6 +192,8 @@ class KeyExchange
 	void finish_acceptance();
 	void finish_reveal();
 	
+	void compute_neighbour_token(size_t neighbour);
+	bool copy_neighbour_token(size_t neighbour);
 	Hash compute_group_hash() const;
 	
 	
@@ -204,6 +212,11 @@ class KeyExchange
 		
 		bool has_key_hash;
 		Hash key_hash;
+		/*
+		 * Known along with the key hash, but only for exchanges we take part in;
+		 * it is not part of the encoded key exchange state.
+		 */
+		CipherSuite cipher_suite;
 		
 		bool has_ephemeral_private_key;
 		SerializedPrivateKey ephemeral_private_key;
@@ -211,12 +224,17 @@ class KeyExchange
 	
 	Hash m_key_id;
 	std::map<std::string, Participant> m_participants;
+	HashSuite m_hash_suite;
 	Room* m_room;
 	
 	State m_state;
 	int m_contributions_remaining;
 	
 	PrivateKey m_ephemeral_private_key;
+	/* Right and left neighbour usernames, and our 3DH tokens with them. */
+	std::string m_neighbours[2];
+	bool m_has_neighbour_token[2];
+	Hash m_neighbour_tokens[2];
 	Hash m_right_secret_share;
 	Hash m_secret_share;
 	SymmetricKey m_symmetric_key;
@@ -25,7 +25,13 @@
 namespace np1sec
 {
 
-const std::string c_np1sec_protocol_name(":o3np1sec0:");
+/*
+ * The trailing digit is the protocol version. Version 1 changed the chat
+ * ciphertext layout and the conversation status hash, so version 0 peers
+ * must not mistake our messages for theirs.
+ */
+const std::string c_np1sec_protocol_name(":o3np1sec1:");
+const std::string c_np1sec_binary_protocol_name("\0o3np1sec1:", 11);
 
 
 
@@ -47,7 +53,7 @@ void encode_integer(MessageBuffer* buffer, T value)
 }
 
 template<typename T>
-T decode_integer(MessageBuffer* buffer)
+T decode_integer(MessageReader* buffer)
 {
 	int shift = 0;
 	T result = 0;
@@ -89,6 +95,24 @@ void MessageBuffer::add_integer(uint64_t number)
 	encode_integer<uint64_t>(this, number);
 }
 
+size_t MessageBuffer::integer_size(uint64_t number)
+{
+	/*
+	 * Mirrors encode_integer<uint64_t>.
+	 */
+	size_t size = 0;
+	int bits_remaining = 64;
+	do {
+		size++;
+		if (bits_remaining == 8) {
+			break;
+		}
+		number = number >> 7;
+		bits_remaining -= 7;
+	} while (number);
+	return size;
+}
+
 void MessageBuffer::add_bytes(const std::string& buffer)
 {
 	append(buffer);
@@ -100,52 +124,63 @@ void MessageBuffer::add_opaque(const std::string& buffer)
 	append(buffer);
 }
 
-void MessageBuffer::check_empty()
+void MessageReader::check_empty()
 {
 	if (!empty()) {
 		throw MessageFormatException();
 	}
 }
 
-bool MessageBuffer::remove_bit()
+bool MessageReader::remove_bit()
 {
 	return remove_byte() != 0;
 }
 
-uint8_t MessageBuffer::remove_byte()
+uint8_t MessageReader::remove_byte()
 {
-	if (size() < 1) {
+	if (empty()) {
 		throw MessageFormatException();
 	}
 	
-	uint8_t result = byte(0);
-	
-	erase(0, 1);
-	
-	return result;
+	return uint8_t(*m_position++);
 }
 
-uint64_t MessageBuffer::remove_integer()
+uint64_t MessageReader::remove_integer()
 {
 	return decode_integer<uint64_t>(this);
 }
 
-std::string MessageBuffer::remove_bytes(size_t size)
+std::string MessageReader::remove_bytes(size_t size)
+{
+	MessageReader reader = remove_reader(size);
+	return std::string(reader.m_position, reader.size());
+}
+
+std::string MessageReader::remove_opaque()
+{
+	return remove_bytes(remove_integer());
+}
+
+MessageReader MessageReader::remove_reader(size_t size)
 {
 	if (this->size() < size) {
 		throw MessageFormatException();
 	}
 	
-	std::string result(*this, 0, size);
-	
-	erase(0, size);
+	MessageReader result(m_position, size);
+	m_position += size;
 	
 	return result;
 }
 
-std::string MessageBuffer::remove_opaque()
+MessageReader MessageReader::remove_opaque_reader()
 {
-	return remove_bytes(remove_integer());
+	return remove_reader(remove_integer());
+}
+
+std::string MessageReader::remove_remaining()
+{
+	return remove_bytes(size());
 }
 
 
@@ -153,35 +188,53 @@ std::string MessageBuffer::remove_opaque()
 std::string Message::encode() const
 {
 	MessageBuffer buffer;
+	buffer.reserve(1 + payload.size());
 	buffer.add_byte(uint8_t(type));
 	buffer.add_bytes(payload);
 	
-	char* base64_buffer = new char[((buffer.size() + 3 - 1) / 3) * 4];
-	size_t base64_size = base64_encode(base64_buffer, reinterpret_cast<const unsigned char*>(buffer.data()), buffer.size());
-	std::string base64_encoded(base64_buffer, base64_size);
-	delete[] base64_buffer;
-	
-	std::string result = c_np1sec_protocol_name;
-	result.append(base64_encoded);
+	std::string result;
+	result.reserve(c_np1sec_protocol_name.size() + base64_encoded_size(buffer.size()));
+	result.append(c_np1sec_protocol_name);
+	base64_encode(&result, reinterpret_cast<const unsigned char*>(buffer.data()), buffer.size());
+	return result;
+}
+
+std::string Message::encode_binary() const
+{
+	std::string result;
+	result.reserve(c_np1sec_binary_protocol_name.size() + 1 + payload.size());
+	result.append(c_np1sec_binary_protocol_name);
+	result.push_back(char(uint8_t(type)));
+	result.append(payload);
 	return result;
 }
 
 Message Message::decode(const std::string& encoded)
 {
-	if (encoded.substr(0, c_np1sec_protocol_name.size()) != c_np1sec_protocol_name) {
+	std::string decoded;
+	const char* data;
+	size_t size;
+	if (encoded.compare(0, c_np1sec_binary_protocol_name.size(), c_np1sec_binary_protocol_name) == 0) {
+		data = encoded.data() + c_np1sec_binary_protocol_name.size();
+		size = encoded.size() - c_np1sec_binary_protocol_name.size();
+	} else if (encoded.compare(0, c_np1sec_protocol_name.size(), c_np1sec_protocol_name) == 0) {
+		if (!base64_decode(
+			&decoded,
+			encoded.data() + c_np1sec_protocol_name.size(),
+			encoded.size() - c_np1sec_protocol_name.size()
+		)) {
+			throw MessageFormatException();
+		}
+		data = decoded.data();
+		size = decoded.size();
+	} else {
 		throw MessageFormatException();
 	}
-	std::string base64_payload = encoded.substr(c_np1sec_protocol_name.size());
-	unsigned char* base64_buffer = new unsigned char[((base64_payload.size() + 4 - 1) / 4) * 3];
-	size_t base64_size = base64_decode(base64_buffer, base64_payload.data(), base64_payload.size());
-	std::string base64_decoded(reinterpret_cast<char *>(base64_buffer), base64_size);
-	delete[] base64_buffer;
-	// TODO: reject malformed base64 for strict compatibility
-	
-	MessageBuffer buffer(base64_decoded);
+	
+	MessageReader buffer(data, size);
 	Message message;
 	message.type = Message::Type(buffer.remove_byte());
-	message.payload = buffer;
+	message.payload = buffer.remove_remaining();
 	
 	return message;
 }
@@ -231,39 +284,63 @@ Message ConversationMessage::sign(const UnsignedConversationMessage& message, co
 
 ConversationMessage ConversationMessage::decode(const Message& encoded)
 {
-	MessageBuffer buffer(encoded.payload);
+	MessageReader buffer(encoded.payload);
 	
 	ConversationMessage result;
 	result.type = encoded.type;
 	result.conversation_public_key = buffer.remove_public_key();
 	result.signature = buffer.remove_signature();
-	result.payload = buffer;
+	result.payload = buffer.remove_remaining();
 	return result;
 }
 
-bool ConversationMessage::verify() const
+std::string ConversationMessage::signed_body() const
 {
 	std::string signed_body;
+	signed_body.reserve(1 + payload.size());
 	signed_body.push_back(uint8_t(type));
 	signed_body += payload;
-	
-	return crypto::verify(std::move(signed_body), signature, conversation_public_key);
+	return signed_body;
+}
+
+bool ConversationMessage::verify() const
+{
+	return crypto::verify(signed_body(), signature, conversation_public_key);
 }
 
 
 
 template<class MessageType>
-static MessageBuffer get_message_payload(const MessageType& message, Message::Type expected_type)
+static MessageReader get_message_payload(const MessageType& message, Message::Type expected_type)
 {
 	if (message.type != expected_type) {
 		throw MessageFormatException();
 	}
-	return MessageBuffer(message.payload);
+	return MessageReader(message.payload);
 }
 
-static MessageBuffer encode_user_set(const ConversationStatusMessage& status, bool include_invites, const std::set<std::string>& users)
+static CipherSuite remove_cipher_suite(MessageReader* buffer)
 {
-	MessageBuffer buffer;
+	uint8_t cipher_suite = buffer->remove_byte();
+	if (cipher_suite > uint8_t(CipherSuite::ChaCha20Poly1305)) {
+		throw MessageFormatException();
+	}
+	return CipherSuite(cipher_suite);
+}
+
+static size_t user_set_size(const ConversationStatusMessage& status, bool include_invites)
+{
+	size_t users = status.participants.size();
+	if (include_invites) {
+		users += status.confirmed_invites.size();
+	}
+	return (users + 7) / 8;
+}
+
+static void add_user_set(MessageBuffer* buffer, const ConversationStatusMessage& status, bool include_invites, const std::set<std::string>& users)
+{
+	buffer->add_integer(user_set_size(status, include_invites));
+	
 	uint8_t byte = 0;
 	int bits = 8;
 	
@@ -273,7 +350,7 @@ static MessageBuffer encode_user_set(const ConversationStatusMessage& status, bo
 			byte |= (1 << bits);
 		}
 		if (bits == 0) {
-			buffer.add_byte(byte);
+			buffer->add_byte(byte);
 			byte = 0;
 			bits = 8;
 		}
@@ -286,7 +363,7 @@ static MessageBuffer encode_user_set(const ConversationStatusMessage& status, bo
 				byte |= (1 << bits);
 			}
 			if (bits == 0) {
-				buffer.add_byte(byte);
+				buffer->add_byte(byte);
 				byte = 0;
 				bits = 8;
 			}
@@ -294,15 +371,12 @@ static MessageBuffer encode_user_set(const ConversationStatusMessage& status, bo
 	}
 	
 	if (bits < 8) {
-		buffer.add_byte(byte);
+		buffer->add_byte(byte);
 	}
-	
-	return buffer;
 }
 
-static std::set<std::string> decode_user_set(const ConversationStatusMessage& status, bool include_invites, const std::string& encoded)
+static std::set<std::string> decode_user_set(const ConversationStatusMessage& status, bool include_invites, MessageReader buffer)
 {
-	MessageBuffer buffer(encoded);
 	std::set<std::string> output;
 	uint8_t byte = 0;
 	int bits = 0;
@@ -366,7 +440,7 @@ Message QuitMessage::encode() const
 
 QuitMessage QuitMessage::decode(const Message& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Quit));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Quit);
 	
 	QuitMessage result;
 	result.nonce = buffer.remove_hash();
@@ -383,13 +457,36 @@ Message HelloMessage::encode() const
 	if (reply) {
 		buffer.add_opaque(reply_to_username);
 	}
+	if (binary_transport || blake2_hash_suite || aggregated_join) {
+		buffer.add_bit(binary_transport);
+	}
+	if (blake2_hash_suite || aggregated_join) {
+		buffer.add_bit(blake2_hash_suite);
+	}
+	if (aggregated_join) {
+		buffer.add_hash(authentication_nonce);
+		buffer.add_bit(has_authentication_confirmation);
+		if (has_authentication_confirmation) {
+			buffer.add_hash(authentication_confirmation);
+		}
+		MessageBuffer roster_buffer;
+		for (const RosterEntry& entry : roster) {
+			MessageBuffer entry_buffer;
+			entry_buffer.add_opaque(entry.username);
+			entry_buffer.add_public_key(entry.long_term_public_key);
+			entry_buffer.add_public_key(entry.ephemeral_public_key);
+			entry_buffer.add_hash(entry.authentication_nonce);
+			roster_buffer.add_opaque(entry_buffer);
+		}
+		buffer.add_opaque(roster_buffer);
+	}
 	
 	return Message(Message::Type::Hello, buffer);
 }
 
 HelloMessage HelloMessage::decode(const Message& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Hello));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Hello);
 	
 	HelloMessage result;
 	result.long_term_public_key = buffer.remove_public_key();
@@ -398,6 +495,31 @@ HelloMessage HelloMessage::decode(const Message& encoded)
 	if (result.reply) {
 		result.reply_to_username = buffer.remove_opaque();
 	}
+	if (!buffer.empty()) {
+		result.binary_transport = buffer.remove_bit();
+	}
+	if (!buffer.empty()) {
+		result.blake2_hash_suite = buffer.remove_bit();
+	}
+	if (!buffer.empty()) {
+		result.aggregated_join = true;
+		result.authentication_nonce = buffer.remove_hash();
+		result.has_authentication_confirmation = buffer.remove_bit();
+		if (result.has_authentication_confirmation) {
+			result.authentication_confirmation = buffer.remove_hash();
+		}
+		MessageReader roster_buffer = buffer.remove_opaque_reader();
+		while (!roster_buffer.empty()) {
+			MessageReader entry_buffer = roster_buffer.remove_opaque_reader();
+			RosterEntry entry;
+			entry.username = entry_buffer.remove_opaque();
+			entry.long_term_public_key = entry_buffer.remove_public_key();
+			entry.ephemeral_public_key = entry_buffer.remove_public_key();
+			entry.authentication_nonce = entry_buffer.remove_hash();
+			entry_buffer.check_empty();
+			result.roster.push_back(std::move(entry));
+		}
+	}
 	buffer.check_empty();
 	return result;
 }
@@ -413,7 +535,7 @@ Message RoomAuthenticationRequestMessage::encode() const
 
 RoomAuthenticationRequestMessage RoomAuthenticationRequestMessage::decode(const Message& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::RoomAuthenticationRequest));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::RoomAuthenticationRequest);
 	
 	RoomAuthenticationRequestMessage result;
 	result.username = buffer.remove_opaque();
@@ -433,7 +555,7 @@ Message RoomAuthenticationMessage::encode() const
 
 RoomAuthenticationMessage RoomAuthenticationMessage::decode(const Message& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::RoomAuthentication));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::RoomAuthentication);
 	
 	RoomAuthenticationMessage result;
 	result.username = buffer.remove_opaque();
@@ -442,6 +564,63 @@ RoomAuthenticationMessage RoomAuthenticationMessage::decode(const Message& encod
 	return result;
 }
 
+std::string ResumeMessage::signed_body() const
+{
+	MessageBuffer buffer;
+	buffer.add_byte(uint8_t(Message::Type::Resume));
+	buffer.add_integer(counter);
+	return std::move(buffer);
+}
+
+Message ResumeMessage::encode() const
+{
+	MessageBuffer buffer;
+	buffer.add_integer(counter);
+	buffer.add_signature(signature);
+	
+	return Message(Message::Type::Resume, buffer);
+}
+
+ResumeMessage ResumeMessage::decode(const Message& encoded)
+{
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Resume);
+	
+	ResumeMessage result;
+	result.counter = buffer.remove_integer();
+	result.signature = buffer.remove_signature();
+	buffer.check_empty();
+	return result;
+}
+
+Message RoomAuthenticationBatchMessage::encode() const
+{
+	MessageBuffer buffer;
+	for (const RoomAuthenticationMessage& authentication : authentications) {
+		MessageBuffer authentication_buffer;
+		authentication_buffer.add_opaque(authentication.username);
+		authentication_buffer.add_hash(authentication.authentication_confirmation);
+		buffer.add_opaque(authentication_buffer);
+	}
+	
+	return Message(Message::Type::RoomAuthenticationBatch, buffer);
+}
+
+RoomAuthenticationBatchMessage RoomAuthenticationBatchMessage::decode(const Message& encoded)
+{
+	MessageReader buffer = get_message_payload(encoded, Message::Type::RoomAuthenticationBatch);
+	
+	RoomAuthenticationBatchMessage result;
+	while (!buffer.empty()) {
+		MessageReader authentication_buffer = buffer.remove_opaque_reader();
+		RoomAuthenticationMessage authentication;
+		authentication.username = authentication_buffer.remove_opaque();
+		authentication.authentication_confirmation = authentication_buffer.remove_hash();
+		authentication_buffer.check_empty();
+		result.authentications.push_back(std::move(authentication));
+	}
+	return result;
+}
+
 UnsignedConversationMessage InviteMessage::encode() const
 {
 	MessageBuffer buffer;
@@ -453,7 +632,7 @@ UnsignedConversationMessage InviteMessage::encode() const
 
 InviteMessage InviteMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Invite));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Invite);
 	
 	InviteMessage result;
 	result.username = buffer.remove_opaque();
@@ -462,85 +641,291 @@ InviteMessage InviteMessage::decode(const UnsignedConversationMessage& encoded)
 	return result;
 }
 
-UnsignedConversationMessage ConversationStatusMessage::encode() const
+/*
+ * The status message consists of nested opaque fields. Their sizes are
+ * computed up front so that every field can be written, length prefix
+ * first, straight into a single buffer of the right size.
+ */
+static size_t encoded_size(const ConversationStatusMessage::Participant& participant)
 {
-	MessageBuffer buffer;
-	buffer.add_opaque(invitee_username);
-	buffer.add_public_key(invitee_long_term_public_key);
-	
-	MessageBuffer participants_buffer;
-	for (const Participant& participant : participants) {
-		MessageBuffer participant_buffer;
-		participant_buffer.add_opaque(participant.username);
-		participant_buffer.add_public_key(participant.long_term_public_key);
-		participant_buffer.add_public_key(participant.conversation_public_key);
-		participants_buffer.add_opaque(participant_buffer);
+	return MessageBuffer::opaque_size(participant.username.size()) + 2 * c_public_key_length;
+}
+
+static size_t encoded_size(const ConversationStatusMessage::ConfirmedInvite& invite)
+{
+	return
+		  MessageBuffer::opaque_size(invite.inviter.size())
+		+ MessageBuffer::opaque_size(invite.username.size())
+		+ 2 * c_public_key_length
+		+ 1;
+}
+
+static size_t encoded_size(const ConversationStatusMessage::UnconfirmedInvite& invite)
+{
+	return
+		  MessageBuffer::opaque_size(invite.inviter.size())
+		+ MessageBuffer::opaque_size(invite.username.size())
+		+ c_public_key_length;
+}
+
+static size_t encoded_size(const KeyExchangeState& exchange)
+{
+	return c_hash_length + 1 + MessageBuffer::opaque_size(exchange.payload.size());
+}
+
+static size_t encoded_size(const ConversationEvent& event)
+{
+	return 1 + MessageBuffer::opaque_size(event.payload.size());
+}
+
+template<class T>
+static size_t opaque_list_size(const std::vector<T>& list)
+{
+	size_t size = 0;
+	for (const T& element : list) {
+		size += MessageBuffer::opaque_size(encoded_size(element));
+	}
+	return size;
+}
+
+template<class T>
+static size_t list_size(const std::vector<T>& list)
+{
+	size_t size = 0;
+	for (const T& element : list) {
+		size += encoded_size(element);
 	}
-	buffer.add_opaque(participants_buffer);
-	
-	MessageBuffer confirmed_invites_buffer;
-	for (const ConfirmedInvite& invite : confirmed_invites) {
-		MessageBuffer invite_buffer;
-		invite_buffer.add_opaque(invite.inviter);
-		invite_buffer.add_opaque(invite.username);
-		invite_buffer.add_public_key(invite.long_term_public_key);
-		invite_buffer.add_public_key(invite.conversation_public_key);
-		invite_buffer.add_bit(invite.authenticated);
-		confirmed_invites_buffer.add_opaque(invite_buffer);
+	return size;
+}
+
+static size_t peer_sets_size(const ConversationStatusMessage& status)
+{
+	return status.participants.size() * MessageBuffer::opaque_size(user_set_size(status, true));
+}
+
+static size_t participants_section_size(const ConversationStatusMessage& status)
+{
+	return MessageBuffer::opaque_size(opaque_list_size(status.participants));
+}
+
+static size_t invites_section_size(const ConversationStatusMessage& status)
+{
+	return
+		  MessageBuffer::opaque_size(opaque_list_size(status.confirmed_invites))
+		+ MessageBuffer::opaque_size(opaque_list_size(status.unconfirmed_invites));
+}
+
+static size_t peer_sets_section_size(const ConversationStatusMessage& status)
+{
+	return 2 * MessageBuffer::opaque_size(peer_sets_size(status));
+}
+
+static size_t key_exchanges_section_size(const ConversationStatusMessage& status)
+{
+	return MessageBuffer::opaque_size(list_size(status.key_exchanges));
+}
+
+static size_t events_section_size(const ConversationStatusMessage& status)
+{
+	return MessageBuffer::opaque_size(list_size(status.events));
+}
+
+static void add_participants_section(MessageBuffer* buffer, const ConversationStatusMessage& status)
+{
+	buffer->add_integer(opaque_list_size(status.participants));
+	for (const ConversationStatusMessage::Participant& participant : status.participants) {
+		buffer->add_integer(encoded_size(participant));
+		buffer->add_opaque(participant.username);
+		buffer->add_public_key(participant.long_term_public_key);
+		buffer->add_public_key(participant.conversation_public_key);
 	}
-	buffer.add_opaque(confirmed_invites_buffer);
-	
-	MessageBuffer unconfirmed_invites_buffer;
-	for (const UnconfirmedInvite& invite : unconfirmed_invites) {
-		MessageBuffer invite_buffer;
-		invite_buffer.add_opaque(invite.inviter);
-		invite_buffer.add_opaque(invite.username);
-		invite_buffer.add_public_key(invite.long_term_public_key);
-		unconfirmed_invites_buffer.add_opaque(invite_buffer);
+}
+
+static void add_invites_section(MessageBuffer* buffer, const ConversationStatusMessage& status)
+{
+	buffer->add_integer(opaque_list_size(status.confirmed_invites));
+	for (const ConversationStatusMessage::ConfirmedInvite& invite : status.confirmed_invites) {
+		buffer->add_integer(encoded_size(invite));
+		buffer->add_opaque(invite.inviter);
+		buffer->add_opaque(invite.username);
+		buffer->add_public_key(invite.long_term_public_key);
+		buffer->add_public_key(invite.conversation_public_key);
+		buffer->add_bit(invite.authenticated);
 	}
-	buffer.add_opaque(unconfirmed_invites_buffer);
 	
-	MessageBuffer timeout_buffer;
-	MessageBuffer votekick_buffer;
-	for (const Participant& participant : participants) {
-		timeout_buffer.add_opaque(encode_user_set(*this, true, participant.timeout_peers));
-		votekick_buffer.add_opaque(encode_user_set(*this, true, participant.votekick_peers));
+	buffer->add_integer(opaque_list_size(status.unconfirmed_invites));
+	for (const ConversationStatusMessage::UnconfirmedInvite& invite : status.unconfirmed_invites) {
+		buffer->add_integer(encoded_size(invite));
+		buffer->add_opaque(invite.inviter);
+		buffer->add_opaque(invite.username);
+		buffer->add_public_key(invite.long_term_public_key);
+	}
+}
+
+static void add_peer_sets_section(MessageBuffer* buffer, const ConversationStatusMessage& status)
+{
+	buffer->add_integer(peer_sets_size(status));
+	for (const ConversationStatusMessage::Participant& participant : status.participants) {
+		add_user_set(buffer, status, true, participant.timeout_peers);
 	}
-	buffer.add_opaque(timeout_buffer);
-	buffer.add_opaque(votekick_buffer);
+	
+	buffer->add_integer(peer_sets_size(status));
+	for (const ConversationStatusMessage::Participant& participant : status.participants) {
+		add_user_set(buffer, status, true, participant.votekick_peers);
+	}
+}
+
+static void add_key_exchanges_section(MessageBuffer* buffer, const ConversationStatusMessage& status)
+{
+	buffer->add_integer(list_size(status.key_exchanges));
+	for (const KeyExchangeState& exchange : status.key_exchanges) {
+		buffer->add_hash(exchange.key_id);
+		buffer->add_byte(uint8_t(exchange.state));
+		buffer->add_opaque(exchange.payload);
+	}
+}
+
+static void add_events_section(MessageBuffer* buffer, const ConversationStatusMessage& status)
+{
+	buffer->add_integer(list_size(status.events));
+	for (const ConversationEvent& event : status.events) {
+		buffer->add_byte(uint8_t(event.type));
+		buffer->add_opaque(event.payload);
+	}
+}
+
+std::string ConversationStatusMessage::encode_participants() const
+{
+	MessageBuffer buffer;
+	buffer.reserve(participants_section_size(*this));
+	add_participants_section(&buffer, *this);
+	return std::move(buffer);
+}
+
+std::string ConversationStatusMessage::encode_invites() const
+{
+	MessageBuffer buffer;
+	buffer.reserve(invites_section_size(*this));
+	add_invites_section(&buffer, *this);
+	return std::move(buffer);
+}
+
+std::string ConversationStatusMessage::encode_peer_sets() const
+{
+	MessageBuffer buffer;
+	buffer.reserve(peer_sets_section_size(*this));
+	add_peer_sets_section(&buffer, *this);
+	return std::move(buffer);
+}
+
+std::string ConversationStatusMessage::encode_key_exchanges() const
+{
+	MessageBuffer buffer;
+	buffer.reserve(key_exchanges_section_size(*this));
+	add_key_exchanges_section(&buffer, *this);
+	return std::move(buffer);
+}
+
+std::string ConversationStatusMessage::encode_events() const
+{
+	MessageBuffer buffer;
+	buffer.reserve(events_section_size(*this));
+	add_events_section(&buffer, *this);
+	return std::move(buffer);
+}
+
+ConversationStatusMessage::EncodedSections ConversationStatusMessage::encode_sections() const
+{
+	EncodedSections sections;
+	sections.participants = encode_participants();
+	sections.invites = encode_invites();
+	sections.peer_sets = encode_peer_sets();
+	sections.key_exchanges = encode_key_exchanges();
+	sections.events = encode_events();
+	return sections;
+}
+
+UnsignedConversationMessage ConversationStatusMessage::encode() const
+{
+	size_t size =
+		  MessageBuffer::opaque_size(invitee_username.size())
+		+ c_public_key_length
+		+ participants_section_size(*this)
+		+ invites_section_size(*this)
+		+ peer_sets_section_size(*this)
+		+ 2 * c_hash_length
+		+ key_exchanges_section_size(*this)
+		+ events_section_size(*this)
+		+ (hash_suite != HashSuite::Sha256 ? 1 : 0);
+	
+	MessageBuffer buffer;
+	buffer.reserve(size);
+	
+	buffer.add_opaque(invitee_username);
+	buffer.add_public_key(invitee_long_term_public_key);
+	
+	add_participants_section(&buffer, *this);
+	add_invites_section(&buffer, *this);
+	add_peer_sets_section(&buffer, *this);
 	
 	buffer.add_hash(conversation_status_hash);
 	buffer.add_hash(latest_session_id);
 	
-	MessageBuffer key_exchange_buffer;
-	for (const KeyExchangeState& exchange : key_exchanges) {
-		key_exchange_buffer.add_hash(exchange.key_id);
-		key_exchange_buffer.add_byte(uint8_t(exchange.state));
-		key_exchange_buffer.add_opaque(exchange.payload);
+	add_key_exchanges_section(&buffer, *this);
+	add_events_section(&buffer, *this);
+	if (hash_suite != HashSuite::Sha256) {
+		buffer.add_byte(uint8_t(hash_suite));
 	}
-	buffer.add_opaque(key_exchange_buffer);
+	assert(buffer.size() == size);
+	
+	return UnsignedConversationMessage(Message::Type::ConversationStatus, std::move(buffer));
+}
+
+UnsignedConversationMessage ConversationStatusMessage::encode(const EncodedSections& sections) const
+{
+	MessageBuffer buffer;
+	buffer.reserve(
+		  MessageBuffer::opaque_size(invitee_username.size())
+		+ c_public_key_length
+		+ sections.participants.size()
+		+ sections.invites.size()
+		+ sections.peer_sets.size()
+		+ 2 * c_hash_length
+		+ sections.key_exchanges.size()
+		+ sections.events.size()
+		+ 1
+	);
+	
+	buffer.add_opaque(invitee_username);
+	buffer.add_public_key(invitee_long_term_public_key);
+	
+	buffer.add_bytes(sections.participants);
+	buffer.add_bytes(sections.invites);
+	buffer.add_bytes(sections.peer_sets);
 	
-	MessageBuffer event_buffer;
-	for (const ConversationEvent& event : events) {
-		event_buffer.add_byte(uint8_t(event.type));
-		event_buffer.add_opaque(event.payload);
+	buffer.add_hash(conversation_status_hash);
+	buffer.add_hash(latest_session_id);
+	
+	buffer.add_bytes(sections.key_exchanges);
+	buffer.add_bytes(sections.events);
+	if (hash_suite != HashSuite::Sha256) {
+		buffer.add_byte(uint8_t(hash_suite));
 	}
-	buffer.add_opaque(event_buffer);
 	
-	return UnsignedConversationMessage(Message::Type::ConversationStatus, buffer);
+	return UnsignedConversationMessage(Message::Type::ConversationStatus, std::move(buffer));
 }
 
 ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConversationStatus));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConversationStatus);
 	
 	ConversationStatusMessage result;
 	result.invitee_username = buffer.remove_opaque();
 	result.invitee_long_term_public_key = buffer.remove_public_key();
 	
-	MessageBuffer participants_buffer = buffer.remove_opaque();
+	MessageReader participants_buffer = buffer.remove_opaque_reader();
 	while (!participants_buffer.empty()) {
-		MessageBuffer participant_buffer = participants_buffer.remove_opaque();
+		MessageReader participant_buffer = participants_buffer.remove_opaque_reader();
 		Participant participant;
 		participant.username = participant_buffer.remove_opaque();
 		participant.long_term_public_key = participant_buffer.remove_public_key();
@@ -549,9 +934,9 @@ ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConver
 		result.participants.push_back(participant);
 	}
 	
-	MessageBuffer confirmed_invites_buffer = buffer.remove_opaque();
+	MessageReader confirmed_invites_buffer = buffer.remove_opaque_reader();
 	while (!confirmed_invites_buffer.empty()) {
-		MessageBuffer invite_buffer = confirmed_invites_buffer.remove_opaque();
+		MessageReader invite_buffer = confirmed_invites_buffer.remove_opaque_reader();
 		ConfirmedInvite invite;
 		invite.inviter = invite_buffer.remove_opaque();
 		invite.username = invite_buffer.remove_opaque();
@@ -562,9 +947,9 @@ ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConver
 		result.confirmed_invites.push_back(invite);
 	}
 	
-	MessageBuffer unconfirmed_invites_buffer = buffer.remove_opaque();
+	MessageReader unconfirmed_invites_buffer = buffer.remove_opaque_reader();
 	while (!unconfirmed_invites_buffer.empty()) {
-		MessageBuffer invite_buffer = unconfirmed_invites_buffer.remove_opaque();
+		MessageReader invite_buffer = unconfirmed_invites_buffer.remove_opaque_reader();
 		UnconfirmedInvite invite;
 		invite.inviter = invite_buffer.remove_opaque();
 		invite.username = invite_buffer.remove_opaque();
@@ -573,17 +958,17 @@ ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConver
 		result.unconfirmed_invites.push_back(invite);
 	}
 	
-	MessageBuffer timeout_buffer = buffer.remove_opaque();
-	MessageBuffer votekick_buffer = buffer.remove_opaque();
+	MessageReader timeout_buffer = buffer.remove_opaque_reader();
+	MessageReader votekick_buffer = buffer.remove_opaque_reader();
 	for (Participant& participant : result.participants) {
-		participant.timeout_peers = decode_user_set(result, true, timeout_buffer.remove_opaque());
-		participant.votekick_peers = decode_user_set(result, true, votekick_buffer.remove_opaque());
+		participant.timeout_peers = decode_user_set(result, true, timeout_buffer.remove_opaque_reader());
+		participant.votekick_peers = decode_user_set(result, true, votekick_buffer.remove_opaque_reader());
 	}
 	
 	result.conversation_status_hash = buffer.remove_hash();
 	result.latest_session_id = buffer.remove_hash();
 	
-	MessageBuffer key_exchange_buffer = buffer.remove_opaque();
+	MessageReader key_exchange_buffer = buffer.remove_opaque_reader();
 	while (!key_exchange_buffer.empty()) {
 		KeyExchangeState exchange;
 		exchange.key_id = key_exchange_buffer.remove_hash();
@@ -592,7 +977,7 @@ ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConver
 		result.key_exchanges.push_back(std::move(exchange));
 	}
 	
-	MessageBuffer event_buffer = buffer.remove_opaque();
+	MessageReader event_buffer = buffer.remove_opaque_reader();
 	while (!event_buffer.empty()) {
 		ConversationEvent event;
 		event.type = Message::Type(event_buffer.remove_byte());
@@ -600,6 +985,14 @@ ConversationStatusMessage ConversationStatusMessage::decode(const UnsignedConver
 		result.events.push_back(std::move(event));
 	}
 	
+	if (!buffer.empty()) {
+		uint8_t hash_suite = buffer.remove_byte();
+		if (hash_suite > uint8_t(HashSuite::Blake2b)) {
+			throw MessageFormatException();
+		}
+		result.hash_suite = HashSuite(hash_suite);
+	}
+	
 	buffer.check_empty();
 	return result;
 }
@@ -616,7 +1009,7 @@ UnsignedConversationMessage ConversationConfirmationMessage::encode() const
 
 ConversationConfirmationMessage ConversationConfirmationMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConversationConfirmation));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConversationConfirmation);
 	
 	ConversationConfirmationMessage result;
 	result.invitee_username = buffer.remove_opaque();
@@ -639,7 +1032,7 @@ UnsignedConversationMessage InviteAcceptanceMessage::encode() const
 
 InviteAcceptanceMessage InviteAcceptanceMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::InviteAcceptance));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::InviteAcceptance);
 	
 	InviteAcceptanceMessage result;
 	result.my_long_term_public_key = buffer.remove_public_key();
@@ -661,7 +1054,7 @@ UnsignedConversationMessage AuthenticationRequestMessage::encode() const
 
 AuthenticationRequestMessage AuthenticationRequestMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::AuthenticationRequest));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::AuthenticationRequest);
 	
 	AuthenticationRequestMessage result;
 	result.username = buffer.remove_opaque();
@@ -681,7 +1074,7 @@ UnsignedConversationMessage AuthenticationMessage::encode() const
 
 AuthenticationMessage AuthenticationMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Authentication));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Authentication);
 	
 	AuthenticationMessage result;
 	result.username = buffer.remove_opaque();
@@ -702,7 +1095,7 @@ UnsignedConversationMessage AuthenticateInviteMessage::encode() const
 
 AuthenticateInviteMessage AuthenticateInviteMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::AuthenticateInvite));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::AuthenticateInvite);
 	
 	AuthenticateInviteMessage result;
 	result.username = buffer.remove_opaque();
@@ -723,7 +1116,7 @@ UnsignedConversationMessage CancelInviteMessage::encode() const
 
 CancelInviteMessage CancelInviteMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::CancelInvite));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::CancelInvite);
 	
 	CancelInviteMessage result;
 	result.username = buffer.remove_opaque();
@@ -741,7 +1134,7 @@ UnsignedConversationMessage JoinMessage::encode() const
 
 JoinMessage JoinMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Join));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Join);
 	
 	JoinMessage result;
 	buffer.check_empty();
@@ -757,7 +1150,7 @@ UnsignedConversationMessage LeaveMessage::encode() const
 
 LeaveMessage LeaveMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Leave));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Leave);
 	
 	LeaveMessage result;
 	buffer.check_empty();
@@ -773,7 +1166,7 @@ UnsignedConversationMessage ConsistencyStatusMessage::encode() const
 
 ConsistencyStatusMessage ConsistencyStatusMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConsistencyStatus));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConsistencyStatus);
 	
 	ConsistencyStatusMessage result;
 	buffer.check_empty();
@@ -791,7 +1184,7 @@ UnsignedConversationMessage ConsistencyCheckMessage::encode() const
 
 ConsistencyCheckMessage ConsistencyCheckMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConsistencyCheck));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConsistencyCheck);
 	
 	ConsistencyCheckMessage result;
 	result.conversation_status_hash = buffer.remove_hash();
@@ -810,7 +1203,7 @@ UnsignedConversationMessage TimeoutMessage::encode() const
 
 TimeoutMessage TimeoutMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Timeout));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Timeout);
 	
 	TimeoutMessage result;
 	result.victim = buffer.remove_opaque();
@@ -830,7 +1223,7 @@ UnsignedConversationMessage VotekickMessage::encode() const
 
 VotekickMessage VotekickMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Votekick));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Votekick);
 	
 	VotekickMessage result;
 	result.victim = buffer.remove_opaque();
@@ -850,7 +1243,7 @@ UnsignedConversationMessage KeyExchangePublicKeyMessage::encode() const
 
 KeyExchangePublicKeyMessage KeyExchangePublicKeyMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyExchangePublicKey));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyExchangePublicKey);
 	
 	KeyExchangePublicKeyMessage result;
 	result.key_id = buffer.remove_hash();
@@ -871,7 +1264,7 @@ UnsignedConversationMessage KeyExchangeSecretShareMessage::encode() const
 
 KeyExchangeSecretShareMessage KeyExchangeSecretShareMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyExchangeSecretShare));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyExchangeSecretShare);
 	
 	KeyExchangeSecretShareMessage result;
 	result.key_id = buffer.remove_hash();
@@ -886,17 +1279,23 @@ UnsignedConversationMessage KeyExchangeAcceptanceMessage::encode() const
 	MessageBuffer buffer;
 	buffer.add_hash(key_id);
 	buffer.add_hash(key_hash);
+	if (cipher_suite != CipherSuite::Aes256Gcm) {
+		buffer.add_byte(uint8_t(cipher_suite));
+	}
 	
 	return UnsignedConversationMessage(Message::Type::KeyExchangeAcceptance, buffer);
 }
 
 KeyExchangeAcceptanceMessage KeyExchangeAcceptanceMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyExchangeAcceptance));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyExchangeAcceptance);
 	
 	KeyExchangeAcceptanceMessage result;
 	result.key_id = buffer.remove_hash();
 	result.key_hash = buffer.remove_hash();
+	if (!buffer.empty()) {
+		result.cipher_suite = remove_cipher_suite(&buffer);
+	}
 	buffer.check_empty();
 	return result;
 }
@@ -912,7 +1311,7 @@ UnsignedConversationMessage KeyExchangeRevealMessage::encode() const
 
 KeyExchangeRevealMessage KeyExchangeRevealMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyExchangeReveal));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyExchangeReveal);
 	
 	KeyExchangeRevealMessage result;
 	result.key_id = buffer.remove_hash();
@@ -931,7 +1330,7 @@ UnsignedConversationMessage KeyActivationMessage::encode() const
 
 KeyActivationMessage KeyActivationMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyActivation));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyActivation);
 	
 	KeyActivationMessage result;
 	result.key_id = buffer.remove_hash();
@@ -949,7 +1348,7 @@ UnsignedConversationMessage KeyRatchetMessage::encode() const
 
 KeyRatchetMessage KeyRatchetMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyRatchet));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyRatchet);
 	
 	KeyRatchetMessage result;
 	result.key_id = buffer.remove_hash();
@@ -962,62 +1361,80 @@ KeyRatchetMessage KeyRatchetMessage::decode(const UnsignedConversationMessage& e
 UnsignedConversationMessage ChatMessage::encode() const
 {
 	MessageBuffer buffer;
+	buffer.reserve(c_hash_length + encrypted_payload.size());
 	buffer.add_hash(key_id);
 	buffer.add_bytes(encrypted_payload);
 	
-	return UnsignedConversationMessage(Message::Type::Chat, buffer);
+	return UnsignedConversationMessage(Message::Type::Chat, std::move(buffer));
 }
 
 ChatMessage ChatMessage::decode(const UnsignedConversationMessage& encoded)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::Chat));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::Chat);
 	
 	ChatMessage result;
 	result.key_id = buffer.remove_hash();
-	result.encrypted_payload = buffer;
+	result.encrypted_payload = buffer.remove_remaining();
 	return result;
 }
 
-std::string ChatMessage::decrypt(const SymmetricKey& symmetric_key) const
+std::string ChatMessage::decrypt(Cipher* cipher) const
 {
-	return crypto::decrypt(encrypted_payload, symmetric_key);
+	std::string plaintext(Cipher::decrypted_size(encrypted_payload.size()), 0);
+	cipher->decrypt(
+		reinterpret_cast<unsigned char*>(&plaintext[0]),
+		reinterpret_cast<const unsigned char*>(encrypted_payload.data()),
+		encrypted_payload.size()
+	);
+	return plaintext;
 }
 
-ChatMessage ChatMessage::encrypt(std::string plaintext, const Hash& key_id, const SymmetricKey& symmetric_key)
+ChatMessage ChatMessage::encrypt(const std::string& plaintext, const Hash& key_id, Cipher* cipher, const InitializationVector& iv)
 {
 	ChatMessage result;
 	result.key_id = key_id;
-	result.encrypted_payload = crypto::encrypt(plaintext, symmetric_key);
+	result.encrypted_payload.resize(Cipher::encrypted_size(plaintext.size()));
+	cipher->encrypt(
+		reinterpret_cast<unsigned char*>(&result.encrypted_payload[0]),
+		reinterpret_cast<const unsigned char*>(plaintext.data()),
+		plaintext.size(),
+		iv
+	);
 	return result;
 }
 
 std::string UnsignedChatMessage::signed_body() const
 {
 	MessageBuffer buffer;
+	buffer.reserve(MessageBuffer::integer_size(message_id) + message.size());
 	buffer.add_integer(message_id);
 	buffer.add_bytes(message);
-	return buffer;
+	return std::move(buffer);
 }
 
 std::string PlaintextChatMessage::sign(const UnsignedChatMessage& message, const PrivateKey& key)
 {
-	Signature signature = crypto::sign(message.signed_body(), key);
+	std::string signed_body = message.signed_body();
+	Signature signature = crypto::sign(signed_body, key);
 	
+	/*
+	 * The plaintext is the signature followed by the signed body.
+	 */
 	MessageBuffer buffer;
+	buffer.reserve(c_signature_length + signed_body.size());
 	buffer.add_signature(signature);
-	buffer.add_integer(message.message_id);
-	buffer.add_bytes(message.message);
-	return buffer;
+	buffer.add_bytes(signed_body);
+	return std::move(buffer);
 }
 
 PlaintextChatMessage PlaintextChatMessage::decode(const std::string& encoded)
 {
-	MessageBuffer buffer(encoded);
+	MessageReader buffer(encoded);
 	
 	PlaintextChatMessage result;
 	result.signature = buffer.remove_signature();
 	result.message_id = buffer.remove_integer();
-	result.message = buffer;
+	result.message = buffer.remove_remaining();
 	return result;
 }
 
@@ -1043,7 +1460,7 @@ ConversationEvent ConversationStatusEvent::encode(const ConversationStatusMessag
 
 ConversationStatusEvent ConversationStatusEvent::decode(const ConversationEvent& encoded, const ConversationStatusMessage& status)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConversationStatus));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConversationStatus);
 	
 	ConversationStatusEvent result;
 	result.invitee_username = buffer.remove_opaque();
@@ -1060,20 +1477,20 @@ ConversationEvent ConversationConfirmationEvent::encode(const ConversationStatus
 	buffer.add_opaque(invitee_username);
 	buffer.add_public_key(invitee_long_term_public_key);
 	buffer.add_hash(status_message_hash);
-	buffer.add_opaque(encode_user_set(status, true, remaining_users));
+	add_user_set(&buffer, status, true, remaining_users);
 	
 	return ConversationEvent(Message::Type::ConversationConfirmation, buffer);
 }
 
 ConversationConfirmationEvent ConversationConfirmationEvent::decode(const ConversationEvent& encoded, const ConversationStatusMessage& status)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConversationConfirmation));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConversationConfirmation);
 	
 	ConversationConfirmationEvent result;
 	result.invitee_username = buffer.remove_opaque();
 	result.invitee_long_term_public_key = buffer.remove_public_key();
 	result.status_message_hash = buffer.remove_hash();
-	result.remaining_users = decode_user_set(status, true, buffer.remove_opaque());
+	result.remaining_users = decode_user_set(status, true, buffer.remove_opaque_reader());
 	buffer.check_empty();
 	return result;
 }
@@ -1082,18 +1499,18 @@ ConversationEvent ConsistencyCheckEvent::encode(const ConversationStatusMessage&
 {
 	MessageBuffer buffer;
 	buffer.add_hash(conversation_status_hash);
-	buffer.add_opaque(encode_user_set(status, true, remaining_users));
+	add_user_set(&buffer, status, true, remaining_users);
 	
 	return ConversationEvent(Message::Type::ConsistencyCheck, buffer);
 }
 
 ConsistencyCheckEvent ConsistencyCheckEvent::decode(const ConversationEvent& encoded, const ConversationStatusMessage& status)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::ConsistencyCheck));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::ConsistencyCheck);
 	
 	ConsistencyCheckEvent result;
 	result.conversation_status_hash = buffer.remove_hash();
-	result.remaining_users = decode_user_set(status, true, buffer.remove_opaque());
+	result.remaining_users = decode_user_set(status, true, buffer.remove_opaque_reader());
 	buffer.check_empty();
 	return result;
 }
@@ -1110,7 +1527,7 @@ ConversationEvent KeyExchangeEvent::encode(const ConversationStatusMessage& stat
 	buffer.add_hash(key_id);
 	buffer.add_bit(cancelled);
 	if (cancelled) {
-		buffer.add_opaque(encode_user_set(status, false, remaining_users));
+		add_user_set(&buffer, status, false, remaining_users);
 	}
 	
 	return ConversationEvent(type, buffer);
@@ -1126,14 +1543,14 @@ KeyExchangeEvent KeyExchangeEvent::decode(const ConversationEvent& encoded, cons
 	)) {
 		throw MessageFormatException();
 	}
-	MessageBuffer buffer(encoded.payload);
+	MessageReader buffer(encoded.payload);
 	
 	KeyExchangeEvent result;
 	result.type = encoded.type;
 	result.key_id = buffer.remove_hash();
 	result.cancelled = buffer.remove_bit();
 	if (result.cancelled) {
-		result.remaining_users = decode_user_set(status, false, buffer.remove_opaque());
+		result.remaining_users = decode_user_set(status, false, buffer.remove_opaque_reader());
 	}
 	buffer.check_empty();
 	return result;
@@ -1143,18 +1560,18 @@ ConversationEvent KeyActivationEvent::encode(const ConversationStatusMessage& st
 {
 	MessageBuffer buffer;
 	buffer.add_hash(key_id);
-	buffer.add_opaque(encode_user_set(status, false, remaining_users));
+	add_user_set(&buffer, status, false, remaining_users);
 	
 	return ConversationEvent(Message::Type::KeyActivation, buffer);
 }
 
 KeyActivationEvent KeyActivationEvent::decode(const ConversationEvent& encoded, const ConversationStatusMessage& status)
 {
-	MessageBuffer buffer(get_message_payload(encoded, Message::Type::KeyActivation));
+	MessageReader buffer = get_message_payload(encoded, Message::Type::KeyActivation);
 	
 	KeyActivationEvent result;
 	result.key_id = buffer.remove_hash();
-	result.remaining_users = decode_user_set(status, false, buffer.remove_opaque());
+	result.remaining_users = decode_user_set(status, false, buffer.remove_opaque_reader());
 	buffer.check_empty();
 	return result;
 }
@@ -1171,7 +1588,16 @@ void PublicKeyParticipant::encode_to(MessageBuffer* buffer) const
 	}
 }
 
-PublicKeyParticipant PublicKeyParticipant::decode_from(MessageBuffer* buffer)
+size_t PublicKeyParticipant::encoded_size() const
+{
+	return
+		  MessageBuffer::opaque_size(username.size())
+		+ c_public_key_length
+		+ 1
+		+ (has_ephemeral_public_key ? c_public_key_length : 0);
+}
+
+PublicKeyParticipant PublicKeyParticipant::decode_from(MessageReader* buffer)
 {
 	PublicKeyParticipant result;
 	result.username = buffer->remove_opaque();
@@ -1194,7 +1620,16 @@ void SecretShareParticipant::encode_to(MessageBuffer* buffer) const
 	}
 }
 
-SecretShareParticipant SecretShareParticipant::decode_from(MessageBuffer* buffer)
+size_t SecretShareParticipant::encoded_size() const
+{
+	return
+		  MessageBuffer::opaque_size(username.size())
+		+ 2 * c_public_key_length
+		+ 1
+		+ (has_secret_share ? c_hash_length : 0);
+}
+
+SecretShareParticipant SecretShareParticipant::decode_from(MessageReader* buffer)
 {
 	SecretShareParticipant result;
 	result.username = buffer->remove_opaque();
@@ -1216,10 +1651,21 @@ void AcceptanceParticipant::encode_to(MessageBuffer* buffer) const
 	buffer->add_bit(has_key_hash);
 	if (has_key_hash) {
 		buffer->add_hash(key_hash);
+		buffer->add_byte(uint8_t(cipher_suite));
 	}
 }
 
-AcceptanceParticipant AcceptanceParticipant::decode_from(MessageBuffer* buffer)
+size_t AcceptanceParticipant::encoded_size() const
+{
+	return
+		  MessageBuffer::opaque_size(username.size())
+		+ 2 * c_public_key_length
+		+ c_hash_length
+		+ 1
+		+ (has_key_hash ? c_hash_length + 1 : 0);
+}
+
+AcceptanceParticipant AcceptanceParticipant::decode_from(MessageReader* buffer)
 {
 	AcceptanceParticipant result;
 	result.username = buffer->remove_opaque();
@@ -1229,6 +1675,9 @@ AcceptanceParticipant AcceptanceParticipant::decode_from(MessageBuffer* buffer)
 	result.has_key_hash = buffer->remove_bit();
 	if (result.has_key_hash) {
 		result.key_hash = buffer->remove_hash();
+		result.cipher_suite = remove_cipher_suite(buffer);
+	} else {
+		result.cipher_suite = CipherSuite::Aes256Gcm;
 	}
 	return result;
 }
@@ -1240,13 +1689,25 @@ void RevealParticipant::encode_to(MessageBuffer* buffer) const
 	buffer->add_public_key(ephemeral_public_key);
 	buffer->add_hash(secret_share);
 	buffer->add_hash(key_hash);
+	buffer->add_byte(uint8_t(cipher_suite));
 	buffer->add_bit(has_ephemeral_private_key);
 	if (has_ephemeral_private_key) {
 		buffer->add_private_key(ephemeral_private_key);
 	}
 }
 
-RevealParticipant RevealParticipant::decode_from(MessageBuffer* buffer)
+size_t RevealParticipant::encoded_size() const
+{
+	return
+		  MessageBuffer::opaque_size(username.size())
+		+ 2 * c_public_key_length
+		+ 2 * c_hash_length
+		+ 1
+		+ 1
+		+ (has_ephemeral_private_key ? c_private_key_length : 0);
+}
+
+RevealParticipant RevealParticipant::decode_from(MessageReader* buffer)
 {
 	RevealParticipant result;
 	result.username = buffer->remove_opaque();
@@ -1254,6 +1715,7 @@ RevealParticipant RevealParticipant::decode_from(MessageBuffer* buffer)
 	result.ephemeral_public_key = buffer->remove_public_key();
 	result.secret_share = buffer->remove_hash();
 	result.key_hash = buffer->remove_hash();
+	result.cipher_suite = remove_cipher_suite(buffer);
 	result.has_ephemeral_private_key = buffer->remove_bit();
 	if (result.has_ephemeral_private_key) {
 		result.ephemeral_private_key = buffer->remove_private_key();
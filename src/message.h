@@ -22,6 +22,7 @@
 #include <cstdint>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "bytearray.h"
@@ -38,8 +39,6 @@ class MessageBuffer : public std::string
 	MessageBuffer() {}
 	MessageBuffer(const std::string& string): std::string(string) {}
 	
-	unsigned char byte(size_t index) { return (unsigned char)(at(index)); }
-	
 	void add_bit(bool bit);
 	void add_byte(uint8_t byte);
 	void add_integer(uint64_t number);
@@ -56,6 +55,30 @@ class MessageBuffer : public std::string
 	void add_bytes(const std::string& buffer);
 	void add_opaque(const std::string& buffer);
 	
+	/*
+	 * Encoded sizes, for reserving a buffer before writing into it.
+	 */
+	static size_t integer_size(uint64_t number);
+	static size_t opaque_size(size_t size) { return integer_size(size) + size; }
+};
+
+/*
+ * Read cursor over an encoded message.
+ *
+ * The reader does not own the bytes it reads; the string it was constructed
+ * from must outlive it. Nested opaque fields can be read as sub-readers
+ * without copying them.
+ */
+class MessageReader
+{
+	public:
+	MessageReader(): m_position(nullptr), m_end(nullptr) {}
+	MessageReader(const char* data, size_t size): m_position(data), m_end(data + size) {}
+	explicit MessageReader(const std::string& buffer): m_position(buffer.data()), m_end(buffer.data() + buffer.size()) {}
+	
+	size_t size() const { return m_end - m_position; }
+	bool empty() const { return m_position == m_end; }
+	
 	void check_empty();
 	bool remove_bit();
 	uint8_t remove_byte();
@@ -67,12 +90,8 @@ class MessageBuffer : public std::string
 			throw MessageFormatException();
 		}
 		
-		ByteArray<n> result;
-		for (int i = 0; i < n; i++) {
-			result.buffer[i] = at(i);
-		}
-		
-		erase(0, n);
+		ByteArray<n> result(reinterpret_cast<const uint8_t*>(m_position));
+		m_position += n;
 		
 		return result;
 	}
@@ -83,6 +102,13 @@ class MessageBuffer : public std::string
 	Signature remove_signature() { return remove_byte_array<c_signature_length>(); }
 	std::string remove_bytes(size_t size);
 	std::string remove_opaque();
+	MessageReader remove_reader(size_t size);
+	MessageReader remove_opaque_reader();
+	std::string remove_remaining();
+	
+	protected:
+	const char* m_position;
+	const char* m_end;
 };
 
 
@@ -94,6 +120,8 @@ struct Message
 		Hello = 0x02,
 		RoomAuthenticationRequest = 0x03,
 		RoomAuthentication = 0x04,
+		RoomAuthenticationBatch = 0x05,
+		Resume = 0x06,
 		
 		Invite = 0x11,
 		ConversationStatus = 0x12,
@@ -127,7 +155,13 @@ struct Message
 	Type type;
 	std::string payload;
 	
+	/*
+	 * encode() armors the message as text: a protocol tag followed by
+	 * base64. encode_binary() frames the raw bytes behind a tag starting
+	 * with a NUL byte, for binary-safe transports. decode() accepts both.
+	 */
 	std::string encode() const;
+	std::string encode_binary() const;
 	static Message decode(const std::string& encoded);
 	
 	static bool is_conversation_message(Type type);
@@ -137,6 +171,7 @@ struct UnsignedConversationMessage
 {
 	UnsignedConversationMessage() {}
 	UnsignedConversationMessage(Message::Type type_, const std::string& payload_): type(type_), payload(payload_) {}
+	UnsignedConversationMessage(Message::Type type_, std::string&& payload_): type(type_), payload(std::move(payload_)) {}
 	
 	Message::Type type;
 	std::string payload;
@@ -149,9 +184,54 @@ struct ConversationMessage : public UnsignedConversationMessage
 	
 	static Message sign(const UnsignedConversationMessage& message, const PrivateKey& key);
 	static ConversationMessage decode(const Message& encoded);
+	/** The bytes covered by the signature */
+	std::string signed_body() const;
 	bool verify() const;
 };
 
+/*
+ * A ConversationMessage whose signature has been verified. Only Room,
+ * which does the verifying, can construct one, so code that takes this
+ * type need not check the signature again. The message can be copied,
+ * but not changed.
+ */
+class VerifiedConversationMessage
+{
+	public:
+	VerifiedConversationMessage(const VerifiedConversationMessage&) = default;
+	VerifiedConversationMessage& operator=(const VerifiedConversationMessage&) = delete;
+	
+	Message::Type type() const
+	{
+		return m_message.type;
+	}
+	
+	const std::string& payload() const
+	{
+		return m_message.payload;
+	}
+	
+	const PublicKey& conversation_public_key() const
+	{
+		return m_message.conversation_public_key;
+	}
+	
+	/** The message as received, to decode its payload */
+	const ConversationMessage& message() const
+	{
+		return m_message;
+	}
+	
+	protected:
+	explicit VerifiedConversationMessage(ConversationMessage&& message):
+		m_message(std::move(message))
+	{}
+	
+	const ConversationMessage m_message;
+	
+	friend class Room;
+};
+
 struct ConversationEvent
 {
 	ConversationEvent() {}
@@ -184,14 +264,19 @@ struct ParticipantKeyExchangeState
 	
 	KeyExchangeState encode() const
 	{
+		size_t size = 0;
+		for (const ParticipantState& participant : participants) {
+			size += participant.ParticipantState::encoded_size();
+		}
 		MessageBuffer buffer;
+		buffer.reserve(size);
 		for (const ParticipantState& participant : participants) {
 			participant.ParticipantState::encode_to(&buffer);
 		}
 		KeyExchangeState result;
 		result.key_id = key_id;
 		result.state = ParticipantState::state;
-		result.payload = buffer;
+		result.payload = std::move(buffer);
 		return result;
 	}
 	
@@ -202,7 +287,7 @@ struct ParticipantKeyExchangeState
 		}
 		ParticipantKeyExchangeState result;
 		result.key_id = encoded.key_id;
-		MessageBuffer buffer(encoded.payload);
+		MessageReader buffer(encoded.payload);
 		while (!buffer.empty()) {
 			result.participants.push_back(ParticipantState::decode_from(&buffer));
 		}
@@ -226,6 +311,38 @@ struct HelloMessage
 	PublicKey ephemeral_public_key;
 	bool reply;
 	std::string reply_to_username;
+	/*
+	 * Optional trailing field, only written when set: the sender can
+	 * receive messages framed by Message::encode_binary().
+	 */
+	bool binary_transport = false;
+	/*
+	 * Optional trailing field, only written when set: the sender can take
+	 * part in conversations using HashSuite::Blake2b.
+	 */
+	bool blake2_hash_suite = false;
+	
+	/*
+	 * Optional trailing fields, only written when aggregated_join is set:
+	 * the sender authenticates room members without a request/response
+	 * round per pair. Everyone authenticating to the sender uses the
+	 * sender's authentication_nonce. A reply carries the sender's
+	 * authentication to reply_to_username, and may carry a roster of the
+	 * other room members, so that the joiner can authenticate to all of
+	 * them in a single RoomAuthenticationBatchMessage.
+	 */
+	struct RosterEntry
+	{
+		std::string username;
+		PublicKey long_term_public_key;
+		PublicKey ephemeral_public_key;
+		Hash authentication_nonce;
+	};
+	bool aggregated_join = false;
+	Hash authentication_nonce;
+	bool has_authentication_confirmation = false;
+	Hash authentication_confirmation;
+	std::vector<RosterEntry> roster;
 	
 	Message encode() const;
 	static HelloMessage decode(const Message& encoded);
@@ -249,6 +366,30 @@ struct RoomAuthenticationMessage
 	static RoomAuthenticationMessage decode(const Message& encoded);
 };
 
+/*
+ * Sent by a user returning from a transient disconnect (see Room::resume),
+ * signed with the ephemeral key of the connection it resumes. The counter
+ * increases with every resumption, so that resume messages cannot be
+ * replayed.
+ */
+struct ResumeMessage
+{
+	uint64_t counter;
+	Signature signature;
+	
+	std::string signed_body() const;
+	Message encode() const;
+	static ResumeMessage decode(const Message& encoded);
+};
+
+struct RoomAuthenticationBatchMessage
+{
+	std::vector<RoomAuthenticationMessage> authentications;
+	
+	Message encode() const;
+	static RoomAuthenticationBatchMessage decode(const Message& encoded);
+};
+
 
 
 struct InviteMessage
@@ -299,8 +440,31 @@ struct ConversationStatusMessage
 	Hash latest_session_id;
 	std::vector<KeyExchangeState> key_exchanges;
 	std::vector<ConversationEvent> events;
+	/* Optional trailing field, only written when not SHA-256. */
+	HashSuite hash_suite = HashSuite::Sha256;
+	
+	/*
+	 * Sections of the encoded status message, in wire order.
+	 * The conversation caches and hashes these independently of each other.
+	 */
+	struct EncodedSections
+	{
+		std::string participants;
+		std::string invites;
+		std::string peer_sets;
+		std::string key_exchanges;
+		std::string events;
+	};
+	
+	std::string encode_participants() const;
+	std::string encode_invites() const;
+	std::string encode_peer_sets() const;
+	std::string encode_key_exchanges() const;
+	std::string encode_events() const;
+	EncodedSections encode_sections() const;
 	
 	UnsignedConversationMessage encode() const;
+	UnsignedConversationMessage encode(const EncodedSections& sections) const;
 	static ConversationStatusMessage decode(const UnsignedConversationMessage& encoded);
 };
 
@@ -433,6 +597,8 @@ struct KeyExchangeAcceptanceMessage
 {
 	Hash key_id;
 	Hash key_hash;
+	/* The sender's preferred cipher suite; optional on the wire, default AES-256-GCM. */
+	CipherSuite cipher_suite = CipherSuite::Aes256Gcm;
 	
 	UnsignedConversationMessage encode() const;
 	static KeyExchangeAcceptanceMessage decode(const UnsignedConversationMessage& encoded);
@@ -475,8 +641,8 @@ struct ChatMessage
 	UnsignedConversationMessage encode() const;
 	static ChatMessage decode(const UnsignedConversationMessage& encoded);
 	
-	std::string decrypt(const SymmetricKey& symmetric_key) const;
-	static ChatMessage encrypt(std::string plaintext, const Hash& key_id, const SymmetricKey& symmetric_key);
+	std::string decrypt(Cipher* cipher) const;
+	static ChatMessage encrypt(const std::string& plaintext, const Hash& key_id, Cipher* cipher, const InitializationVector& iv);
 };
 struct UnsignedChatMessage
 {
@@ -550,8 +716,9 @@ struct PublicKeyParticipant
 	bool has_ephemeral_public_key;
 	PublicKey ephemeral_public_key;
 	
+	size_t encoded_size() const;
 	void encode_to(MessageBuffer* buffer) const;
-	static PublicKeyParticipant decode_from(MessageBuffer* buffer);
+	static PublicKeyParticipant decode_from(MessageReader* buffer);
 	static const KeyExchangeState::State state = KeyExchangeState::State::PublicKey;
 };
 typedef ParticipantKeyExchangeState<PublicKeyParticipant> PublicKeyKeyExchangeState;
@@ -564,8 +731,9 @@ struct SecretShareParticipant
 	bool has_secret_share;
 	Hash secret_share;
 	
+	size_t encoded_size() const;
 	void encode_to(MessageBuffer* buffer) const;
-	static SecretShareParticipant decode_from(MessageBuffer* buffer);
+	static SecretShareParticipant decode_from(MessageReader* buffer);
 	static const KeyExchangeState::State state = KeyExchangeState::State::SecretShare;
 };
 typedef ParticipantKeyExchangeState<SecretShareParticipant> SecretShareKeyExchangeState;
@@ -578,9 +746,11 @@ struct AcceptanceParticipant
 	Hash secret_share;
 	bool has_key_hash;
 	Hash key_hash;
+	CipherSuite cipher_suite;
 	
+	size_t encoded_size() const;
 	void encode_to(MessageBuffer* buffer) const;
-	static AcceptanceParticipant decode_from(MessageBuffer* buffer);
+	static AcceptanceParticipant decode_from(MessageReader* buffer);
 	static const KeyExchangeState::State state = KeyExchangeState::State::Acceptance;
 };
 typedef ParticipantKeyExchangeState<AcceptanceParticipant> AcceptanceKeyExchangeState;
@@ -592,11 +762,13 @@ struct RevealParticipant
 	PublicKey ephemeral_public_key;
 	Hash secret_share;
 	Hash key_hash;
+	CipherSuite cipher_suite;
 	bool has_ephemeral_private_key;
 	SerializedPrivateKey ephemeral_private_key;
 	
+	size_t encoded_size() const;
 	void encode_to(MessageBuffer* buffer) const;
-	static RevealParticipant decode_from(MessageBuffer* buffer);
+	static RevealParticipant decode_from(MessageReader* buffer);
 	static const KeyExchangeState::State state = KeyExchangeState::State::Reveal;
 };
 typedef ParticipantKeyExchangeState<RevealParticipant> RevealKeyExchangeState;
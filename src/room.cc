@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "ephemeralkeypool.h"
 #include "room.h"
 
 #include <cassert>
@@ -23,11 +24,34 @@
 namespace np1sec
 {
 
+/*
+ * A user that announces new keys more than c_hello_rate_limit times within
+ * c_hello_rate_window milliseconds gets only its latest Hello answered,
+ * at the end of the window.
+ */
+const unsigned int c_hello_rate_limit = 5;
+const uint32_t c_hello_rate_window = 10000;
+
+/*
+ * Room members listed in a single Hello reply to a joining user.
+ */
+const size_t c_roster_slice_size = 16;
+
 Room::Room(RoomInterface* interface, const std::string& username, const PrivateKey& private_key):
 	m_interface(interface),
 	m_username(username),
 	m_long_term_private_key(private_key),
 	m_disconnecting(false),
+	m_preferred_cipher_suite(crypto::preferred_cipher_suite()),
+	m_preferred_hash_suite(HashSuite::Sha256),
+	m_blake2_hash_suite(true),
+	m_inbound_queue_ready(false),
+	m_aggregated_join(true),
+	m_lazy_authentication(false),
+	m_resume_grace_period(0),
+	m_suspended(false),
+	m_resuming(false),
+	m_resume_counter(0),
 	m_conversations(this)
 {
 	assert(m_interface);
@@ -66,17 +90,28 @@ void Room::connect()
 		disconnect();
 	}
 	
-	m_ephemeral_private_key = PrivateKey::generate(true);
+	m_ephemeral_private_key = EphemeralKeyPool::instance().take();
+	m_hello_nonce = crypto::nonce_hash();
+	m_resume_counter = 0;
 	
 	HelloMessage hello_message;
 	hello_message.long_term_public_key = m_long_term_private_key.public_key();
 	hello_message.ephemeral_public_key = m_ephemeral_private_key.public_key();
 	hello_message.reply = false;
+	hello_message.binary_transport = m_interface->binary_transport();
+	hello_message.blake2_hash_suite = m_blake2_hash_suite;
+	hello_message.aggregated_join = m_aggregated_join;
+	hello_message.authentication_nonce = m_hello_nonce;
 	send_message(hello_message.encode());
 }
 
 void Room::disconnect()
 {
+	m_suspended = false;
+	m_suspended_messages.clear();
+	m_resuming = false;
+	m_resume_message.clear();
+	
 	m_disconnecting = true;
 	m_disconnect_nonce = crypto::nonce_hash();
 	
@@ -85,20 +120,122 @@ void Room::disconnect()
 	send_message(quit_message.encode());
 	
 	m_message_queue.clear();
+	m_unechoed_messages.clear();
 	
 	interface()->disconnected();
 	
 	m_users.clear();
+	m_roster_authentications.clear();
+	m_hello_rate_limits.clear();
+	m_resume_timers.clear();
 	
 	m_conversations.disconnect();
 }
 
+void Room::suspend()
+{
+	if (m_suspended || !connected()) {
+		return;
+	}
+	
+	m_suspended = true;
+	m_suspended_since = std::chrono::steady_clock::now();
+}
+
+void Room::resume(bool inbound_intact)
+{
+	if (!m_suspended) {
+		return;
+	}
+	
+	m_suspended = false;
+	
+	if (!inbound_intact) {
+		/*
+		 * We may have missed messages that everyone else acted on.
+		 */
+		connect();
+		return;
+	}
+	
+	if (std::chrono::steady_clock::now() - m_suspended_since >= std::chrono::milliseconds(m_resume_grace_period)) {
+		/*
+		 * The other users have given up on us by now.
+		 */
+		connect();
+		return;
+	}
+	
+	m_resume_counter++;
+	ResumeMessage resume_message;
+	resume_message.counter = m_resume_counter;
+	resume_message.signature = crypto::sign(resume_message.signed_body(), m_ephemeral_private_key);
+	Message message = resume_message.encode();
+	
+	/*
+	 * Our messages still in flight either reach the room ahead of the
+	 * resume message, or were lost with the link. Until its echo tells
+	 * which, everything else we send is held back, so that the lost ones
+	 * can be sent again in their original order.
+	 */
+	m_resuming = false;
+	m_resume_message = encode_message(message);
+	send_message(message);
+	m_resuming = true;
+}
+
 void Room::create_conversation()
 {
 	m_conversations.create_conversation();
 }
 
 void Room::message_received(const std::string& sender, const std::string& text_message)
+{
+	handle_message(sender, text_message, nullptr);
+}
+
+void Room::messages_received(const std::vector<ReceivedMessage>& messages)
+{
+	std::vector<crypto::SignatureVerification> batch;
+	std::vector<size_t> batch_positions(messages.size(), messages.size());
+	for (size_t i = 0; i < messages.size(); i++) {
+		try {
+			Message np1sec_message = Message::decode(messages[i].text_message);
+			if (!Message::is_conversation_message(np1sec_message.type)) {
+				continue;
+			}
+			ConversationMessage message = ConversationMessage::decode(np1sec_message);
+			/*
+			 * Messages that are irrelevant now are left out of the batch;
+			 * if an earlier message in the backlog makes them relevant,
+			 * they are verified individually.
+			 */
+			if (!m_conversations.is_relevant(messages[i].sender, message)) {
+				continue;
+			}
+			
+			crypto::SignatureVerification verification;
+			verification.payload = message.signed_body();
+			verification.signature = message.signature;
+			verification.public_key = message.conversation_public_key;
+			batch_positions[i] = batch.size();
+			batch.push_back(std::move(verification));
+		} catch(MessageFormatException) {}
+	}
+	
+	std::vector<bool> results = crypto::verify_batch(batch);
+	
+	for (size_t i = 0; i < messages.size(); i++) {
+		if (batch_positions[i] < batch.size()) {
+			bool signature_valid = results[batch_positions[i]];
+			handle_message(messages[i].sender, messages[i].text_message, &signature_valid);
+		} else {
+			handle_message(messages[i].sender, messages[i].text_message, nullptr);
+		}
+	}
+}
+
+void Room::handle_message(const std::string& sender, const std::string& text_message, const bool* signature_valid)
 {
 	auto filter = [&] (Message& message) {
 		if (!m_inbound_message_filter) return true;
@@ -132,11 +269,14 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 	}
 	
 	if (sender == username()) {
-		if (m_message_queue.empty() || m_message_queue.front() != text_message) {
-			disconnect();
+		if (!own_message_echoed(text_message)) {
+			if (m_resuming) {
+				connect();
+			} else {
+				disconnect();
+			}
 			return;
 		}
-		m_message_queue.pop_front();
 	}
 	
 	Message np1sec_message;
@@ -162,9 +302,32 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 				   m_users.at(sender).long_term_public_key == message.long_term_public_key
 				&& m_users.at(sender).ephemeral_public_key == message.ephemeral_public_key
 			) {
+				/*
+				 * When two users announce themselves at the same time, each
+				 * sees the other's Hello before its reply; in an aggregated
+				 * join, the reply still carries an authentication.
+				 */
+				const User& user = m_users.at(sender);
+				if (
+					   message.reply
+					&& message.reply_to_username == username()
+					&& m_aggregated_join
+					&& user.aggregated_join
+					&& !user.authenticated
+				) {
+					answer_hello(sender, message);
+				}
 				return;
 			}
 			
+			if (m_resume_timers.count(sender)) {
+				/*
+				 * The user reconnected rather than resuming.
+				 */
+				m_resume_timers.erase(sender);
+				m_conversations.user_left(sender);
+			}
+			
 			user_removed(sender);
 		}
 		
@@ -173,7 +336,17 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 		user.long_term_public_key = message.long_term_public_key;
 		user.ephemeral_public_key = message.ephemeral_public_key;
 		user.authenticated = false;
-		user.authentication_nonce = crypto::nonce_hash();
+		user.authentication_requested = false;
+		user.binary_transport = message.binary_transport;
+		user.blake2_hash_suite = message.blake2_hash_suite;
+		user.aggregated_join = message.aggregated_join;
+		user.hello_nonce = message.authentication_nonce;
+		user.resume_counter = 0;
+		if (m_aggregated_join && message.aggregated_join) {
+			user.authentication_nonce = m_hello_nonce;
+		} else {
+			user.authentication_nonce = crypto::nonce_hash();
+		}
 		m_users[sender] = std::move(user);
 		
 		if (sender == username()) {
@@ -182,19 +355,15 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 			return;
 		}
 		
-		if (!message.reply || message.reply_to_username != username()) {
-			HelloMessage reply_message;
-			reply_message.long_term_public_key = m_long_term_private_key.public_key();
-			reply_message.ephemeral_public_key = m_ephemeral_private_key.public_key();
-			reply_message.reply = true;
-			reply_message.reply_to_username = sender;
-			send_message(reply_message.encode());
+		if (m_lazy_authentication) {
+			interface()->user_joined(sender, message.long_term_public_key, UserPresence::Unauthenticated);
 		}
 		
-		RoomAuthenticationRequestMessage authentication_request_message;
-		authentication_request_message.username = sender;
-		authentication_request_message.nonce = m_users.at(sender).authentication_nonce;
-		send_message(authentication_request_message.encode());
+		if (!hello_rate_limit(sender, message)) {
+			return;
+		}
+		
+		answer_hello(sender, message);
 	} else if (np1sec_message.type == Message::Type::RoomAuthenticationRequest) {
 		RoomAuthenticationRequestMessage message;
 		try {
@@ -223,6 +392,10 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 			username()
 		);
 		send_message(reply.encode());
+		
+		if (m_lazy_authentication) {
+			request_user_authentication(sender);
+		}
 	} else if (np1sec_message.type == Message::Type::RoomAuthentication) {
 		RoomAuthenticationMessage message;
 		try {
@@ -235,24 +408,56 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 			return;
 		}
 		
+		if (!m_users.count(sender)) {
+			return;
+		}
+		authenticate_user(m_users.at(sender), message.authentication_confirmation);
+		
+		if (m_lazy_authentication) {
+			request_user_authentication(sender);
+		}
+	} else if (np1sec_message.type == Message::Type::Resume) {
+		ResumeMessage message;
+		try {
+			message = ResumeMessage::decode(np1sec_message);
+		} catch(MessageFormatException) {
+			return;
+		}
+		
 		if (!m_users.count(sender)) {
 			return;
 		}
 		User& user = m_users.at(sender);
 		
-		if (user.authenticated) {
+		if (message.counter <= user.resume_counter) {
 			return;
 		}
-		if (message.authentication_confirmation == crypto::authentication_token(
-			m_long_term_private_key,
-			m_ephemeral_private_key,
-			user.long_term_public_key,
-			user.ephemeral_public_key,
-			user.authentication_nonce,
-			sender
-		)) {
-			user.authenticated = true;
-			interface()->user_joined(user.username, user.long_term_public_key);
+		if (!crypto::verify(message.signed_body(), message.signature, user.ephemeral_public_key)) {
+			return;
+		}
+		user.resume_counter = message.counter;
+		
+		m_resume_timers.erase(sender);
+	} else if (np1sec_message.type == Message::Type::RoomAuthenticationBatch) {
+		RoomAuthenticationBatchMessage message;
+		try {
+			message = RoomAuthenticationBatchMessage::decode(np1sec_message);
+		} catch(MessageFormatException) {
+			return;
+		}
+		
+		if (!m_users.count(sender)) {
+			return;
+		}
+		
+		for (const RoomAuthenticationMessage& authentication : message.authentications) {
+			if (authentication.username == username()) {
+				authenticate_user(m_users.at(sender), authentication.authentication_confirmation);
+				
+				if (m_lazy_authentication) {
+					request_user_authentication(sender);
+				}
+			}
 		}
 	}
 	
@@ -264,19 +469,69 @@ void Room::message_received(const std::string& sender, const std::string& text_m
 			return;
 		}
 		
-		if (!message.verify()) {
+		if (!m_conversations.is_relevant(sender, message)) {
+			m_conversations.message_dropped();
+			return;
+		}
+		
+		if (signature_valid ? !*signature_valid : !message.verify()) {
 			return;
 		}
 		
-		m_conversations.message_received(sender, message);
+		m_conversations.message_received(sender, VerifiedConversationMessage(std::move(message)));
 	}
 }
 
 void Room::user_left(const std::string& username)
 {
+	if (m_resume_grace_period && m_users.count(username)) {
+		if (!m_resume_timers.count(username)) {
+			m_resume_timers[username] = Timer(m_interface, m_resume_grace_period, [this, username] {
+				m_resume_timers.erase(username);
+				user_disconnected(username);
+			});
+		}
+		return;
+	}
+	
 	user_disconnected(username);
 }
 
+void Room::queue_message_received(const std::string& sender, const std::string& text_message)
+{
+	m_inbound_queue.push(InboundQueue::Type::MessageReceived, sender, text_message);
+	
+	if (!m_inbound_queue_ready.exchange(true)) {
+		m_interface->queue_ready();
+	}
+}
+
+void Room::queue_user_left(const std::string& username)
+{
+	m_inbound_queue.push(InboundQueue::Type::UserLeft, username, std::string());
+	
+	if (!m_inbound_queue_ready.exchange(true)) {
+		m_interface->queue_ready();
+	}
+}
+
+/*
+ * The flag is cleared before draining. An entry we cannot reach yet is
+ * still being pushed, and its producer raises the flag again afterwards.
+ */
+void Room::process_queue()
+{
+	m_inbound_queue_ready.store(false);
+	
+	while (std::unique_ptr<InboundQueue::Entry> entry = m_inbound_queue.pop()) {
+		if (entry->type == InboundQueue::Type::MessageReceived) {
+			message_received(entry->sender, entry->text_message);
+		} else {
+			user_left(entry->sender);
+		}
+	}
+}
+
 void Room::left_room()
 {
 	// TODO: left_room() conversations
@@ -287,17 +542,405 @@ void Room::send_message(const Message& message)
 	if (m_outbound_message_filter && !m_outbound_message_filter(message)) {
 		return;
 	}
-	send_message(message.encode());
+	
+	send_message(encode_message(message));
 }
 
 void Room::send_message(const std::string& message)
 {
-	m_message_queue.push_back(message);
+	if (m_suspended || m_resuming) {
+		m_suspended_messages.push_back(message);
+		return;
+	}
+	
+	m_message_queue.push(message);
+	if (m_resume_grace_period) {
+		m_unechoed_messages.push_back(message);
+	}
 	m_interface->send_message(message);
 }
 
+std::string Room::encode_message(const Message& message) const
+{
+	/*
+	 * Hello messages are always armored, so that users who have yet to
+	 * announce their transport can see them.
+	 */
+	if (message.type != Message::Type::Hello && binary_transport()) {
+		return message.encode_binary();
+	} else {
+		return message.encode();
+	}
+}
+
+bool Room::own_message_echoed(const std::string& text_message)
+{
+	bool in_order = m_message_queue.pop_if_front(text_message);
+	/*
+	 * The grace period may have been set with messages already in flight,
+	 * which m_unechoed_messages then lacks.
+	 */
+	if (in_order && !m_unechoed_messages.empty() && m_unechoed_messages.front() == text_message) {
+		m_unechoed_messages.pop_front();
+	}
+	if (!m_resuming || text_message != m_resume_message) {
+		return in_order;
+	}
+	
+	/*
+	 * Our resume message is back. Whatever we sent before it and did not
+	 * see echoed first never reached the room.
+	 */
+	std::deque<std::string> messages;
+	if (!in_order) {
+		if (m_unechoed_messages.size() != m_message_queue.size()) {
+			return false;
+		}
+		while (!m_unechoed_messages.empty()) {
+			std::string message = std::move(m_unechoed_messages.front());
+			m_unechoed_messages.pop_front();
+			m_message_queue.pop_if_front(message);
+			if (message == m_resume_message) {
+				break;
+			}
+			messages.push_back(std::move(message));
+		}
+	}
+	
+	m_resuming = false;
+	m_resume_message.clear();
+	messages.insert(messages.end(), m_suspended_messages.begin(), m_suspended_messages.end());
+	m_suspended_messages.clear();
+	for (const std::string& message : messages) {
+		send_message(message);
+	}
+	return true;
+}
+
+bool Room::binary_transport() const
+{
+	if (!m_interface->binary_transport()) {
+		return false;
+	}
+	if (m_users.empty()) {
+		return false;
+	}
+	for (const auto& i : m_users) {
+		if (!i.second.binary_transport) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Room::answer_hello(const std::string& sender, const HelloMessage& message)
+{
+	User& user = m_users.at(sender);
+	bool aggregated = m_aggregated_join && user.aggregated_join;
+	bool addressed_to_us = message.reply && message.reply_to_username == username();
+	bool eager = !m_lazy_authentication;
+	
+	if (!addressed_to_us) {
+		HelloMessage reply_message;
+		reply_message.long_term_public_key = m_long_term_private_key.public_key();
+		reply_message.ephemeral_public_key = m_ephemeral_private_key.public_key();
+		reply_message.reply = true;
+		reply_message.reply_to_username = sender;
+		reply_message.binary_transport = m_interface->binary_transport();
+		reply_message.blake2_hash_suite = m_blake2_hash_suite;
+		reply_message.aggregated_join = m_aggregated_join;
+		reply_message.authentication_nonce = m_hello_nonce;
+		if (aggregated && eager) {
+			reply_message.has_authentication_confirmation = true;
+			reply_message.authentication_confirmation = authentication_confirmation(
+				user.long_term_public_key,
+				user.ephemeral_public_key,
+				user.hello_nonce
+			);
+			if (!message.reply) {
+				reply_message.roster = roster(sender);
+			}
+		}
+		send_message(reply_message.encode());
+	}
+	
+	/*
+	 * With lazy authentication, the sender now knows about us and we
+	 * authenticate each other in request_user_authentication(). We still
+	 * accept an authentication the sender volunteered.
+	 */
+	if (!eager) {
+		if (addressed_to_us && aggregated && message.has_authentication_confirmation) {
+			authenticate_user(user, message.authentication_confirmation);
+		}
+		return;
+	}
+	
+	/*
+	 * In an aggregated join, our reply authenticates us to the sender, and
+	 * the sender authenticates to us when it receives the reply.
+	 */
+	if (aggregated && !addressed_to_us) {
+		return;
+	}
+	
+	if (!aggregated || !message.has_authentication_confirmation) {
+		RoomAuthenticationRequestMessage authentication_request_message;
+		authentication_request_message.username = sender;
+		authentication_request_message.nonce = user.authentication_nonce;
+		send_message(authentication_request_message.encode());
+	} else {
+		authenticate_user(user, message.authentication_confirmation);
+	}
+	
+	if (!aggregated) {
+		return;
+	}
+	
+	auto roster_authentication = m_roster_authentications.find(sender);
+	if (!(
+		   roster_authentication != m_roster_authentications.end()
+		&& roster_authentication->second.long_term_public_key == user.long_term_public_key
+		&& roster_authentication->second.ephemeral_public_key == user.ephemeral_public_key
+		&& roster_authentication->second.authentication_nonce == user.hello_nonce
+	)) {
+		RoomAuthenticationMessage authentication_message;
+		authentication_message.username = sender;
+		authentication_message.authentication_confirmation = authentication_confirmation(
+			user.long_term_public_key,
+			user.ephemeral_public_key,
+			user.hello_nonce
+		);
+		send_message(authentication_message.encode());
+	}
+	
+	if (!message.roster.empty()) {
+		answer_roster(message.roster);
+	}
+}
+
+/*
+ * Authenticate to every room member in the roster we have not heard from
+ * yet, in a single message. When their own replies arrive, only members
+ * whose keys differ from the roster need a separate authentication.
+ */
+void Room::answer_roster(const std::vector<HelloMessage::RosterEntry>& roster)
+{
+	RoomAuthenticationBatchMessage batch_message;
+	for (const HelloMessage::RosterEntry& entry : roster) {
+		if (entry.username == username() || m_users.count(entry.username) || m_roster_authentications.count(entry.username)) {
+			continue;
+		}
+		
+		RoomAuthenticationMessage authentication_message;
+		authentication_message.username = entry.username;
+		authentication_message.authentication_confirmation = authentication_confirmation(
+			entry.long_term_public_key,
+			entry.ephemeral_public_key,
+			entry.authentication_nonce
+		);
+		batch_message.authentications.push_back(std::move(authentication_message));
+		m_roster_authentications[entry.username] = entry;
+	}
+	
+	if (!batch_message.authentications.empty()) {
+		send_message(batch_message.encode());
+	}
+}
+
+void Room::authenticate_user(User& user, const Hash& authentication_confirmation)
+{
+	if (user.authenticated) {
+		return;
+	}
+	if (authentication_confirmation == crypto::authentication_token(
+		m_long_term_private_key,
+		m_ephemeral_private_key,
+		user.long_term_public_key,
+		user.ephemeral_public_key,
+		user.authentication_nonce,
+		user.username
+	)) {
+		user.authenticated = true;
+		interface()->user_joined(user.username, user.long_term_public_key, UserPresence::Authenticated);
+	}
+}
+
+/*
+ * In an aggregated join we can authenticate to the user right away, which
+ * makes a lazy user authenticate back; otherwise we ask the user to
+ * authenticate, which makes a lazy user ask us in turn.
+ */
+void Room::request_user_authentication(const std::string& username)
+{
+	if (!m_lazy_authentication || username == this->username() || !m_users.count(username)) {
+		return;
+	}
+	User& user = m_users.at(username);
+	if (user.authentication_requested) {
+		return;
+	}
+	user.authentication_requested = true;
+	
+	if (m_aggregated_join && user.aggregated_join) {
+		RoomAuthenticationMessage authentication_message;
+		authentication_message.username = username;
+		authentication_message.authentication_confirmation = authentication_confirmation(
+			user.long_term_public_key,
+			user.ephemeral_public_key,
+			user.hello_nonce
+		);
+		send_message(authentication_message.encode());
+	} else if (!user.authenticated) {
+		RoomAuthenticationRequestMessage authentication_request_message;
+		authentication_request_message.username = username;
+		authentication_request_message.nonce = user.authentication_nonce;
+		send_message(authentication_request_message.encode());
+	}
+}
+
+Hash Room::authentication_confirmation(const PublicKey& long_term_public_key, const PublicKey& ephemeral_public_key, const Hash& nonce) const
+{
+	return crypto::authentication_token(
+		m_long_term_private_key,
+		m_ephemeral_private_key,
+		long_term_public_key,
+		ephemeral_public_key,
+		nonce,
+		username()
+	);
+}
+
+/*
+ * The aggregated members, sorted by name, split the roster between them in
+ * slices of c_roster_slice_size, so that no single reply outgrows a message.
+ * The first member of each slice sends the rest of it.
+ */
+std::vector<HelloMessage::RosterEntry> Room::roster(const std::string& joiner) const
+{
+	std::vector<const User*> members;
+	for (const auto& i : m_users) {
+		if (i.first == joiner || !i.second.authenticated || !i.second.aggregated_join) {
+			continue;
+		}
+		members.push_back(&i.second);
+	}
+	
+	std::vector<HelloMessage::RosterEntry> roster;
+	for (size_t i = 0; i < members.size(); i += c_roster_slice_size) {
+		if (members[i]->username != username()) {
+			continue;
+		}
+		for (size_t j = i + 1; j < members.size() && j < i + c_roster_slice_size; j++) {
+			HelloMessage::RosterEntry entry;
+			entry.username = members[j]->username;
+			entry.long_term_public_key = members[j]->long_term_public_key;
+			entry.ephemeral_public_key = members[j]->ephemeral_public_key;
+			entry.authentication_nonce = members[j]->hello_nonce;
+			roster.push_back(std::move(entry));
+		}
+	}
+	return roster;
+}
+
+bool Room::hello_rate_limit(const std::string& sender, const HelloMessage& message)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::milliseconds window(c_hello_rate_window);
+	
+	HelloRateLimit& limit = m_hello_rate_limits[sender];
+	if (limit.hellos == 0 || now - limit.window_start >= window) {
+		limit.window_start = now;
+		limit.hellos = 0;
+		limit.deferred_timer.stop();
+	}
+	
+	limit.hellos++;
+	if (limit.hellos <= c_hello_rate_limit) {
+		return true;
+	}
+	
+	limit.deferred_hello = message;
+	if (!limit.deferred_timer.active()) {
+		uint32_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(limit.window_start + window - now).count();
+		limit.deferred_timer = Timer(m_interface, remaining, [this, sender] {
+			hello_rate_window_ended(sender);
+		});
+	}
+	return false;
+}
+
+void Room::hello_rate_window_ended(const std::string& sender)
+{
+	/*
+	 * Only the latest keys are worth answering; older Hellos were
+	 * superseded, or the user has left since.
+	 */
+	if (!m_users.count(sender)) {
+		m_hello_rate_limits.erase(sender);
+		return;
+	}
+	
+	HelloRateLimit& limit = m_hello_rate_limits.at(sender);
+	if (limit.hellos <= c_hello_rate_limit) {
+		return;
+	}
+	limit.window_start = std::chrono::steady_clock::now();
+	limit.hellos = 1;
+	
+	const User& user = m_users.at(sender);
+	if (
+		   user.long_term_public_key != limit.deferred_hello.long_term_public_key
+		|| user.ephemeral_public_key != limit.deferred_hello.ephemeral_public_key
+	) {
+		return;
+	}
+	
+	HelloMessage message = limit.deferred_hello;
+	answer_hello(sender, message);
+}
+
+HashSuite Room::conversation_hash_suite() const
+{
+	if (m_preferred_hash_suite == HashSuite::Sha256 || !m_blake2_hash_suite) {
+		return HashSuite::Sha256;
+	}
+	for (const auto& i : m_users) {
+		if (!user_supports_hash_suite(i.first, m_preferred_hash_suite)) {
+			return HashSuite::Sha256;
+		}
+	}
+	return m_preferred_hash_suite;
+}
+
+bool Room::user_supports_hash_suite(const std::string& username, HashSuite suite) const
+{
+	if (suite == HashSuite::Sha256) {
+		return true;
+	}
+	if (!m_users.count(username)) {
+		return false;
+	}
+	return m_users.at(username).blake2_hash_suite;
+}
+
 void Room::user_removed(const std::string& username)
 {
+	m_roster_authentications.erase(username);
+	
+	auto limit = m_hello_rate_limits.find(username);
+	if (limit != m_hello_rate_limits.end() && !limit->second.deferred_timer.active()) {
+		std::chrono::steady_clock::duration remaining =
+			limit->second.window_start + std::chrono::milliseconds(c_hello_rate_window) - std::chrono::steady_clock::now();
+		if (remaining <= std::chrono::steady_clock::duration::zero()) {
+			m_hello_rate_limits.erase(limit);
+		} else {
+			limit->second.deferred_timer = Timer(m_interface, std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count(), [this, username] {
+				hello_rate_window_ended(username);
+			});
+		}
+	}
+	
 	if (!m_users.count(username)) {
 		return;
 	}
@@ -306,13 +949,15 @@ void Room::user_removed(const std::string& username)
 	bool authenticated = m_users.at(username).authenticated;
 	m_users.erase(username);
 	
-	if (authenticated) {
+	if (authenticated || m_lazy_authentication) {
 		interface()->user_left(username, public_key);
 	}
 }
 
 void Room::user_disconnected(const std::string& username)
 {
+	m_resume_timers.erase(username);
+	
 	m_conversations.user_left(username);
 	
 	user_removed(username);
@@ -20,13 +20,18 @@
 #define SRC_ROOM_H_
 
 #include "conversationlist.h"
+#include "echoqueue.h"
+#include "inboundqueue.h"
 #include "interface.h"
 #include "message.h"
 #include "timer.h"
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <map>
 #include <set>
+#include <vector>
 
 namespace np1sec
 {
@@ -74,6 +79,110 @@ class Room
 	 */
 	std::set<Conversation*> invites() const;
 	
+	/**
+	 * Number of conversation messages dropped, without verifying their
+	 * signatures, because no conversation of ours could use them.
+	 */
+	uint64_t dropped_messages() const
+	{
+		return m_conversations.dropped_messages();
+	}
+	
+	/**
+	 * The cipher suite we ask for in new key exchanges. Defaults to the
+	 * suite this machine runs fastest (see crypto::preferred_cipher_suite).
+	 */
+	CipherSuite preferred_cipher_suite() const
+	{
+		return m_preferred_cipher_suite;
+	}
+	
+	void set_preferred_cipher_suite(CipherSuite suite)
+	{
+		m_preferred_cipher_suite = suite;
+	}
+	
+	/**
+	 * The hash suite we ask for in new conversations. Defaults to SHA-256;
+	 * rooms can opt into BLAKE2b, which is used for a new conversation
+	 * only if every user in the room supports it.
+	 */
+	HashSuite preferred_hash_suite() const
+	{
+		return m_preferred_hash_suite;
+	}
+	
+	void set_preferred_hash_suite(HashSuite suite)
+	{
+		m_preferred_hash_suite = suite;
+	}
+	
+	/**
+	 * Whether we announce support for the BLAKE2b hash suite, and so may
+	 * take part in conversations using it. Enabled by default. Takes
+	 * effect on the next Room::connect().
+	 */
+	bool blake2_hash_suite() const
+	{
+		return m_blake2_hash_suite;
+	}
+	
+	void set_blake2_hash_suite(bool supported)
+	{
+		m_blake2_hash_suite = supported;
+	}
+	
+	/**
+	 * Whether we authenticate to other room members through aggregated
+	 * joins (see HelloMessage::aggregated_join), which costs a joiner
+	 * close to one message per room member instead of five. Enabled by
+	 * default; members that do not support it are authenticated pairwise.
+	 * Takes effect on the next Room::connect().
+	 */
+	bool aggregated_join() const
+	{
+		return m_aggregated_join;
+	}
+	
+	void set_aggregated_join(bool aggregated_join)
+	{
+		m_aggregated_join = aggregated_join;
+	}
+	
+	/**
+	 * Whether room authentication between us and another user is deferred
+	 * until one of us invites the other or we share a conversation. Until
+	 * then, the user is reported as UserPresence::Unauthenticated (see
+	 * RoomInterface::user_joined). Disabled by default; must be set before
+	 * Room::connect().
+	 */
+	bool lazy_authentication() const
+	{
+		return m_lazy_authentication;
+	}
+	
+	void set_lazy_authentication(bool lazy_authentication)
+	{
+		m_lazy_authentication = lazy_authentication;
+	}
+	
+	/**
+	 * How long, in milliseconds, a transient disconnect can last before
+	 * it ends our session (see Room::suspend). This is also how long we
+	 * keep a user reported gone by Room::user_left in the room and its
+	 * conversations, waiting for it to resume. Zero, the default,
+	 * disables resumption.
+	 */
+	uint32_t resume_grace_period() const
+	{
+		return m_resume_grace_period;
+	}
+	
+	void set_resume_grace_period(uint32_t milliseconds)
+	{
+		m_resume_grace_period = milliseconds;
+	}
+	
 	/* Operations */
 
 	/**
@@ -97,6 +206,29 @@ class Room
 	 */
 	void create_conversation();
 	
+	/**
+	 * Indicate to the library that the communication link dropped, but
+	 * may come back with the message stream intact, as with XMPP stream
+	 * management. Our users and conversations are kept, and messages we
+	 * send are held back until Room::resume is called.
+	 */
+	void suspend();
+	
+	/**
+	 * Indicate to the library that the communication link is back after
+	 * Room::suspend. Only the transport can know whether messages sent to
+	 * us while the link was down are lost: \p inbound_intact says that
+	 * they are all still delivered, as with XMPP stream management or a
+	 * message archive. In that case, and within the grace period (see
+	 * Room::set_resume_grace_period), we announce our return with a short
+	 * signed resume message and carry on where we left off. Our own
+	 * messages that did not make it out before the link dropped are sent
+	 * again, in order, once the resume message is echoed back. Otherwise
+	 * we cannot tell what we missed, and this reconnects, like
+	 * Room::connect.
+	 */
+	void resume(bool inbound_intact);
+	
 	/* Callbacks */
 
 	/**
@@ -110,17 +242,61 @@ class Room
 	 * must be implemented through the RoomInterface::send_message
 	 * function.
 	 *
+	 * Messages arrive either as armored text or, if the room is using a
+	 * binary transport (see RoomInterface::binary_transport), as raw
+	 * binary frames; both must be passed on unmodified.
+	 *
 	 * \param sender Clear text user name of the sender
 	 * \param text_message Encrypted message.
 	 */
 	void message_received(const std::string& sender, const std::string& text_message);
 
+	struct ReceivedMessage
+	{
+		std::string sender;
+		std::string text_message;
+	};
+
+	/**
+	 * Tell the library that a backlog of (n+1)sec messages has arrived.
+	 *
+	 * Equivalent to calling Room::message_received for each message in
+	 * order, but verifies the signatures of all conversation messages
+	 * in the backlog together, which takes less time than verifying
+	 * them one by one once the backlog holds more than one of them.
+	 */
+	void messages_received(const std::vector<ReceivedMessage>& messages);
+
 
 	/**
 	 * Indicate to the library a user has left.
+	 *
+	 * With a resume grace period set, the user is only removed if it does
+	 * not resume within that period.
 	 */
 	void user_left(const std::string& username);
 
+	/**
+	 * Thread-safe counterparts of Room::message_received and
+	 * Room::user_left, which may be called from any thread, including
+	 * concurrently, as long as the room exists.
+	 *
+	 * They only queue their input. When the queue becomes non-empty, the
+	 * RoomInterface::queue_ready callback is executed on the calling
+	 * thread, after which the room's own thread must call
+	 * Room::process_queue. Input queued from the same thread is processed
+	 * in the order it was queued.
+	 */
+	void queue_message_received(const std::string& sender, const std::string& text_message);
+	void queue_user_left(const std::string& username);
+
+	/**
+	 * Process all input queued so far, in order, as if it had been passed
+	 * to Room::message_received and Room::user_left directly. Must be
+	 * called from the thread that uses the room.
+	 */
+	void process_queue();
+
 	/**
 	 * TODO
 	 */
@@ -152,6 +328,16 @@ class Room
 		return m_interface;
 	}
 	
+	/* The hash suite for a conversation we create now. */
+	HashSuite conversation_hash_suite() const;
+	bool user_supports_hash_suite(const std::string& username, HashSuite suite) const;
+	
+	/*
+	 * With lazy authentication, start authenticating \p username, whom we
+	 * are about to share a conversation with. Does nothing otherwise.
+	 */
+	void request_user_authentication(const std::string& username);
+	
 	/* Operations */
 	void send_message(const Message& message);
 	void send_message(const std::string& message);
@@ -197,6 +383,43 @@ class Room
 	}
 
 	protected:
+	/*
+	 * Processes one message. If \p signature_valid is not null, it holds
+	 * the result of verifying the message's conversation signature.
+	 */
+	void handle_message(const std::string& sender, const std::string& text_message, const bool* signature_valid);
+	
+	/*
+	 * True if our transport is binary-safe and every user in the room
+	 * announced the same, in which case messages are sent unarmored.
+	 */
+	bool binary_transport() const;
+	std::string encode_message(const Message& message) const;
+	
+	/*
+	 * Matches an echo of our own message against the messages in flight.
+	 * Returns false if our message stream is broken.
+	 */
+	bool own_message_echoed(const std::string& text_message);
+	
+	struct User;
+	void answer_hello(const std::string& sender, const HelloMessage& message);
+	void answer_roster(const std::vector<HelloMessage::RosterEntry>& roster);
+	void authenticate_user(User& user, const Hash& authentication_confirmation);
+	Hash authentication_confirmation(const PublicKey& long_term_public_key, const PublicKey& ephemeral_public_key, const Hash& nonce) const;
+	std::vector<HelloMessage::RosterEntry> roster(const std::string& joiner) const;
+	
+	/*
+	 * Returns false if \p sender exceeded its Hello budget, in which case
+	 * the Hello is answered once the rate limit window ends.
+	 */
+	bool hello_rate_limit(const std::string& sender, const HelloMessage& message);
+	/*
+	 * Answers the Hello deferred during the window, or forgets the window
+	 * if \p sender has left the room since.
+	 */
+	void hello_rate_window_ended(const std::string& sender);
+	
 	void user_removed(const std::string& username);
 	void user_disconnected(const std::string& username);
 	
@@ -207,11 +430,41 @@ class Room
 	PrivateKey m_long_term_private_key;
 	PrivateKey m_ephemeral_private_key;
 	
-	std::deque<std::string> m_message_queue;
+	EchoQueue m_message_queue;
 	bool m_disconnecting;
 	Hash m_disconnect_nonce;
 	
 	bool m_debug_disable_fsck = false;
+	
+	CipherSuite m_preferred_cipher_suite;
+	HashSuite m_preferred_hash_suite;
+	bool m_blake2_hash_suite;
+	
+	InboundQueue m_inbound_queue;
+	// set while a RoomInterface::queue_ready is pending
+	std::atomic<bool> m_inbound_queue_ready;
+	
+	bool m_aggregated_join;
+	bool m_lazy_authentication;
+	
+	uint32_t m_resume_grace_period;
+	bool m_suspended;
+	std::chrono::steady_clock::time_point m_suspended_since;
+	// messages held back while suspended, or resuming
+	std::deque<std::string> m_suspended_messages;
+	// set from a resume until its resume message is echoed
+	bool m_resuming;
+	std::string m_resume_message;
+	/*
+	 * With a resume grace period, the messages in m_message_queue, kept so
+	 * that those lost with the link can be sent again.
+	 */
+	std::deque<std::string> m_unechoed_messages;
+	uint64_t m_resume_counter;
+	// users that left but may still resume
+	std::map<std::string, Timer> m_resume_timers;
+	// the nonce everyone uses to authenticate to us in aggregated joins
+	Hash m_hello_nonce;
 
 	struct User
 	{
@@ -219,10 +472,38 @@ class Room
 		PublicKey long_term_public_key;
 		PublicKey ephemeral_public_key;
 		bool authenticated;
+		// with lazy authentication, whether we started authenticating
+		bool authentication_requested;
+		// the nonce the user authenticates to us with
 		Hash authentication_nonce;
+		bool binary_transport;
+		bool blake2_hash_suite;
+		bool aggregated_join;
+		// the nonce we authenticate to the user with, in aggregated joins
+		Hash hello_nonce;
+		uint64_t resume_counter;
 	};
 	std::map<std::string, User> m_users;
 	
+	/*
+	 * Users we authenticated to in a RoomAuthenticationBatchMessage, based
+	 * on a roster, before they answered our Hello.
+	 */
+	std::map<std::string, HelloMessage::RosterEntry> m_roster_authentications;
+	
+	/*
+	 * Kept while the user is in the room, and until the window ends after
+	 * the user leaves, so reconnecting does not reset the budget.
+	 */
+	struct HelloRateLimit
+	{
+		std::chrono::steady_clock::time_point window_start;
+		unsigned int hellos = 0;
+		Timer deferred_timer;
+		HelloMessage deferred_hello;
+	};
+	std::map<std::string, HelloRateLimit> m_hello_rate_limits;
+	
 	ConversationList m_conversations;
 
 	/* Called before the message is processed. If the function returns false,
@@ -0,0 +1,433 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "roomhost.h"
+
+#include <cassert>
+
+namespace np1sec
+{
+
+/*
+ * The number of tasks a strand runs before it is queued again behind the
+ * other strands of its worker, so that a busy room cannot starve them.
+ */
+const size_t c_strand_batch_size = 64;
+
+struct HostedRoom::Strand
+{
+	std::mutex mutex;
+	std::condition_variable idle;
+	std::deque<std::function<void()>> tasks;
+	// queued on a worker or running
+	bool scheduled;
+	bool running;
+	std::thread::id running_thread;
+	bool closed;
+	// the worker the strand is queued on when it becomes runnable
+	size_t worker;
+};
+
+
+
+HostedRoom::HostedRoom(RoomHost* host, const std::string& channel, const std::string& username, const PrivateKey& private_key):
+	m_host(host),
+	m_channel(channel),
+	m_username(username),
+	m_strand(host->create_strand()),
+	m_closed(false),
+	m_room(this, username, private_key)
+{}
+
+HostedRoom::~HostedRoom()
+{
+	close();
+}
+
+void HostedRoom::post(std::function<void()> task)
+{
+	m_host->post(m_strand, std::move(task));
+}
+
+void HostedRoom::connect()
+{
+	post([this] {
+		m_host->add_room(this);
+		m_room.connect();
+	});
+}
+
+void HostedRoom::close()
+{
+	if (m_closed) {
+		return;
+	}
+	
+	/*
+	 * Once the strand is idle, no connect() task can register us again.
+	 */
+	m_host->close(m_strand);
+	m_host->remove_room(this);
+}
+
+void HostedRoom::send_message(const std::string& message)
+{
+	m_host->send_message(this, message);
+}
+
+TimerToken* HostedRoom::set_timer(uint32_t interval, TimerCallback* callback)
+{
+	return m_host->set_timer(m_strand, interval, callback);
+}
+
+void HostedRoom::queue_ready()
+{
+	post([this] { m_room.process_queue(); });
+}
+
+
+
+RoomHost::RoomHost(size_t threads):
+	m_next_worker(0),
+	m_runnable(0),
+	m_stopping(false),
+	m_next_timer_id(0),
+	m_timers_stopping(false)
+{
+	assert(threads > 0);
+	
+	for (size_t i = 0; i < threads; i++) {
+		m_workers.emplace_back(new Worker());
+	}
+	for (size_t i = 0; i < threads; i++) {
+		m_workers[i]->thread = std::thread([this, i] { run_worker(i); });
+	}
+	m_timer_thread = std::thread([this] { run_timers(); });
+}
+
+RoomHost::~RoomHost()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_timer_mutex);
+		m_timers_stopping = true;
+	}
+	m_timers_changed.notify_all();
+	m_timer_thread.join();
+	
+	{
+		std::unique_lock<std::mutex> lock(m_idle_mutex);
+		m_stopping = true;
+	}
+	m_work_available.notify_all();
+	for (std::unique_ptr<Worker>& worker : m_workers) {
+		worker->thread.join();
+	}
+	
+	for (const auto& i : m_timers) {
+		delete i.second;
+	}
+}
+
+size_t RoomHost::rooms(const std::string& channel) const
+{
+	std::unique_lock<std::mutex> lock(m_rooms_mutex);
+	auto it = m_channels.find(channel);
+	if (it == m_channels.end()) {
+		return 0;
+	}
+	return it->second.size();
+}
+
+void RoomHost::message_received(const std::string& channel, const std::string& sender, const std::string& message)
+{
+	std::unique_lock<std::mutex> lock(m_rooms_mutex);
+	auto it = m_channels.find(channel);
+	if (it == m_channels.end()) {
+		return;
+	}
+	for (HostedRoom* room : it->second) {
+		room->m_room.queue_message_received(sender, message);
+	}
+}
+
+void RoomHost::user_left(const std::string& channel, const std::string& username)
+{
+	std::unique_lock<std::mutex> lock(m_rooms_mutex);
+	auto it = m_channels.find(channel);
+	if (it == m_channels.end()) {
+		return;
+	}
+	for (HostedRoom* room : it->second) {
+		room->m_room.queue_user_left(username);
+	}
+}
+
+void RoomHost::add_room(HostedRoom* room)
+{
+	std::unique_lock<std::mutex> lock(m_rooms_mutex);
+	if (room->m_closed) {
+		return;
+	}
+	m_channels[room->channel()].insert(room);
+}
+
+void RoomHost::remove_room(HostedRoom* room)
+{
+	std::unique_lock<std::mutex> lock(m_rooms_mutex);
+	room->m_closed = true;
+	auto it = m_channels.find(room->channel());
+	if (it == m_channels.end()) {
+		return;
+	}
+	it->second.erase(room);
+	if (it->second.empty()) {
+		m_channels.erase(it);
+	}
+}
+
+/*
+ * With a transport, hosted rooms must see the channel in the transport's
+ * order, so they only get the message once the transport echoes it back;
+ * delivering it here as well would let local rooms see it before messages
+ * the transport ordered first. Without one, the channel is local to this
+ * host, and the rooms in it, the sender included, get the message through
+ * their inbound queues right away.
+ */
+void RoomHost::send_message(HostedRoom* room, const std::string& message)
+{
+	if (m_transport) {
+		m_transport(room->channel(), room->username(), message);
+	} else {
+		message_received(room->channel(), room->username(), message);
+	}
+}
+
+std::shared_ptr<RoomHost::Strand> RoomHost::create_strand()
+{
+	std::shared_ptr<Strand> strand = std::make_shared<Strand>();
+	strand->scheduled = false;
+	strand->running = false;
+	strand->closed = false;
+	
+	std::unique_lock<std::mutex> lock(m_idle_mutex);
+	strand->worker = m_next_worker;
+	m_next_worker = (m_next_worker + 1) % m_workers.size();
+	return strand;
+}
+
+void RoomHost::post(const std::shared_ptr<Strand>& strand, std::function<void()> task)
+{
+	{
+		std::unique_lock<std::mutex> lock(strand->mutex);
+		if (strand->closed) {
+			return;
+		}
+		strand->tasks.push_back(std::move(task));
+		if (strand->scheduled) {
+			return;
+		}
+		strand->scheduled = true;
+	}
+	schedule(strand);
+}
+
+void RoomHost::close(const std::shared_ptr<Strand>& strand)
+{
+	std::unique_lock<std::mutex> lock(strand->mutex);
+	assert(!(strand->running && strand->running_thread == std::this_thread::get_id()));
+	strand->closed = true;
+	strand->tasks.clear();
+	strand->idle.wait(lock, [&strand] { return !strand->running; });
+}
+
+void RoomHost::schedule(const std::shared_ptr<Strand>& strand)
+{
+	Worker& worker = *m_workers[strand->worker];
+	{
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		worker.strands.push_back(strand);
+	}
+	{
+		std::unique_lock<std::mutex> lock(m_idle_mutex);
+		m_runnable++;
+	}
+	m_work_available.notify_one();
+}
+
+/*
+ * Workers take strands from the front of their own queue and steal from
+ * the back of the others', where the strands that waited least are.
+ */
+std::shared_ptr<RoomHost::Strand> RoomHost::take_strand(size_t worker)
+{
+	std::shared_ptr<Strand> strand;
+	for (size_t i = 0; i < m_workers.size() && !strand; i++) {
+		Worker& victim = *m_workers[(worker + i) % m_workers.size()];
+		std::unique_lock<std::mutex> lock(victim.mutex);
+		if (victim.strands.empty()) {
+			continue;
+		}
+		if (i == 0) {
+			strand = std::move(victim.strands.front());
+			victim.strands.pop_front();
+		} else {
+			strand = std::move(victim.strands.back());
+			victim.strands.pop_back();
+		}
+	}
+	
+	if (strand) {
+		std::unique_lock<std::mutex> lock(m_idle_mutex);
+		m_runnable--;
+	}
+	return strand;
+}
+
+void RoomHost::run_strand(const std::shared_ptr<Strand>& strand, size_t worker)
+{
+	std::deque<std::function<void()>> tasks;
+	{
+		std::unique_lock<std::mutex> lock(strand->mutex);
+		if (strand->closed) {
+			strand->scheduled = false;
+			return;
+		}
+		while (!strand->tasks.empty() && tasks.size() < c_strand_batch_size) {
+			tasks.push_back(std::move(strand->tasks.front()));
+			strand->tasks.pop_front();
+		}
+		strand->running = true;
+		strand->running_thread = std::this_thread::get_id();
+	}
+	
+	for (std::function<void()>& task : tasks) {
+		task();
+	}
+	
+	bool reschedule;
+	{
+		std::unique_lock<std::mutex> lock(strand->mutex);
+		strand->running = false;
+		strand->worker = worker;
+		reschedule = !strand->closed && !strand->tasks.empty();
+		strand->scheduled = reschedule;
+		/*
+		 * Only a thread closing the strand waits for this.
+		 */
+		strand->idle.notify_all();
+	}
+	if (reschedule) {
+		schedule(strand);
+	}
+}
+
+void RoomHost::run_worker(size_t worker)
+{
+	while (true) {
+		std::shared_ptr<Strand> strand = take_strand(worker);
+		if (strand) {
+			run_strand(strand, worker);
+			continue;
+		}
+		
+		std::unique_lock<std::mutex> lock(m_idle_mutex);
+		m_work_available.wait(lock, [this] { return m_stopping || m_runnable > 0; });
+		if (m_stopping) {
+			return;
+		}
+	}
+}
+
+TimerToken* RoomHost::set_timer(const std::shared_ptr<Strand>& strand, uint32_t interval, TimerCallback* callback)
+{
+	HostTimer* timer = new HostTimer();
+	timer->host = this;
+	timer->strand = strand;
+	timer->callback = callback;
+	timer->fired = false;
+	
+	std::unique_lock<std::mutex> lock(m_timer_mutex);
+	timer->id = m_next_timer_id++;
+	timer->position = m_timer_queue.insert(std::make_pair(std::chrono::steady_clock::now() + std::chrono::milliseconds(interval), timer));
+	m_timers[timer->id] = timer;
+	if (timer->position == m_timer_queue.begin()) {
+		m_timers_changed.notify_one();
+	}
+	return timer;
+}
+
+void RoomHost::HostTimer::unset()
+{
+	host->unset_timer(this);
+}
+
+void RoomHost::unset_timer(HostTimer* timer)
+{
+	std::unique_lock<std::mutex> lock(m_timer_mutex);
+	if (!timer->fired) {
+		m_timer_queue.erase(timer->position);
+	}
+	m_timers.erase(timer->id);
+	delete timer;
+}
+
+/*
+ * Runs on the timer's strand. The timer may have been unset between firing
+ * and getting here, hence the lookup by id.
+ */
+void RoomHost::execute_timer(uint64_t id)
+{
+	TimerCallback* callback;
+	{
+		std::unique_lock<std::mutex> lock(m_timer_mutex);
+		auto it = m_timers.find(id);
+		if (it == m_timers.end()) {
+			return;
+		}
+		callback = it->second->callback;
+		delete it->second;
+		m_timers.erase(it);
+	}
+	callback->execute();
+}
+
+void RoomHost::run_timers()
+{
+	std::unique_lock<std::mutex> lock(m_timer_mutex);
+	while (!m_timers_stopping) {
+		if (m_timer_queue.empty()) {
+			m_timers_changed.wait(lock);
+			continue;
+		}
+		
+		auto next = m_timer_queue.begin();
+		if (next->first > std::chrono::steady_clock::now()) {
+			m_timers_changed.wait_until(lock, next->first);
+			continue;
+		}
+		
+		HostTimer* timer = next->second;
+		m_timer_queue.erase(next);
+		timer->fired = true;
+		uint64_t id = timer->id;
+		post(timer->strand, [this, id] { execute_timer(id); });
+	}
+}
+
+} // namespace np1sec
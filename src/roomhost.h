@@ -0,0 +1,254 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef SRC_ROOMHOST_H_
+#define SRC_ROOMHOST_H_
+
+#include "room.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace np1sec
+{
+
+class RoomHost;
+
+/**
+ * A Room run by a RoomHost, which provides its timers, runs it on a
+ * strand and carries the messages it sends.
+ *
+ * Derive from this class and implement the remaining RoomInterface
+ * callbacks. All callbacks are executed on the room's strand: never
+ * concurrently, but not necessarily on the same worker thread each time.
+ */
+class HostedRoom : public RoomInterface
+{
+	public:
+	/**
+	 * Create a room for \p username in the communication channel named
+	 * \p channel. Once connected, hosted rooms in the same channel receive
+	 * each other's messages directly.
+	 */
+	HostedRoom(RoomHost* host, const std::string& channel, const std::string& username, const PrivateKey& private_key);
+	~HostedRoom();
+	
+	HostedRoom(const HostedRoom&) = delete;
+	HostedRoom& operator=(const HostedRoom&) = delete;
+	
+	/**
+	 * The room itself. It may only be used from tasks run through
+	 * HostedRoom::post and from the RoomInterface callbacks.
+	 */
+	Room& room()
+	{
+		return m_room;
+	}
+	
+	const std::string& channel() const
+	{
+		return m_channel;
+	}
+	
+	const std::string& username() const
+	{
+		return m_username;
+	}
+	
+	/**
+	 * Run \p task on the room's strand. May be called from any thread.
+	 */
+	void post(std::function<void()> task);
+	
+	/**
+	 * Start receiving the messages of the channel and call Room::connect,
+	 * on the room's strand. May be called from any thread, once.
+	 */
+	void connect();
+	
+	/**
+	 * Stop running the room: tasks that have not started yet are dropped,
+	 * and no callbacks are executed after this returns. Must not be called
+	 * from the room's strand. Derived classes whose callbacks use their own
+	 * members must call this in their destructor.
+	 */
+	void close();
+	
+	/*
+	 * RoomInterface operations, implemented by the host
+	 */
+	void send_message(const std::string& message) override;
+	TimerToken* set_timer(uint32_t interval, TimerCallback* callback) override;
+	void queue_ready() override;
+	
+	protected:
+	struct Strand;
+	
+	RoomHost* m_host;
+	std::string m_channel;
+	std::string m_username;
+	std::shared_ptr<Strand> m_strand;
+	// set by RoomHost::remove_room, under its rooms mutex
+	bool m_closed;
+	Room m_room;
+	
+	friend class RoomHost;
+};
+
+/**
+ * Runs any number of hosted rooms on a fixed set of worker threads.
+ *
+ * Each room runs on a strand, so that the room itself stays single
+ * threaded. Runnable strands are queued on the worker that last ran them;
+ * workers that run out of strands steal them from the other workers, so
+ * that the rooms sharing a worker with a busy room are moved elsewhere.
+ */
+class RoomHost
+{
+	public:
+	typedef std::function<void(const std::string& channel, const std::string& sender, const std::string& message)> Transport;
+	
+	explicit RoomHost(size_t threads);
+	
+	/**
+	 * All hosted rooms must be closed before the host is destroyed.
+	 */
+	~RoomHost();
+	
+	RoomHost(const RoomHost&) = delete;
+	RoomHost& operator=(const RoomHost&) = delete;
+	
+	size_t threads() const
+	{
+		return m_workers.size();
+	}
+	
+	/**
+	 * The number of connected hosted rooms in \p channel.
+	 */
+	size_t rooms(const std::string& channel) const;
+	
+	/**
+	 * Set the function that carries messages sent by hosted rooms to the
+	 * channel. It is called on the sending room's strand. The transport
+	 * must echo every message, including those of hosted rooms, back
+	 * through message_received, in the order of the channel; hosted rooms
+	 * only see their own and each other's messages that way. Without a
+	 * transport, hosted rooms in a channel deliver to each other directly.
+	 * Must be set before any room connects.
+	 */
+	void set_transport(Transport transport)
+	{
+		m_transport = std::move(transport);
+	}
+	
+	/**
+	 * Deliver a message from outside this host to every hosted room in
+	 * \p channel. May be called from any thread; see
+	 * Room::queue_message_received for the ordering guarantees.
+	 */
+	void message_received(const std::string& channel, const std::string& sender, const std::string& message);
+	
+	/**
+	 * Tell every hosted room in \p channel that a user outside this host
+	 * has left. May be called from any thread.
+	 */
+	void user_left(const std::string& channel, const std::string& username);
+	
+	protected:
+	typedef HostedRoom::Strand Strand;
+	
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<std::shared_ptr<Strand>> strands;
+		std::thread thread;
+	};
+	
+	class HostTimer final : public TimerToken
+	{
+		public:
+		void unset() override;
+		
+		RoomHost* host;
+		uint64_t id;
+		std::shared_ptr<Strand> strand;
+		TimerCallback* callback;
+		bool fired;
+		std::multimap<std::chrono::steady_clock::time_point, HostTimer*>::iterator position;
+	};
+	
+	/* Rooms */
+	void add_room(HostedRoom* room);
+	void remove_room(HostedRoom* room);
+	void send_message(HostedRoom* room, const std::string& message);
+	
+	/* Strands */
+	std::shared_ptr<Strand> create_strand();
+	void post(const std::shared_ptr<Strand>& strand, std::function<void()> task);
+	void close(const std::shared_ptr<Strand>& strand);
+	void schedule(const std::shared_ptr<Strand>& strand);
+	std::shared_ptr<Strand> take_strand(size_t worker);
+	void run_strand(const std::shared_ptr<Strand>& strand, size_t worker);
+	void run_worker(size_t worker);
+	
+	/* Timers */
+	TimerToken* set_timer(const std::shared_ptr<Strand>& strand, uint32_t interval, TimerCallback* callback);
+	void unset_timer(HostTimer* timer);
+	void execute_timer(uint64_t id);
+	void run_timers();
+	
+	protected:
+	Transport m_transport;
+	
+	mutable std::mutex m_rooms_mutex;
+	std::map<std::string, std::set<HostedRoom*>> m_channels;
+	
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	size_t m_next_worker;
+	std::mutex m_idle_mutex;
+	std::condition_variable m_work_available;
+	// strands queued on any worker
+	size_t m_runnable;
+	bool m_stopping;
+	
+	std::mutex m_timer_mutex;
+	std::condition_variable m_timers_changed;
+	std::multimap<std::chrono::steady_clock::time_point, HostTimer*> m_timer_queue;
+	// every timer not yet executed or unset, including fired ones
+	std::map<uint64_t, HostTimer*> m_timers;
+	uint64_t m_next_timer_id;
+	bool m_timers_stopping;
+	std::thread m_timer_thread;
+	
+	friend class HostedRoom;
+};
+
+} // namespace np1sec
+
+#endif
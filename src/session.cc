@@ -23,10 +23,10 @@
 namespace np1sec
 {
 
-Session::Session(Conversation* conversation, const Hash& key_id, const std::vector<KeyExchange::AcceptedUser>& users, const SymmetricKey& symmetric_key, const PrivateKey& private_key):
+Session::Session(Conversation* conversation, const Hash& key_id, const std::vector<KeyExchange::AcceptedUser>& users, const SymmetricKey& symmetric_key, CipherSuite cipher_suite, const PrivateKey& private_key):
 	m_conversation(conversation),
 	m_key_id(key_id),
-	m_symmetric_key(symmetric_key),
+	m_cipher(symmetric_key, cipher_suite),
 	m_private_key(private_key),
 	m_signature_id(1)
 {
@@ -38,6 +38,14 @@ Session::Session(Conversation* conversation, const Hash& key_id, const std::vect
 		participant.signature_id = 1;
 		m_participants[user.username] = std::move(participant);
 	}
+	
+	m_counter_iv = true;
+	m_iv_salt = iv_salt(symmetric_key, m_conversation->room()->username());
+	for (const auto& i : m_participants) {
+		if (i.first != m_conversation->room()->username() && iv_salt(symmetric_key, i.first) == m_iv_salt) {
+			m_counter_iv = false;
+		}
+	}
 }
 
 void Session::send_message(const std::string& message)
@@ -48,7 +56,7 @@ void Session::send_message(const std::string& message)
 	
 	std::string signed_payload = PlaintextChatMessage::sign(payload, m_private_key);
 	
-	ChatMessage encrypted = ChatMessage::encrypt(signed_payload, m_key_id, m_symmetric_key);
+	ChatMessage encrypted = ChatMessage::encrypt(signed_payload, m_key_id, &m_cipher, next_iv(payload.message_id));
 	
 	m_conversation->send_message(encrypted.encode());
 }
@@ -58,7 +66,7 @@ void Session::decrypt_message(const std::string& sender, const ChatMessage& encr
 	assert(m_participants.count(sender));
 	
 	try {
-		std::string decrypted_payload = encrypted_message.decrypt(m_symmetric_key);
+		std::string decrypted_payload = encrypted_message.decrypt(&m_cipher);
 		
 		PlaintextChatMessage payload = PlaintextChatMessage::decode(decrypted_payload);
 		
@@ -75,4 +83,31 @@ void Session::decrypt_message(const std::string& sender, const ChatMessage& encr
 	} catch(MessageFormatException) {}
 }
 
+ByteArray<Session::c_iv_salt_length> Session::iv_salt(const SymmetricKey& symmetric_key, const std::string& username)
+{
+	HashBuilder builder(true);
+	builder.update(symmetric_key.key);
+	builder.update(std::string("iv-salt"));
+	builder.update(username);
+	Hash hash = builder.final();
+	
+	return ByteArray<c_iv_salt_length>(hash.buffer);
+}
+
+InitializationVector Session::next_iv(uint64_t message_id)
+{
+	static_assert(c_iv_salt_length + sizeof(message_id) == c_cipher_iv_length, "IV layout does not match the IV length");
+	
+	if (!m_counter_iv) {
+		return crypto::nonce<c_cipher_iv_length>();
+	}
+	
+	InitializationVector iv;
+	memcpy(iv.buffer, m_iv_salt.buffer, c_iv_salt_length);
+	for (size_t i = 0; i < sizeof(message_id); i++) {
+		iv.buffer[c_iv_salt_length + i] = uint8_t(message_id >> (8 * (sizeof(message_id) - 1 - i)));
+	}
+	return iv;
+}
+
 } // namespace np1sec
@@ -32,11 +32,22 @@ class Conversation;
 class Session
 {
 	public:
-	Session(Conversation* conversation, const Hash& key_id, const std::vector<KeyExchange::AcceptedUser>& users, const SymmetricKey& symmetric_key, const PrivateKey& private_key);
+	static const size_t c_iv_salt_length = 4;
+	
+	Session(Conversation* conversation, const Hash& key_id, const std::vector<KeyExchange::AcceptedUser>& users, const SymmetricKey& symmetric_key, CipherSuite cipher_suite, const PrivateKey& private_key);
 	
 	void send_message(const std::string& message);
 	void decrypt_message(const std::string& sender, const ChatMessage& encrypted_message);
 	
+	CipherSuite cipher_suite() const
+	{
+		return m_cipher.suite();
+	}
+	
+	protected:
+	static ByteArray<c_iv_salt_length> iv_salt(const SymmetricKey& symmetric_key, const std::string& username);
+	InitializationVector next_iv(uint64_t message_id);
+	
 	protected:
 	struct Participant
 	{
@@ -49,9 +60,16 @@ class Session
 	Conversation* m_conversation;
 	Hash m_key_id;
 	std::map<std::string, Participant> m_participants;
-	SymmetricKey m_symmetric_key;
+	Cipher m_cipher;
 	PrivateKey m_private_key;
 	uint64_t m_signature_id;
+	/*
+	 * Chat messages are encrypted under the IV salt || message_id, where the
+	 * salt is derived from the session key and the sender's username. If our
+	 * salt collides with another participant's, we fall back to random IVs.
+	 */
+	bool m_counter_iv;
+	ByteArray<c_iv_salt_length> m_iv_salt;
 };
 
 } // namespace np1sec
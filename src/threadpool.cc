@@ -0,0 +1,143 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace np1sec
+{
+
+ThreadPool::ThreadPool(size_t threads):
+	m_thread_count(threads),
+	m_stopping(false)
+{}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_work_available.notify_all();
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& function)
+{
+	struct Batch
+	{
+		const std::function<void(size_t)>* function;
+		size_t count;
+		std::atomic<size_t> next;
+		std::vector<std::exception_ptr> exceptions;
+		
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t finished;
+		
+		/* Runs items until none are left. */
+		void work()
+		{
+			size_t completed = 0;
+			for (size_t i = next++; i < count; i = next++) {
+				try {
+					(*function)(i);
+				} catch(...) {
+					exceptions[i] = std::current_exception();
+				}
+				completed++;
+			}
+			if (completed > 0) {
+				std::unique_lock<std::mutex> lock(mutex);
+				finished += completed;
+				if (finished == count) {
+					done.notify_all();
+				}
+			}
+		}
+	};
+	
+	if (count == 0) {
+		return;
+	}
+	
+	std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+	batch->function = &function;
+	batch->count = count;
+	batch->next = 0;
+	batch->exceptions.resize(count);
+	batch->finished = 0;
+	
+	size_t helpers = std::min(count - 1, m_thread_count);
+	if (helpers > 0) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_threads.size() < m_thread_count) {
+				m_threads.emplace_back([this] { run(); });
+			}
+			for (size_t i = 0; i < helpers; i++) {
+				m_work.push_back([batch] { batch->work(); });
+			}
+		}
+		m_work_available.notify_all();
+	}
+	
+	batch->work();
+	
+	{
+		std::unique_lock<std::mutex> lock(batch->mutex);
+		batch->done.wait(lock, [&batch] { return batch->finished == batch->count; });
+	}
+	
+	for (const std::exception_ptr& exception : batch->exceptions) {
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+}
+
+ThreadPool& ThreadPool::instance()
+{
+	static ThreadPool pool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+	return pool;
+}
+
+void ThreadPool::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_work_available.wait(lock, [this] { return m_stopping || !m_work.empty(); });
+		if (m_stopping) {
+			return;
+		}
+		
+		std::function<void()> work = std::move(m_work.front());
+		m_work.pop_front();
+		lock.unlock();
+		work();
+		lock.lock();
+	}
+}
+
+} // namespace np1sec
@@ -0,0 +1,77 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_THREADPOOL_H_
+#define SRC_THREADPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace np1sec
+{
+
+/*
+ * A fixed set of worker threads for CPU-bound work that can be split
+ * into independent pieces, such as the Diffie-Hellman computations of a
+ * key exchange. The workers are started on first use.
+ */
+class ThreadPool
+{
+	public:
+	explicit ThreadPool(size_t threads);
+	~ThreadPool();
+	
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	
+	/*
+	 * Call function(i) for every i in [0, count), spread over the workers
+	 * and the calling thread, and return once all calls have finished.
+	 * Each call must write only its own results, so the outcome does not
+	 * depend on scheduling. If any calls throw, the exception of the
+	 * lowest such i is rethrown.
+	 */
+	void parallel_for(size_t count, const std::function<void(size_t)>& function);
+	
+	size_t threads() const
+	{
+		return m_thread_count;
+	}
+	
+	/** The process-wide pool used by the library, one worker per additional core */
+	static ThreadPool& instance();
+	
+	protected:
+	void run();
+	
+	protected:
+	size_t m_thread_count;
+	std::mutex m_mutex;
+	std::condition_variable m_work_available;
+	std::deque<std::function<void()>> m_work;
+	bool m_stopping;
+	std::vector<std::thread> m_threads;
+};
+
+} // namespace np1sec
+
+#endif
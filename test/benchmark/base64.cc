@@ -0,0 +1,169 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Measures base64 throughput of every implementation this CPU supports, over
+ * a range of message sizes. Before timing anything, the implementations are
+ * checked against the scalar one for identical output and identical rejection
+ * of malformed input; the benchmark exits with an error if they disagree.
+ *
+ * Usage: base64_benchmark [megabytes per measurement]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/base64.h"
+
+using namespace np1sec;
+
+static const char* implementation_name(Base64Implementation implementation)
+{
+	switch (implementation) {
+		case Base64Implementation::Scalar: return "scalar";
+		case Base64Implementation::SSE2: return "sse2";
+		case Base64Implementation::AVX2: return "avx2";
+	}
+	return "unknown";
+}
+
+static std::string random_bytes(std::mt19937& random, size_t size)
+{
+	std::string result(size, 0);
+	for (size_t i = 0; i < size; i++) {
+		result[i] = char(random());
+	}
+	return result;
+}
+
+static std::string encode(const std::string& data)
+{
+	std::string result;
+	base64_encode(&result, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+	return result;
+}
+
+static bool check(Base64Implementation implementation)
+{
+	std::mt19937 random(1);
+	for (size_t size = 0; size < 600; size++) {
+		for (int round = 0; round < 8; round++) {
+			std::string data = random_bytes(random, size);
+			
+			debug_set_base64_implementation(Base64Implementation::Scalar);
+			std::string expected = encode(data);
+			debug_set_base64_implementation(implementation);
+			std::string encoded = encode(data);
+			if (encoded != expected) {
+				fprintf(stderr, "%s: encoding mismatch at size %zu\n", implementation_name(implementation), size);
+				return false;
+			}
+			
+			std::string decoded;
+			if (!base64_decode(&decoded, encoded.data(), encoded.size()) || decoded != data) {
+				fprintf(stderr, "%s: decoding mismatch at size %zu\n", implementation_name(implementation), size);
+				return false;
+			}
+			
+			if (encoded.empty()) {
+				continue;
+			}
+			std::string corrupted = encoded;
+			corrupted[random() % corrupted.size()] = char(random());
+			debug_set_base64_implementation(Base64Implementation::Scalar);
+			bool expected_valid = base64_decode(&decoded, corrupted.data(), corrupted.size());
+			std::string expected_decoded = decoded;
+			debug_set_base64_implementation(implementation);
+			bool valid = base64_decode(&decoded, corrupted.data(), corrupted.size());
+			if (valid != expected_valid || (valid && decoded != expected_decoded)) {
+				fprintf(stderr, "%s: validation mismatch at size %zu\n", implementation_name(implementation), size);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void measure(Base64Implementation implementation, size_t size, size_t total)
+{
+	std::mt19937 random(2);
+	std::string data = random_bytes(random, size);
+	std::string encoded = encode(data);
+	size_t iterations = total / size + 1;
+	
+	debug_set_base64_implementation(implementation);
+	
+	std::string output;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; i++) {
+		output.clear();
+		base64_encode(&output, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+	}
+	auto middle = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; i++) {
+		if (!base64_decode(&output, encoded.data(), encoded.size())) {
+			abort();
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	
+	double megabytes = double(iterations) * size / (1024 * 1024);
+	double encode_seconds = std::chrono::duration<double>(middle - start).count();
+	double decode_seconds = std::chrono::duration<double>(end - middle).count();
+	printf("%-8s %8zu %12.1f %12.1f\n",
+		implementation_name(implementation),
+		size,
+		megabytes / encode_seconds,
+		megabytes / decode_seconds
+	);
+}
+
+int main(int argc, char** argv)
+{
+	size_t total = 256;
+	if (argc > 1) {
+		total = strtoul(argv[1], nullptr, 10);
+	}
+	total *= 1024 * 1024;
+	
+	std::vector<Base64Implementation> implementations;
+	for (Base64Implementation implementation : { Base64Implementation::Scalar, Base64Implementation::SSE2, Base64Implementation::AVX2 }) {
+		if (base64_implementation_supported(implementation)) {
+			implementations.push_back(implementation);
+		}
+	}
+	
+	for (Base64Implementation implementation : implementations) {
+		if (!check(implementation)) {
+			return 1;
+		}
+	}
+	
+	printf("%-8s %8s %12s %12s\n", "impl", "bytes", "encode MB/s", "decode MB/s");
+	for (size_t size : { 64, 256, 1024, 16384, 262144 }) {
+		for (Base64Implementation implementation : implementations) {
+			measure(implementation, size, total);
+		}
+	}
+	
+	return 0;
+}
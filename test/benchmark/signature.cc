@@ -0,0 +1,133 @@
+/**
+ * (n+1)Sec Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Compares verifying a backlog of signatures one at a time through
+ * crypto::verify with verifying it through crypto::verify_batch, over a
+ * range of backlog sizes. The signatures come from a handful of keys, like
+ * the conversation messages of a chat backlog. Before timing anything, the
+ * two are checked to give the same verdicts, including for tampered
+ * signatures; the benchmark exits with an error if they disagree.
+ *
+ * Usage: signature_benchmark [rounds per measurement]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/crypto.h"
+
+using namespace np1sec;
+
+static const size_t c_payload_size = 200;
+static const size_t c_key_count = 4;
+
+static std::vector<crypto::SignatureVerification> make_batch(std::mt19937& random, const std::vector<PrivateKey>& keys, size_t size)
+{
+	std::vector<crypto::SignatureVerification> batch;
+	for (size_t i = 0; i < size; i++) {
+		const PrivateKey& key = keys[random() % keys.size()];
+		crypto::SignatureVerification item;
+		item.payload.resize(c_payload_size);
+		for (char& c : item.payload) {
+			c = char(random());
+		}
+		item.signature = crypto::sign(item.payload, key);
+		item.public_key = key.public_key();
+		batch.push_back(item);
+	}
+	return batch;
+}
+
+static bool check(std::mt19937& random, const std::vector<PrivateKey>& keys)
+{
+	for (size_t round = 0; round < 16; round++) {
+		std::vector<crypto::SignatureVerification> batch = make_batch(random, keys, 16);
+		for (crypto::SignatureVerification& item : batch) {
+			if (random() % 3 == 0) {
+				item.signature.buffer[random() % sizeof(item.signature.buffer)] ^= 0x01;
+			}
+		}
+		
+		std::vector<bool> results = crypto::verify_batch(batch);
+		for (size_t i = 0; i < batch.size(); i++) {
+			if (results[i] != crypto::verify(batch[i].payload, batch[i].signature, batch[i].public_key)) {
+				fprintf(stderr, "verdict mismatch\n");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void measure(std::mt19937& random, const std::vector<PrivateKey>& keys, size_t size, size_t rounds)
+{
+	std::vector<crypto::SignatureVerification> batch = make_batch(random, keys, size);
+	
+	auto start = std::chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++) {
+		for (const crypto::SignatureVerification& item : batch) {
+			if (!crypto::verify(item.payload, item.signature, item.public_key)) {
+				abort();
+			}
+		}
+	}
+	auto middle = std::chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++) {
+		for (bool result : crypto::verify_batch(batch)) {
+			if (!result) {
+				abort();
+			}
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	
+	double count = double(rounds) * size;
+	double individual = std::chrono::duration<double, std::micro>(middle - start).count() / count;
+	double batched = std::chrono::duration<double, std::micro>(end - middle).count() / count;
+	printf("%8zu %14.1f %14.1f %8.2f\n", size, individual, batched, individual / batched);
+}
+
+int main(int argc, char** argv)
+{
+	size_t rounds = 8;
+	if (argc > 1) {
+		rounds = strtoul(argv[1], nullptr, 10);
+	}
+	
+	std::mt19937 random(1);
+	std::vector<PrivateKey> keys;
+	for (size_t i = 0; i < c_key_count; i++) {
+		keys.push_back(PrivateKey::generate(true));
+	}
+	
+	if (!check(random, keys)) {
+		return 1;
+	}
+	
+	printf("%8s %14s %14s %8s\n", "batch", "verify us/sig", "batch us/sig", "speedup");
+	for (size_t size : { 1, 2, 4, 16, 64, 256 }) {
+		measure(random, keys, size, rounds);
+	}
+	
+	return 0;
+}
@@ -60,7 +60,9 @@ struct ConvImpl : public np1sec::ConversationInterface {
     }
 
     ~ConvImpl() {
-        np1sec_conv->leave(false);
+        if (np1sec_conv) {
+            np1sec_conv->leave(false);
+        }
     }
 
     std::string my_username;
@@ -88,6 +90,10 @@ public:
     ConvImpl* get_impl() { return _impl.get(); }
     np1sec::Conversation* get_np1sec_conv() { return _impl->np1sec_conv; }
 
+    // The room frees its conversations when it disconnects; forget ours
+    // beforehand so that destroying this wrapper does not touch it.
+    void detach() { _impl->np1sec_conv = nullptr; }
+
     void invite(const std::string& user, const np1sec::PublicKey& pubkey)
     {
         _impl->np1sec_conv->invite(user, pubkey);
@@ -25,7 +25,8 @@
 #include "conv.h"
 #include "client.h"
 
-struct RoomImpl : public np1sec::RoomInterface {
+struct RoomImpl : public np1sec::RoomInterface
+                , public std::enable_shared_from_this<RoomImpl> {
     using tcp = boost::asio::ip::tcp;
     using error_code = boost::system::error_code;
 
@@ -42,6 +43,13 @@ struct RoomImpl : public np1sec::RoomInterface {
     Pipe<std::string, np1sec::PublicKey> _user_joined_pipe;
     Pipe<> _disconnect_pipe;
     bool _enable_message_logging = false;
+    bool _binary_transport = false;
+    size_t _binary_frames_received = 0;
+    /* While the link is cut, frames in both directions are lost, but
+     * inbound ones are kept if the transport can resume its stream. */
+    bool _link_cut = false;
+    bool _keep_inbound = false;
+    std::vector<std::pair<std::string, std::string>> _kept_inbound;
 
 	/* Called before the message is processed. If the function returns false,
 	 * the message won't be processed. It is used for debugging and testing. */
@@ -54,8 +62,7 @@ struct RoomImpl : public np1sec::RoomInterface {
     RoomImpl(boost::asio::io_service& ios, std::string name)
         : _name(std::move(name))
         , _client(std::make_shared<Client>(ios, [=] (std::string name, std::string msg) {
-                        using std::move;
-                        _np1sec_room.message_received(name , msg);
+                        frame_received(name, msg);
                     }))
         , _private_key(np1sec::PrivateKey::generate(true))
         , _np1sec_room(this, _name, _private_key)
@@ -102,16 +109,47 @@ struct RoomImpl : public np1sec::RoomInterface {
         return _client->get_io_service();
     }
 
+    void frame_received(const std::string& name, const std::string& msg)
+    {
+        if (_link_cut) {
+            if (_keep_inbound) {
+                _kept_inbound.emplace_back(name, msg);
+            }
+            return;
+        }
+        if (!msg.empty() && msg[0] == '\0') {
+            ++_binary_frames_received;
+        }
+        _np1sec_room.message_received(name, msg);
+    }
+
     void send_message(const std::string& msg) override
     {
+        if (_link_cut) {
+            return;
+        }
         _client->send_message(_name, msg);
     }
 
+    bool binary_transport() const override
+    {
+        return _binary_transport;
+    }
+
     np1sec::TimerToken* set_timer(uint32_t ms, np1sec::TimerCallback* cb) override
     {
         return _timers.create(get_io_service(), ms, cb);
     }
 
+    void queue_ready() override
+    {
+        get_io_service().post([w = std::weak_ptr<RoomImpl>(shared_from_this())] {
+                if (auto self = w.lock()) {
+                    self->_np1sec_room.process_queue();
+                }
+            });
+    }
+
     void connected() override
     {
         _connect_pipe.apply();
@@ -128,6 +166,21 @@ struct RoomImpl : public np1sec::RoomInterface {
         _user_joined_pipe.apply(name, pubkey);
     }
 
+    void user_joined(const std::string& name, const np1sec::PublicKey& pubkey, np1sec::UserPresence presence) override
+    {
+        /*
+         * With lazy room authentication, users are invited as soon as they
+         * are present; the invitation gets them authenticated.
+         */
+        if (_np1sec_room.lazy_authentication()) {
+            if (presence == np1sec::UserPresence::Unauthenticated) {
+                _user_joined_pipe.apply(name, pubkey);
+            }
+        } else if (presence == np1sec::UserPresence::Authenticated) {
+            user_joined(name, pubkey);
+        }
+    }
+
     void user_left(const std::string&, const np1sec::PublicKey&) override
     {
         //std::cout << _name << " TODO: user_left" << std::endl;
@@ -201,6 +254,40 @@ public:
         _impl->_enable_message_logging = enable;
     }
 
+    /* Must be called before connecting. */
+    void set_binary_transport(bool enable) {
+        _impl->_binary_transport = enable;
+    }
+
+    size_t binary_frames_received() const {
+        return _impl->_binary_frames_received;
+    }
+
+    /*
+     * Cut the link to the server: frames in both directions are lost,
+     * except that with \p keep_inbound, those sent to us are delivered
+     * once the link is restored, as by a transport that resumes its stream.
+     */
+    void cut_link(bool keep_inbound) {
+        _impl->_link_cut = true;
+        _impl->_keep_inbound = keep_inbound;
+    }
+
+    /*
+     * Restore the link, call \p restored, and then deliver the frames
+     * kept while it was cut.
+     */
+    template<class F>
+    void restore_link(F&& restored) {
+        _impl->_link_cut = false;
+        restored();
+        auto kept = std::move(_impl->_kept_inbound);
+        _impl->_kept_inbound.clear();
+        for (const auto& frame : kept) {
+            _impl->frame_received(frame.first, frame.second);
+        }
+    }
+
     bool stopped() const {
         return _impl->_client->stopped();
     }
@@ -232,6 +319,11 @@ public:
         _impl->connect(ep, std::forward<H>(h));
     }
 
+    template<class H>
+    void on_connected(H&& h) {
+        _impl->_connect_pipe.schedule(*_ios, std::forward<H>(h));
+    }
+
     template<class H>
     void disconnect_room(H&& h) {
         _impl->_disconnect_pipe.schedule(*_ios, std::forward<H>(h));
@@ -20,9 +20,17 @@
 #include <boost/test/unit_test.hpp>
 
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <random>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include "echo_server.h"
 #include "room.h"
+#include "src/keyexchange.h"
+#include "src/roomhost.h"
+#include <gcrypt.h>
 
 using error_code = boost::system::error_code;
 using std::move;
@@ -224,7 +232,8 @@ std::function<void()> create_session(io_service& ios,
                                      size_t client_count,
                                      tcp::endpoint server_ep,
                                      InviteStrategy invite_strategy,
-                                     std::function<void(std::vector<User>)>&& handler)
+                                     std::function<void(std::vector<User>)>&& handler,
+                                     std::function<void(Room&, size_t)> configure_room = nullptr)
 {
     auto result = make_shared<std::vector<User>>();
 
@@ -241,6 +250,10 @@ std::function<void()> create_session(io_service& ios,
     for (size_t i = 0; i < client_count; ++i) {
         auto r = make_shared<Room>(ios, str("user", i));
 
+        if (configure_room) {
+            configure_room(*r, i);
+        }
+
         rooms.push_back(r);
         //r->enable_message_logging();
 
@@ -453,7 +466,8 @@ BOOST_AUTO_TEST_CASE(test_session_join_order)
 }
 
 //------------------------------------------------------------------------------
-template<class H> void test_with_session(size_t user_count, H&& h) {
+template<class H> void test_with_session(size_t user_count, H&& h,
+                                         std::function<void(Room&, size_t)> configure_room = nullptr) {
     using Users = std::vector<User>;
 
     io_service ios;
@@ -482,14 +496,16 @@ template<class H> void test_with_session(size_t user_count, H&& h) {
                 BOOST_CHECK_EQUAL(new_users.size(), user_count);
                 users = move(new_users);
                 h(server, users, finish);
-            });
+            },
+            configure_room);
 
     ios.run();
 
     BOOST_CHECK(callback_called);
 }
 
-template<class H> void test_with_session_each_user(size_t user_count, H&& h) {
+template<class H> void test_with_session_each_user(size_t user_count, H&& h,
+                                                   std::function<void(Room&, size_t)> configure_room = nullptr) {
     using Users = std::vector<User>;
 
     test_with_session(user_count, [=] (EchoServer&, Users& users, auto finish) {
@@ -500,7 +516,7 @@ template<class H> void test_with_session_each_user(size_t user_count, H&& h) {
         for (auto& user : users) {
             h(user, on_finish_one);
         }
-    });
+    }, configure_room);
 }
 
 //------------------------------------------------------------------------------
@@ -603,6 +619,1063 @@ BOOST_AUTO_TEST_CASE(test_randomized_message_exchange)
     });
 }
 
+//------------------------------------------------------------------------------
+/*
+ * Every user sends one message and waits for everyone else's, checking
+ * whether any binary frames arrived meanwhile.
+ */
+void test_transport_message_exchange(size_t user_count,
+                                     std::function<bool(size_t)> binary_transport,
+                                     bool expect_binary_frames)
+{
+    test_with_session_each_user(user_count, [=] (User& user, auto finish) {
+        auto binary_frames = user.room.binary_frames_received();
+
+        user.conv.send_chat(str("Message from ", user.name()));
+
+        async_loop([=, &user] (unsigned int i, auto cont) {
+            if (i == user_count) {
+                BOOST_CHECK_EQUAL(user.room.binary_frames_received() > binary_frames, expect_binary_frames);
+                return finish();
+            }
+
+            user.conv.receive_chat([=] (const std::string& source, const std::string& msg) {
+                BOOST_CHECK_EQUAL(msg, str("Message from ", source));
+                return cont();
+            });
+        });
+    },
+    [=] (Room& room, size_t i) {
+        room.set_binary_transport(binary_transport(i));
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_binary_transport_message_exchange)
+{
+    test_transport_message_exchange(4, [] (size_t) { return true; }, true);
+}
+
+BOOST_AUTO_TEST_CASE(test_mixed_transport_message_exchange)
+{
+    /*
+     * Only some of the users have a binary-safe transport, so everyone has
+     * to stick to the text armor.
+     */
+    test_transport_message_exchange(4, [] (size_t i) { return i % 2 == 0; }, false);
+}
+
+void test_configured_message_exchange(size_t user_count,
+                                      std::function<void(Room&, size_t)> configure_room,
+                                      std::function<void(User&)> check_user = nullptr)
+{
+    test_with_session_each_user(user_count, [=] (User& user, auto finish) {
+        user.conv.send_chat(str("Message from ", user.name()));
+
+        async_loop([=, &user] (unsigned int i, auto cont) {
+            if (i == user_count) {
+                if (check_user) {
+                    check_user(user);
+                }
+                return finish();
+            }
+
+            user.conv.receive_chat([=] (const std::string& source, const std::string& msg) {
+                BOOST_CHECK_EQUAL(msg, str("Message from ", source));
+                return cont();
+            });
+        });
+    },
+    configure_room);
+}
+
+std::function<void(User&)> check_cipher_suite(np1sec::CipherSuite suite)
+{
+    return [=] (User& user) {
+        auto& chat = user.conv.get_np1sec_conv()->m_encrypted_chat;
+        BOOST_CHECK(chat.session_cipher_suite(chat.latest_session_id()) == suite);
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_chacha20_poly1305_message_exchange)
+{
+    test_configured_message_exchange(4, [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_preferred_cipher_suite(np1sec::CipherSuite::ChaCha20Poly1305);
+    },
+    check_cipher_suite(np1sec::CipherSuite::ChaCha20Poly1305));
+}
+
+BOOST_AUTO_TEST_CASE(test_aes256_gcm_message_exchange)
+{
+    test_configured_message_exchange(4, [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_preferred_cipher_suite(np1sec::CipherSuite::Aes256Gcm);
+    },
+    check_cipher_suite(np1sec::CipherSuite::Aes256Gcm));
+}
+
+BOOST_AUTO_TEST_CASE(test_mixed_cipher_suite_message_exchange)
+{
+    /*
+     * One user lacks hardware AES, so everyone has to agree on
+     * ChaCha20-Poly1305 for the session.
+     */
+    test_configured_message_exchange(4, [] (Room& room, size_t i) {
+        room.get_np1sec_room()->set_preferred_cipher_suite(
+            i == 0 ? np1sec::CipherSuite::ChaCha20Poly1305 : np1sec::CipherSuite::Aes256Gcm);
+    },
+    check_cipher_suite(np1sec::CipherSuite::ChaCha20Poly1305));
+}
+
+BOOST_AUTO_TEST_CASE(test_key_exchange_state_keeps_cipher_suite)
+{
+    /*
+     * A joiner rebuilds in-flight key exchanges from the conversation
+     * status; the suites already announced must survive that, or the
+     * joiner would pick a different cipher than everyone else.
+     */
+    np1sec::Hash key_hash = np1sec::crypto::hash("key");
+    np1sec::AcceptanceKeyExchangeState state;
+    state.key_id = np1sec::crypto::hash("key id");
+    for (const char* username : { "alice", "bob" }) {
+        np1sec::AcceptanceParticipant participant;
+        participant.username = username;
+        participant.long_term_public_key = np1sec::PrivateKey::generate(true).public_key();
+        participant.ephemeral_public_key = np1sec::PrivateKey::generate(true).public_key();
+        participant.secret_share = np1sec::crypto::hash(username);
+        participant.has_key_hash = participant.username == "alice";
+        participant.key_hash = key_hash;
+        participant.cipher_suite = np1sec::CipherSuite::ChaCha20Poly1305;
+        state.participants.push_back(participant);
+    }
+
+    np1sec::KeyExchange exchange(state.encode(), np1sec::HashSuite::Sha256);
+    np1sec::KeyExchange rebuilt(exchange.encode(), np1sec::HashSuite::Sha256);
+    rebuilt.set_key_hash("bob", key_hash, np1sec::CipherSuite::Aes256Gcm);
+    BOOST_REQUIRE(rebuilt.state() == np1sec::KeyExchange::State::KeyAccepted);
+    BOOST_CHECK(rebuilt.cipher_suite() == np1sec::CipherSuite::ChaCha20Poly1305);
+}
+
+std::function<void(User&)> check_hash_suite(np1sec::HashSuite suite)
+{
+    return [=] (User& user) {
+        BOOST_CHECK(user.conv.get_np1sec_conv()->hash_suite() == suite);
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_blake2_hash_suite_message_exchange)
+{
+    test_configured_message_exchange(4, [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_preferred_hash_suite(np1sec::HashSuite::Blake2b);
+    },
+    check_hash_suite(np1sec::HashSuite::Blake2b));
+}
+
+BOOST_AUTO_TEST_CASE(test_mixed_hash_suite_conversations)
+{
+    /*
+     * Conversations fall back to SHA-256 when their creator, or any user
+     * in the room, lacks BLAKE2b, even if everyone asks for BLAKE2b. Only
+     * user0 lacks it: it creates the first conversation, and is in the
+     * room when user2 creates another one.
+     */
+    test_with_session(3, [] (EchoServer&, std::vector<User>& users, auto finish) {
+        for (auto& user : users) {
+            check_hash_suite(np1sec::HashSuite::Sha256)(user);
+        }
+
+        users[2].room.create_conversation([=] (Conv conv) {
+            BOOST_CHECK(conv.get_np1sec_conv()->hash_suite() == np1sec::HashSuite::Sha256);
+            finish();
+        });
+    },
+    [] (Room& room, size_t i) {
+        room.get_np1sec_room()->set_preferred_hash_suite(np1sec::HashSuite::Blake2b);
+        room.get_np1sec_room()->set_blake2_hash_suite(i != 0);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_mixed_room_authentication_message_exchange)
+{
+    /*
+     * Users that do not take part in aggregated joins must still be
+     * authenticated by, and to, those who do.
+     */
+    test_configured_message_exchange(4, [] (Room& room, size_t i) {
+        room.get_np1sec_room()->set_aggregated_join(i % 2 == 0);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_lazy_room_authentication_message_exchange)
+{
+    /*
+     * Users are invited while still unauthenticated in the room, and get
+     * authenticated on the way into the conversation.
+     */
+    test_configured_message_exchange(3, [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_lazy_authentication(true);
+    },
+    [] (User& user) {
+        auto room = user.room.get_np1sec_room();
+        for (const auto& participant : user.conv.get_np1sec_conv()->participants()) {
+            BOOST_CHECK(participant == user.name() || room->users().count(participant));
+        }
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_after_transient_disconnect)
+{
+    /*
+     * A user whose link drops for a moment, and whose transport resumes
+     * the stream, gets everything sent to it while away; what it sent as
+     * the link dropped is lost, and must be sent again. The others keep it
+     * in the conversation, and everyone sees the chat in the same order.
+     */
+    test_with_session(3, [] (EchoServer&, std::vector<User>& users, auto finish) {
+        User& away = users[1];
+        std::string away_name = away.name();
+
+        away.room.cut_link(true);
+        away.conv.send_chat("Message from away");
+        away.room.get_np1sec_room()->suspend();
+        for (auto& user : users) {
+            if (&user != &away) {
+                user.room.get_np1sec_room()->user_left(away_name);
+            }
+        }
+        users[0].conv.send_chat("Message while away");
+
+        auto received = on_nth_invocation(users.size(), finish);
+
+        for (auto& user : users) {
+            user.conv.receive_chat([=, &user, &users, &away] (const std::string& source, const std::string& msg) {
+                BOOST_CHECK_EQUAL(source, users[0].name());
+                BOOST_CHECK_EQUAL(msg, "Message while away");
+
+                if (&user == &users[2]) {
+                    away.room.restore_link([&away] {
+                        away.room.get_np1sec_room()->resume(true);
+                    });
+                }
+
+                user.conv.receive_chat([=, &user] (const std::string& source, const std::string& msg) {
+                    BOOST_CHECK_EQUAL(source, away_name);
+                    BOOST_CHECK_EQUAL(msg, "Message from away");
+                    BOOST_CHECK(user.conv.get_np1sec_conv()->participants().count(away_name));
+                    received();
+                });
+            });
+        }
+    },
+    [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_resume_grace_period(10000);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_reconnect_after_lossy_disconnect)
+{
+    /*
+     * A user whose link drops, losing frames both ways, cannot tell what
+     * it missed. It must reconnect rather than resume, and leave the
+     * conversation it can no longer follow.
+     */
+    test_with_session(3, [] (EchoServer&, std::vector<User>& users, auto finish) {
+        User& away = users[1];
+        std::string away_name = away.name();
+
+        away.room.cut_link(false);
+        away.conv.send_chat("Message from away");
+        away.room.get_np1sec_room()->suspend();
+        for (auto& user : users) {
+            if (&user != &away) {
+                user.room.get_np1sec_room()->user_left(away_name);
+            }
+        }
+        users[0].conv.send_chat("Message while away");
+
+        auto done = on_nth_invocation(2, finish);
+
+        users[2].conv.receive_chat([=, &users, &away] (const std::string& source, const std::string& msg) {
+            BOOST_CHECK_EQUAL(source, users[0].name());
+            BOOST_CHECK_EQUAL(msg, "Message while away");
+
+            away.room.on_connected([=, &away] {
+                BOOST_CHECK(away.room.get_np1sec_room()->conversations().empty());
+                done();
+            });
+            away.conv.detach();
+            away.room.restore_link([&away] {
+                away.room.get_np1sec_room()->resume(false);
+            });
+        });
+
+        users[2].conv.wait_for_user_to_leave([=] (const std::string& username) {
+            BOOST_CHECK_EQUAL(username, away_name);
+            done();
+        });
+    },
+    [] (Room& room, size_t) {
+        room.get_np1sec_room()->set_resume_grace_period(10000);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_queued_input_from_many_threads)
+{
+    /*
+     * Several threads hammer a room's inbound queue at once. Everything
+     * must be processed on the room's own thread, with each thread's
+     * messages in the order it queued them.
+     */
+    test_with_session(2, [] (EchoServer&, std::vector<User>& users, auto finish) {
+        const size_t producer_count = 4;
+        const uint64_t message_count = 1000;
+
+        User& user = users[0];
+        auto room_thread = std::this_thread::get_id();
+        auto producers = make_shared<std::vector<std::thread>>();
+        auto next_counters = make_shared<std::map<std::string, uint64_t>>();
+
+        auto received = on_nth_invocation(producer_count * message_count, [=] {
+            for (auto& producer : *producers) {
+                producer.join();
+            }
+            finish();
+        });
+
+        user.room.set_inbound_message_filter([=] (const std::string& sender, const np1sec::Message& msg) {
+            if (sender.compare(0, 8, "producer") != 0) {
+                return true;
+            }
+            BOOST_CHECK(std::this_thread::get_id() == room_thread);
+
+            auto quit = np1sec::QuitMessage::decode(msg);
+            uint64_t counter = 0;
+            for (size_t i = 0; i < sizeof(counter); i++) {
+                counter = (counter << 8) | quit.nonce.buffer[i];
+            }
+            BOOST_CHECK_EQUAL(counter, (*next_counters)[sender]++);
+            received();
+            return false;
+        });
+
+        for (size_t p = 0; p < producer_count; p++) {
+            producers->emplace_back([=, room = user.room.get_np1sec_room()] {
+                std::string sender = str("producer", p);
+
+                for (uint64_t counter = 0; counter < message_count; counter++) {
+                    np1sec::QuitMessage quit;
+                    for (size_t i = 0; i < sizeof(quit.nonce.buffer); i++) {
+                        quit.nonce.buffer[i] = 0;
+                    }
+                    for (size_t i = 0; i < sizeof(counter); i++) {
+                        quit.nonce.buffer[i] = (counter >> (8 * (sizeof(counter) - 1 - i))) & 0xff;
+                    }
+                    room->queue_message_received(sender, quit.encode().encode());
+                }
+            });
+        }
+    });
+}
+
+/* A hosted room that records who joined */
+struct HostedUser : np1sec::HostedRoom {
+    std::mutex& mutex;
+    std::condition_variable& changed;
+    bool is_connected = false;
+    std::map<std::string, PublicKey> joined;
+
+    HostedUser(np1sec::RoomHost* host, const std::string& name, std::mutex& mutex, std::condition_variable& changed,
+               const np1sec::PrivateKey& private_key = np1sec::PrivateKey::generate(true))
+        : np1sec::HostedRoom(host, "channel", name, private_key)
+        , mutex(mutex)
+        , changed(changed)
+    {}
+
+    ~HostedUser() { close(); }
+
+    void connected() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        is_connected = true;
+        changed.notify_all();
+    }
+    void disconnected() override {}
+    void user_left(const std::string&, const PublicKey&) override {}
+
+    void user_joined(const std::string& name, const PublicKey& public_key) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        joined[name] = public_key;
+        changed.notify_all();
+    }
+
+    np1sec::ConversationInterface* created_conversation(np1sec::Conversation*) override { return nullptr; }
+    np1sec::ConversationInterface* invited_to_conversation(np1sec::Conversation*, const std::string&) override { return nullptr; }
+};
+
+BOOST_AUTO_TEST_CASE(test_room_host_local_channel)
+{
+    /*
+     * Rooms sharing a RoomHost with no transport reach each other through
+     * the host's local fan-out and get their timers from it.
+     */
+    const size_t user_count = 4;
+
+    np1sec::RoomHost host(2);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<HostedUser>> users;
+    for (size_t i = 0; i < user_count; i++) {
+        users.emplace_back(new HostedUser(&host, str("user", i), mutex, changed));
+    }
+    for (auto& user : users) {
+        user->connect();
+    }
+
+    auto everyone_joined = [&] {
+        for (auto& user : users) {
+            for (auto& other : users) {
+                if (&other != &user && !user->joined.count(other->username())) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        BOOST_CHECK(changed.wait_for(lock, 30s, everyone_joined));
+    }
+
+    for (auto& user : users) {
+        user->close();
+    }
+}
+
+/*
+ * A transport that echoes each sender's messages in order, but interleaves
+ * different senders at random, so that messages overtake the ones hosted
+ * rooms sent before them.
+ */
+struct ReorderingTransport {
+    np1sec::RoomHost& host;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::string, std::deque<std::pair<std::string, std::string>>> pending;
+    bool stopping = false;
+    std::thread thread;
+
+    explicit ReorderingTransport(np1sec::RoomHost& host) : host(host) {
+        host.set_transport([this] (const std::string& channel, const std::string& sender, const std::string& message) {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending[sender].emplace_back(channel, message);
+            changed.notify_all();
+        });
+        thread = std::thread([this] { run(); });
+    }
+
+    ~ReorderingTransport() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+
+    void run() {
+        std::mt19937 rng(std::random_device{}());
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) {
+                return;
+            }
+
+            // let concurrent sends pile up
+            lock.unlock();
+            std::this_thread::sleep_for(1ms);
+            lock.lock();
+
+            auto it = pending.begin();
+            std::advance(it, rng() % pending.size());
+            std::string sender = it->first;
+            auto message = std::move(it->second.front());
+            it->second.pop_front();
+            if (it->second.empty()) {
+                pending.erase(it);
+            }
+
+            lock.unlock();
+            host.message_received(message.first, sender, message.second);
+            lock.lock();
+        }
+    }
+};
+
+/* A hosted room that joins the conversations it is invited to, and records their chat */
+struct HostedChatUser : HostedUser {
+    struct Chat : np1sec::ConversationInterface {
+        HostedChatUser& user;
+
+        explicit Chat(HostedChatUser& user) : user(user) {}
+
+        void user_invited(const std::string&, const std::string&) override {}
+        void invitation_cancelled(const std::string&, const std::string&) override {}
+        void user_authenticated(const std::string&, const PublicKey&) override {}
+        void user_authentication_failed(const std::string&) override {}
+        void user_joined(const std::string&) override {}
+        void user_left(const std::string&) override { user.update(); }
+        void votekick_registered(const std::string&, const std::string&, bool) override {}
+        void user_joined_chat(const std::string&) override { user.update(); }
+        void joined() override {}
+        void joined_chat() override { user.update(); }
+        void left() override {}
+
+        void message_received(const std::string& sender, const std::string& message) override {
+            std::unique_lock<std::mutex> lock(user.mutex);
+            user.messages.push_back(str(sender, ": ", message));
+            user.changed.notify_all();
+        }
+    };
+
+    Chat chat{*this};
+    np1sec::Conversation* conversation = nullptr;
+    size_t chat_size = 0;
+    std::vector<std::string> messages;
+
+    using HostedUser::HostedUser;
+
+    ~HostedChatUser() { close(); }
+
+    // on the room's strand
+    void update() {
+        size_t size = 0;
+        for (const auto& participant : conversation->participants()) {
+            if (participant == username() ? conversation->in_chat() : conversation->participant_in_chat(participant)) {
+                size++;
+            }
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        chat_size = size;
+        changed.notify_all();
+    }
+
+    np1sec::ConversationInterface* created_conversation(np1sec::Conversation* created) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        conversation = created;
+        changed.notify_all();
+        return &chat;
+    }
+
+    np1sec::ConversationInterface* invited_to_conversation(np1sec::Conversation* invitation, const std::string&) override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            conversation = invitation;
+        }
+        post([this] { conversation->join(); });
+        return &chat;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_room_host_transport_order)
+{
+    /*
+     * With a transport, hosted rooms must see the channel in the order the
+     * transport echoes it, not in the order they sent to it. If they did
+     * not, they would disagree about the conversation and its chat.
+     */
+    const size_t user_count = 3;
+
+    np1sec::RoomHost host(2);
+    ReorderingTransport transport(host);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<HostedChatUser>> users;
+    for (size_t i = 0; i < user_count; i++) {
+        users.emplace_back(new HostedChatUser(&host, str("user", i), mutex, changed));
+    }
+    for (auto& user : users) {
+        user->connect();
+    }
+
+    auto wait_for_everyone = [&] (std::function<bool(HostedChatUser&)> predicate) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, 30s, [&] {
+            for (auto& user : users) {
+                if (!predicate(*user)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    };
+
+    BOOST_REQUIRE(wait_for_everyone([&] (HostedChatUser& user) {
+        return user.joined.size() == user_count - 1;
+    }));
+
+    HostedChatUser& creator = *users[0];
+    creator.post([&] { creator.room().create_conversation(); });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        BOOST_REQUIRE(changed.wait_for(lock, 30s, [&] { return creator.conversation != nullptr; }));
+    }
+    creator.post([&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::map<std::string, PublicKey> invitees = creator.joined;
+        lock.unlock();
+        for (const auto& invitee : invitees) {
+            creator.conversation->invite(invitee.first, invitee.second);
+        }
+    });
+
+    BOOST_REQUIRE(wait_for_everyone([&] (HostedChatUser& user) {
+        return user.chat_size == user_count;
+    }));
+
+    for (auto& user : users) {
+        user->post([user = user.get()] { user->conversation->send_chat(str("Message from ", user->username())); });
+    }
+
+    BOOST_REQUIRE(wait_for_everyone([&] (HostedChatUser& user) {
+        return user.messages.size() == user_count;
+    }));
+    for (auto& user : users) {
+        BOOST_CHECK(user->messages == users[0]->messages);
+    }
+
+    for (auto& user : users) {
+        user->close();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_room_host_close_after_connect)
+{
+    /*
+     * Closing a room while its connect task may be running must leave
+     * nothing of it behind in the host's channel.
+     */
+    np1sec::RoomHost host(2);
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    for (size_t i = 0; i < 50; i++) {
+        HostedUser user(&host, str("user", i), mutex, changed);
+        user.connect();
+        user.close();
+        BOOST_CHECK_EQUAL(host.rooms("channel"), 0u);
+    }
+
+    host.message_received("channel", "outsider", "message");
+    BOOST_CHECK_EQUAL(host.rooms("channel"), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_room_host_roster_slices)
+{
+    /*
+     * A user joining more aggregated members than fit in one roster slice
+     * gets the roster from several members, and must still authenticate
+     * to, and be authenticated by, every one of them.
+     */
+    const size_t member_count = 20;
+    const size_t slice_size = 16; // c_roster_slice_size
+
+    np1sec::RoomHost host(2);
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    std::map<std::string, size_t> slices;
+    host.set_transport([&] (const std::string& channel, const std::string& sender, const std::string& encoded) {
+        host.message_received(channel, sender, encoded);
+
+        np1sec::HelloMessage hello;
+        try {
+            np1sec::Message message = np1sec::Message::decode(encoded);
+            if (message.type != np1sec::Message::Type::Hello) {
+                return;
+            }
+            hello = np1sec::HelloMessage::decode(message);
+        } catch (np1sec::MessageFormatException) {
+            return;
+        }
+        if (hello.reply && hello.reply_to_username == "joiner" && !hello.roster.empty()) {
+            std::unique_lock<std::mutex> lock(mutex);
+            slices[sender] = hello.roster.size();
+        }
+    });
+
+    std::vector<std::unique_ptr<HostedUser>> users;
+    auto everyone_joined = [&] {
+        for (auto& user : users) {
+            for (auto& other : users) {
+                if (&other != &user && !user->joined.count(other->username())) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    for (size_t i = 0; i <= member_count; i++) {
+        std::string name = i < member_count ? str("member", i) : std::string("joiner");
+        users.emplace_back(new HostedUser(&host, name, mutex, changed));
+        users.back()->connect();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        BOOST_REQUIRE(changed.wait_for(lock, 30s, everyone_joined));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t listed = 0;
+        for (const auto& slice : slices) {
+            BOOST_CHECK(slice.second < slice_size);
+            listed += slice.second;
+        }
+        BOOST_CHECK_EQUAL(slices.size(), (member_count + slice_size - 1) / slice_size);
+        BOOST_CHECK_EQUAL(listed, member_count - slices.size());
+    }
+
+    for (auto& user : users) {
+        user->close();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_room_host_hello_rate_limit)
+{
+    /*
+     * A user that reconnects with new keys more often than the Hello rate
+     * limit allows only gets its latest Hello answered, once the rate
+     * window is over, and must then be authenticated with its latest keys.
+     */
+    const size_t reconnect_count = 7; // more than c_hello_rate_limit
+
+    np1sec::RoomHost host(2);
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    HostedUser observer(&host, "observer", mutex, changed);
+    observer.connect();
+
+    std::vector<std::unique_ptr<HostedUser>> flappers;
+    np1sec::PrivateKey latest_key;
+    for (size_t i = 0; i < reconnect_count; i++) {
+        if (!flappers.empty()) {
+            flappers.back()->close();
+        }
+        latest_key = np1sec::PrivateKey::generate(true);
+        flappers.emplace_back(new HostedUser(&host, "flapper", mutex, changed, latest_key));
+        flappers.back()->connect();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        BOOST_REQUIRE(changed.wait_for(lock, 30s, [&] {
+            return flappers.back()->is_connected && (i > 0 || observer.joined.count("flapper"));
+        }));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        BOOST_CHECK(changed.wait_for(lock, 30s, [&] {
+            return flappers.back()->joined.count("observer")
+                && observer.joined.at("flapper") == latest_key.public_key();
+        }));
+    }
+
+    /*
+     * Once the flapper is gone and its window is over, the observer must
+     * not keep any state about it.
+     */
+    flappers.back()->close();
+    host.user_left("channel", "flapper");
+    auto deadline = Clock::now() + 30s;
+    bool forgotten = false;
+    while (!forgotten && Clock::now() < deadline) {
+        std::this_thread::sleep_for(100ms);
+        std::unique_lock<std::mutex> lock(mutex);
+        bool checked = false;
+        observer.post([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            forgotten = observer.room().m_hello_rate_limits.empty()
+                && observer.room().m_roster_authentications.empty();
+            checked = true;
+            changed.notify_all();
+        });
+        changed.wait(lock, [&] { return checked; });
+    }
+    BOOST_CHECK(forgotten);
+
+    observer.close();
+}
+
+/*
+ * Ed25519 signatures made with hand-picked scalars, so that R or A can be
+ * given a small-order component. The cofactored equation accepts those,
+ * and the batch verifier must agree with verify() about them.
+ */
+class TorsionSigner {
+public:
+    TorsionSigner() {
+        BOOST_REQUIRE(!gcry_mpi_ec_new(&_context, NULL, "Ed25519"));
+        _order = gcry_mpi_ec_get_mpi("n", _context, 1);
+        _base = gcry_mpi_ec_get_point("g", _context, 1);
+
+        /* (0, -1) has order 2 */
+        gcry_mpi_t p = gcry_mpi_ec_get_mpi("p", _context, 1);
+        gcry_mpi_t x = gcry_mpi_set_ui(NULL, 0);
+        gcry_mpi_t y = gcry_mpi_new(0);
+        gcry_mpi_t one = gcry_mpi_set_ui(NULL, 1);
+        gcry_mpi_sub_ui(y, p, 1);
+        _torsion = gcry_mpi_point_set(NULL, x, y, one);
+        gcry_mpi_release(one);
+        gcry_mpi_release(y);
+        gcry_mpi_release(x);
+        gcry_mpi_release(p);
+    }
+
+    ~TorsionSigner() {
+        gcry_mpi_point_release(_torsion);
+        gcry_mpi_point_release(_base);
+        gcry_mpi_release(_order);
+        gcry_ctx_release(_context);
+    }
+
+    np1sec::crypto::SignatureVerification sign(const std::string& payload, bool torsion_r, bool torsion_a) {
+        gcry_mpi_t a = random_scalar();
+        gcry_mpi_t r = random_scalar();
+
+        gcry_mpi_point_t a_point = multiply_base(a, torsion_a);
+        gcry_mpi_point_t r_point = multiply_base(r, torsion_r);
+        std::string a_encoded = encode_point(a_point);
+        std::string r_encoded = encode_point(r_point);
+
+        unsigned char digest[64];
+        std::string hashed = r_encoded + a_encoded + payload;
+        gcry_md_hash_buffer(GCRY_MD_SHA512, digest, hashed.data(), hashed.size());
+        gcry_mpi_t k = scan_le(std::string(reinterpret_cast<char*>(digest), sizeof(digest)));
+        gcry_mpi_mod(k, k, _order);
+
+        gcry_mpi_t s = gcry_mpi_new(0);
+        gcry_mpi_mulm(s, k, a, _order);
+        gcry_mpi_addm(s, s, r, _order);
+        std::string signature = r_encoded + print_le(s, 32);
+
+        np1sec::crypto::SignatureVerification result;
+        result.payload = payload;
+        result.signature = np1sec::Signature(reinterpret_cast<const uint8_t*>(signature.data()));
+        result.public_key = PublicKey(reinterpret_cast<const uint8_t*>(a_encoded.data()));
+
+        gcry_mpi_release(s);
+        gcry_mpi_release(k);
+        gcry_mpi_point_release(r_point);
+        gcry_mpi_point_release(a_point);
+        gcry_mpi_release(r);
+        gcry_mpi_release(a);
+        return result;
+    }
+
+private:
+    gcry_mpi_t random_scalar() {
+        gcry_mpi_t result = gcry_mpi_new(256);
+        gcry_mpi_randomize(result, 256, GCRY_STRONG_RANDOM);
+        gcry_mpi_mod(result, result, _order);
+        return result;
+    }
+
+    gcry_mpi_point_t multiply_base(gcry_mpi_t scalar, bool torsion) {
+        gcry_mpi_point_t result = gcry_mpi_point_new(0);
+        gcry_mpi_ec_mul(result, scalar, _base, _context);
+        if (torsion) {
+            gcry_mpi_point_t sum = gcry_mpi_point_new(0);
+            gcry_mpi_ec_add(sum, result, _torsion, _context);
+            gcry_mpi_point_release(result);
+            result = sum;
+        }
+        return result;
+    }
+
+    static std::string print_le(gcry_mpi_t number, size_t size) {
+        unsigned char buffer[64];
+        size_t written;
+        BOOST_REQUIRE(!gcry_mpi_print(GCRYMPI_FMT_USG, buffer, sizeof(buffer), &written, number));
+        std::string result(reinterpret_cast<char*>(buffer), written);
+        result.insert(0, size - written, '\0');
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    static gcry_mpi_t scan_le(std::string buffer) {
+        std::reverse(buffer.begin(), buffer.end());
+        gcry_mpi_t result;
+        BOOST_REQUIRE(!gcry_mpi_scan(&result, GCRYMPI_FMT_USG, buffer.data(), buffer.size(), NULL));
+        return result;
+    }
+
+    std::string encode_point(gcry_mpi_point_t point) {
+        gcry_mpi_t x = gcry_mpi_new(0);
+        gcry_mpi_t y = gcry_mpi_new(0);
+        BOOST_REQUIRE(!gcry_mpi_ec_get_affine(x, y, point, _context));
+        std::string result = print_le(y, 32);
+        if (gcry_mpi_test_bit(x, 0)) {
+            result[31] |= 0x80;
+        }
+        gcry_mpi_release(y);
+        gcry_mpi_release(x);
+        return result;
+    }
+
+    gcry_ctx_t _context;
+    gcry_mpi_t _order;
+    gcry_mpi_point_t _base;
+    gcry_mpi_point_t _torsion;
+};
+
+BOOST_AUTO_TEST_CASE(test_batch_signature_verification)
+{
+    /*
+     * Batches with repeated keys, tampered signatures and signatures with
+     * small-order components must get exactly the verdicts of verify().
+     */
+    using np1sec::crypto::SignatureVerification;
+
+    std::mt19937 random{std::random_device()()};
+    std::vector<np1sec::PrivateKey> keys;
+    for (size_t i = 0; i < 4; i++) {
+        keys.push_back(np1sec::PrivateKey::generate(true));
+    }
+
+    TorsionSigner torsion_signer;
+    for (int torsion = 0; torsion < 3; torsion++) {
+        auto item = torsion_signer.sign("plain", torsion == 1, torsion == 2);
+        BOOST_REQUIRE(np1sec::crypto::verify(item.payload, item.signature, item.public_key));
+    }
+
+    size_t rejected = 0;
+    for (size_t round = 0; round < 20; round++) {
+        std::vector<SignatureVerification> batch;
+
+        for (size_t i = 0; i < 16; i++) {
+            const np1sec::PrivateKey& key = keys[random() % keys.size()];
+            SignatureVerification item;
+            item.payload = str("Message #", round, ".", i);
+            item.signature = np1sec::crypto::sign(item.payload, key);
+            item.public_key = key.public_key();
+
+            if (random() % 3 == 0) {
+                if (random() % 2) {
+                    item.payload[random() % item.payload.size()] ^= 0x01;
+                } else {
+                    item.signature.buffer[random() % sizeof(item.signature.buffer)] ^= 0x01;
+                }
+            }
+            batch.push_back(item);
+        }
+
+        for (size_t i = 0; i < 2; i++) {
+            batch.insert(batch.begin() + random() % batch.size(), torsion_signer.sign(str("R #", round, ".", i), true, false));
+            batch.insert(batch.begin() + random() % batch.size(), torsion_signer.sign(str("A #", round, ".", i), false, true));
+        }
+
+        std::vector<bool> results = np1sec::crypto::verify_batch(batch);
+        BOOST_REQUIRE_EQUAL(results.size(), batch.size());
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            bool expected = np1sec::crypto::verify(batch[i].payload, batch[i].signature, batch[i].public_key);
+            BOOST_CHECK_EQUAL(results[i], expected);
+            if (!expected) {
+                rejected++;
+            }
+        }
+    }
+    BOOST_CHECK(rejected > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_backlog_message_exchange)
+{
+    /*
+     * A user that gets the chat as one backlog, with forged copies mixed
+     * in, through Room::messages_received, must see exactly the genuine
+     * messages, in order.
+     */
+    test_with_session(3, [] (EchoServer&, std::vector<User>& users, auto finish) {
+        const size_t message_count = 8;
+        const size_t sender_count = users.size() - 1;
+
+        User& late = users[1];
+        auto backlog = make_shared<std::vector<np1sec::Room::ReceivedMessage>>();
+        auto held = make_shared<size_t>(0);
+        auto replaying = make_shared<bool>(false);
+
+        late.room.set_inbound_message_filter([=, &late] (const std::string& sender, const np1sec::Message& msg) {
+            if (*replaying || sender == late.name() || msg.type != np1sec::Message::Type::Chat) {
+                return true;
+            }
+
+            backlog->push_back({sender, msg.encode()});
+            if (*held % 3 == 0) {
+                np1sec::Message forged = msg;
+                forged.payload[forged.payload.size() / 2] ^= 0x01;
+                backlog->push_back({sender, forged.encode()});
+            }
+
+            if (++*held == sender_count * message_count) {
+                late.room.get_io_service().post([=, &late] {
+                    *replaying = true;
+                    late.room.get_np1sec_room()->messages_received(*backlog);
+                });
+            }
+            return false;
+        });
+
+        for (auto& user : users) {
+            if (&user == &late) continue;
+            for (size_t i = 0; i < message_count; i++) {
+                user.conv.send_chat(str("Message #", i));
+            }
+        }
+
+        auto next_message = make_shared<std::map<std::string, size_t>>();
+        async_loop([=, &late] (unsigned int i, auto cont) {
+            if (i == sender_count * message_count) {
+                return finish();
+            }
+
+            late.conv.receive_chat([=] (const std::string& source, const std::string& msg) {
+                BOOST_CHECK_EQUAL(msg, str("Message #", (*next_message)[source]++));
+                cont();
+            });
+        });
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_unrelated_conversation_traffic_dropped)
+{
+    /*
+     * A room member outside the conversation should discard its traffic
+     * without verifying it.
+     */
+    test_with_session(2, [] (EchoServer& server, std::vector<User>& users, auto finish) {
+        auto outsider = make_shared<Room>(server.get_io_service(), "outsider");
+
+        outsider->connect(server.local_endpoint(), [=, &users] (error_code ec) {
+            BOOST_CHECK(!ec);
+
+            for (auto& user : users) {
+                user.conv.send_chat(str("Message from ", user.name()));
+            }
+
+            size_t expected = users.size();
+            async_loop([=] (unsigned int i, auto cont) {
+                if (outsider->get_np1sec_room()->dropped_messages() >= expected) {
+                    outsider->stop();
+                    return finish();
+                }
+                BOOST_REQUIRE(i < 500);
+                wait(10ms, outsider->get_io_service(), cont);
+            });
+        });
+    });
+}
+
 //------------------------------------------------------------------------------
 
 BOOST_AUTO_TEST_CASE(test_ddos_hello)